@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 /* OpenCL includes */
 #include <CL/cl.h>
@@ -9,23 +11,1038 @@
 /* Utility functions */
 #include "utils.h"
 #include "bmp-utils.h"
+#include "options.h"
+#include "runtime.h"
+#include "profiler.h"
+#include "host-memory.h"
+#include "bmp-stream.h"
 #include "gold.h"
+#include "gold-parallel.h"
+#include "autotune.h"
+#include "command-graph.h"
 
 static const int HIST_BINS = 256; 
 
+/* Largest int image the streaming mode reads as a whole to verify its
+ * result */
+static const size_t maxReferenceBytes = (size_t)1 << 30;
+
+/* Copy 8-bit pixel values into a byte array, a quarter of the size of
+ * the int array readBmp returns. The array is page-aligned so that a
+ * zero-copy buffer can use it in place. */
+static unsigned char* packPixels(const int *pixels, int numPixels)
+{
+   unsigned char *packed = (unsigned char*)alignedAlloc(numPixels);
+   int i;
+   for (i = 0; i < numPixels; i++) {
+      packed[i] = (unsigned char)pixels[i];
+   }
+   return packed;
+}
+
+/* Choose how many sub-histograms each work-group of histogramPacked
+ * keeps: up to 8, as long as they use at most half the local memory */
+static int histogramCopies(cl_device_id device)
+{
+   cl_ulong localMemSize;
+   int copies = 8;
+   check(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, 
+      sizeof(cl_ulong), &localMemSize, NULL));
+   while (copies > 1 && 
+          copies*HIST_BINS*sizeof(int) > localMemSize/2) {
+      copies /= 2;
+   }
+   return copies;
+}
+
+/* Size the NDRange of histogramPacked from the device and the input
+ * length. A few work-groups per compute unit keep the device busy; more
+ * would only add merges into the global histogram. A configuration stored
+ * by --autotune replaces these defaults. Every work-item gets at least
+ * one 16-pixel vector. */
+static void packedWorkSize(cl_kernel kernel, cl_device_id device,
+   int numData, size_t *globalWorkSize, size_t *localWorkSize)
+{
+   LaunchConfig tuned;
+   cl_uint computeUnits;
+   size_t maxLocal;
+   size_t numGroups;
+   size_t numVectors = (numData+15)/16;
+
+   check(clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+      sizeof(cl_uint), &computeUnits, NULL));
+   check(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+      sizeof(size_t), &maxLocal, NULL));
+
+   *localWorkSize = maxLocal < 256 ? maxLocal : 256;
+   numGroups = computeUnits*4;
+   if (loadLaunchConfig(kernel, device, "histogramPacked", &tuned)) {
+      *localWorkSize = tuned.local[0];
+      numGroups = tuned.groups;
+   }
+   if (numGroups*(*localWorkSize) > numVectors) {
+      numGroups = (numVectors + *localWorkSize - 1)/(*localWorkSize);
+   }
+   if (numGroups < 1) {
+      numGroups = 1;
+   }
+   *globalWorkSize = numGroups*(*localWorkSize);
+}
+
+/* Launch of a histogram kernel whose arguments are set, for the
+ * autotuner. The kernels add into the output histogram, which therefore
+ * has to be cleared again after tuning. */
+typedef struct {
+   cl_command_queue queue;
+   cl_kernel kernel;
+} HistogramLaunch;
+
+static cl_event launchHistogram(void *arg, const LaunchConfig *config)
+{
+   HistogramLaunch *launch = (HistogramLaunch*)arg;
+   size_t globalWorkSize = config->groups*config->local[0];
+   cl_event event;
+   if (clEnqueueNDRangeKernel(launch->queue, launch->kernel, 1, NULL,
+          &globalWorkSize, &config->local[0], 0, NULL, &event) != 
+       CL_SUCCESS) {
+      return NULL;
+   }
+   return event;
+}
+
+/* Time every work-group size of 'kernelName' with 1 to 16 work-groups per
+ * compute unit and store the fastest configuration */
+static void tuneHistogram(Runtime *rt, const char *kernelName)
+{
+   static LaunchConfig candidates[MAX_TUNE_CANDIDATES];
+   size_t sizes[64][2];
+   HistogramLaunch launch;
+   cl_uint computeUnits;
+   int numSizes;
+   int count = 0;
+   int s, g;
+
+   check(clGetDeviceInfo(rt->device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+      sizeof(cl_uint), &computeUnits, NULL));
+   numSizes = localSizeCandidates(rt->kernel, rt->device, 1, sizes, 64);
+   for (s = 0; s < numSizes; s++) {
+      for (g = 1; g <= 16 && count < MAX_TUNE_CANDIDATES; g *= 2) {
+         candidates[count].local[0] = sizes[s][0];
+         candidates[count].local[1] = 1;
+         candidates[count].items = 1;
+         candidates[count].groups = g*computeUnits;
+         count++;
+      }
+   }
+   launch.queue = rt->queue;
+   launch.kernel = rt->kernel;
+   autotuneKernel(rt->device, kernelName, candidates, count, 
+      launchHistogram, &launch);
+}
+
+/* Compute the histogram of the image in 'bmp' in bands of rows, so that
+ * neither the device nor the host ever holds more than 'budget' bytes of
+ * it. Two band buffers alternate: while the kernel works on band N from
+ * one buffer, band N+1 is mapped on a second queue and decoded straight
+ * from the mapped file into it. Graph nodes order each map after the
+ * kernel that last used its buffer, and each kernel after its unmap and
+ * the previous kernel (the first one after 'fillNode'). Every band adds
+ * into bufOutputHistogram. Returns the node of the last kernel. */
+static int streamHistogram(Runtime *rt, CommandGraph *graph, 
+   const BmpStream *bmp, cl_mem bufOutputHistogram, size_t budget, 
+   int fillNode)
+{
+   cl_int status;
+   cl_ulong maxAlloc;
+   size_t chunkSize;
+   int bandRows;
+   cl_mem chunkBuffers[2];
+   int kernelDone[2] = {GRAPH_NONE, GRAPH_NONE};
+   int lastKernel = fillNode;
+   cl_command_queue uploadQueue;
+   int numBands;
+   int band;
+   int i;
+
+   /* Two bands and the histogram must fit in the budget. Bands are whole
+    * rows, and at least one row. */
+   if (budget < 2*(size_t)bmp->cols + HIST_BINS*sizeof(int)) {
+      printf("A budget of %lu bytes does not fit two rows and the "
+         "histogram, use at least %lu\n", (unsigned long)budget, 
+         (unsigned long)(2*(size_t)bmp->cols + HIST_BINS*sizeof(int)));
+      exit(-1);
+   }
+   chunkSize = (budget - HIST_BINS*sizeof(int))/2;
+   check(clGetDeviceInfo(rt->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, 
+      sizeof(cl_ulong), &maxAlloc, NULL));
+   if (chunkSize > maxAlloc) {
+      chunkSize = maxAlloc;
+   }
+   bandRows = (int)(chunkSize/bmp->cols);
+   if (bandRows < 1) {
+      bandRows = 1;
+   }
+   if (bandRows > bmp->rows) {
+      bandRows = bmp->rows;
+   }
+   chunkSize = (size_t)bandRows*bmp->cols;
+   numBands = (bmp->rows + bandRows - 1)/bandRows;
+   printf("Streaming %lu pixels in %d band(s) of %d rows\n", 
+      (unsigned long)bmp->rows*bmp->cols, numBands, bandRows);
+
+   /* Uploads get their own queue so they overlap with the kernels */
+   uploadQueue = clCreateCommandQueue(rt->context, rt->device, 
+      queueProperties(0, NULL, rt->device) | CL_QUEUE_PROFILING_ENABLE, 
+      &status);
+   check(status);
+
+   /* The bands are decoded into the buffers in place, so they are
+    * allocated where the host can map them */
+   for (i = 0; i < 2; i++) {
+      chunkBuffers[i] = poolBuffer(&rt->pool, rt->context, 
+         CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, chunkSize);
+   }
+
+   for (band = 0; band < numBands; band++) {
+      int b = band % 2;
+      int firstRow = band*bandRows;
+      int rows = bmp->rows - firstRow;
+      if (rows > bandRows) {
+         rows = bandRows;
+      }
+      int chunkElements = rows*bmp->cols;
+
+      /* Map the buffer once the kernel that used it has finished, and
+       * decode the band into it. This blocking map is the only host wait
+       * of a band. */
+      cl_event lastUse = graphEvent(graph, kernelDone[b]);
+      unsigned char *mapped = (unsigned char*)clEnqueueMapBuffer(uploadQueue,
+         chunkBuffers[b], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0,
+         chunkElements, lastUse ? 1 : 0, lastUse ? &lastUse : NULL, NULL, 
+         &status);
+      check(status);
+      bmpReadRows(bmp, firstRow, rows, mapped, STORAGE_UNORM8);
+
+      /* Hand the band back to the device */
+      cl_event unmapped;
+      status = clEnqueueUnmapMemObject(uploadQueue, chunkBuffers[b], mapped,
+         0, NULL, &unmapped);
+      check(status);
+      clFlush(uploadQueue);
+      int uploadDone = graphAddEvent(graph, unmapped, "unmap band");
+
+      /* Process the band once it has arrived */
+      size_t globalWorkSize[1];
+      size_t localWorkSize[1];
+      packedWorkSize(rt->kernel, rt->device, chunkElements, 
+         &globalWorkSize[0], &localWorkSize[0]);
+      status  = clSetKernelArg(rt->kernel, 0, sizeof(cl_mem), 
+         &chunkBuffers[b]);
+      status |= clSetKernelArg(rt->kernel, 1, sizeof(int), &chunkElements);
+      status |= clSetKernelArg(rt->kernel, 2, sizeof(cl_mem), 
+         &bufOutputHistogram);
+      check(status);
+
+      int deps[2] = {uploadDone, lastKernel};
+      kernelDone[b] = graphKernel(graph, rt->queue, rt->kernel, 1, NULL,
+         globalWorkSize, localWorkSize, chunkElements, 2, deps, 
+         "histogram band");
+      lastKernel = kernelDone[b];
+   }
+
+   /* The buffers go back to the pool once their last kernel finishes,
+    * and the queue is freed once its commands finish */
+   for (i = 0; i < 2; i++) {
+      poolReturnAfter(&rt->pool, chunkBuffers[i], 
+         graphEvent(graph, kernelDone[i]));
+   }
+   clReleaseCommandQueue(uploadQueue);
+   return lastKernel;
+}
+
+static int compareNames(const void *a, const void *b)
+{
+   return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Return the images named by --batch: every .bmp file of a directory,
+ * sorted by name, or the non-empty lines of a list file */
+static char** batchFileList(const char *path, int *numFiles)
+{
+   struct stat st;
+   char **files = NULL;
+   int capacity = 0;
+   int count = 0;
+   char name[1024];
+
+   if (stat(path, &st) != 0) {
+      printf("Cannot open %s\n", path);
+      exit(-1);
+   }
+
+   if (S_ISDIR(st.st_mode)) {
+      DIR *dir = opendir(path);
+      struct dirent *entry;
+      if (!dir) {
+         printf("Cannot open %s\n", path);
+         exit(-1);
+      }
+      while ((entry = readdir(dir)) != NULL) {
+         size_t len = strlen(entry->d_name);
+         if (len < 4 || strcmp(entry->d_name+len-4, ".bmp") != 0) {
+            continue;
+         }
+         if (count == capacity) {
+            capacity = capacity ? capacity*2 : 64;
+            files = (char**)realloc(files, capacity*sizeof(char*));
+            if (!files) { exit(-1); }
+         }
+         snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+         files[count++] = strdup(name);
+      }
+      closedir(dir);
+      qsort(files, count, sizeof(char*), compareNames);
+   }
+   else {
+      FILE *fp = fopen(path, "r");
+      if (!fp) {
+         printf("Cannot open %s\n", path);
+         exit(-1);
+      }
+      while (fgets(name, sizeof(name), fp)) {
+         name[strcspn(name, "\r\n")] = '\0';
+         if (!name[0]) {
+            continue;
+         }
+         if (count == capacity) {
+            capacity = capacity ? capacity*2 : 64;
+            files = (char**)realloc(files, capacity*sizeof(char*));
+            if (!files) { exit(-1); }
+         }
+         files[count++] = strdup(name);
+      }
+      fclose(fp);
+   }
+
+   *numFiles = count;
+   return files;
+}
+
+/* Compute one histogram per image for the images named by 'batchPath'
+ * with a single launch of histogramBatch. The images are packed into one
+ * uchar buffer with an offsets table, so the whole batch costs one
+ * upload, one kernel and one read. */
+static int runBatch(int argc, char **argv, const char *batchPath)
+{
+   cl_int status;
+   int numImages;
+   char **files = batchFileList(batchPath, &numImages);
+   int i;
+
+   if (numImages == 0) {
+      printf("No images in %s\n", batchPath);
+      return 1;
+   }
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "histogram-batch", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   /* Read the images and pack them back to back */
+   int *hOffsets = (int*)malloc((numImages+1)*sizeof(int));
+   unsigned char *hPixels = NULL;
+   size_t totalPixels = 0;
+   int maxPixels = 0;
+   if (!hOffsets) { exit(-1); }
+   for (i = 0; i < numImages; i++) {
+      BmpStream bmp;
+      bmpOpen(&bmp, files[i]);
+      if (totalPixels + (size_t)bmp.rows*bmp.cols > 0x7fffffff) {
+         printf("Batch too large, split it into several runs\n");
+         exit(-1);
+      }
+      int numPixels = bmp.rows*bmp.cols;
+      hPixels = (unsigned char*)realloc(hPixels, totalPixels + numPixels);
+      if (!hPixels) { exit(-1); }
+      bmpReadRows(&bmp, 0, bmp.rows, hPixels + totalPixels, STORAGE_UNORM8);
+      bmpClose(&bmp);
+      hOffsets[i] = (int)totalPixels;
+      totalPixels += numPixels;
+      if (numPixels > maxPixels) {
+         maxPixels = numPixels;
+      }
+   }
+   hOffsets[numImages] = (int)totalPixels;
+
+   const size_t histogramsSize = (size_t)numImages*HIST_BINS*sizeof(int);
+   int *hHistograms = (int*)malloc(histogramsSize);
+   if (!hHistograms) { exit(-1); }
+
+   /* Select a device and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
+
+   /* Take the buffers from the pool */
+   cl_mem bufPixels = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+      totalPixels);
+   cl_mem bufOffsets = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+      (numImages+1)*sizeof(int));
+   cl_mem bufHistograms = poolBuffer(&rt.pool, rt.context, 
+      CL_MEM_WRITE_ONLY, histogramsSize);
+   profileStageEnd(&prof);
+
+   /* Upload the batch and clear the histograms. The three commands are
+    * independent, and they run while the program is built. */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
+   int deps[3];
+   deps[0] = graphWriteBuffer(&graph, rt.queue, bufPixels, 0, totalPixels,
+      hPixels, 0, NULL, "write pixels");
+   deps[1] = graphWriteBuffer(&graph, rt.queue, bufOffsets, 0, 
+      (numImages+1)*sizeof(int), hOffsets, 0, NULL, "write offsets");
+   int zero = 0;
+   deps[2] = graphFillBuffer(&graph, rt.queue, bufHistograms, &zero, 
+      sizeof(int), 0, histogramsSize, 0, NULL, "fill histograms");
+
+   /* Build the program and create the kernel */
+   profileStageBegin(&prof, "build");
+   char options[64];
+   sprintf(options, "-D HIST_COPIES=%d", histogramCopies(rt.device));
+   runtimeBuild(&rt, "histogram.cl", options, "histogramBatch");
+   profileStageEnd(&prof);
+
+   status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &bufPixels);
+   status |= clSetKernelArg(rt.kernel, 1, sizeof(cl_mem), &bufOffsets);
+   status |= clSetKernelArg(rt.kernel, 2, sizeof(cl_mem), &bufHistograms);
+   check(status);
+
+   /* One row of work-groups per image. Large images get several
+    * work-groups, each handling at least 64 pixels per work-item. */
+   size_t maxLocal;
+   check(clGetKernelWorkGroupInfo(rt.kernel, rt.device, 
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxLocal, NULL));
+   size_t localWorkSize[2];
+   localWorkSize[0] = maxLocal < 256 ? maxLocal : 256;
+   localWorkSize[1] = 1;
+   size_t segments = (maxPixels + localWorkSize[0]*64 - 1)/
+      (localWorkSize[0]*64);
+   if (segments > 16) {
+      segments = 16;
+   }
+   size_t globalWorkSize[2];
+   globalWorkSize[0] = segments*localWorkSize[0];
+   globalWorkSize[1] = numImages;
+
+   int kernelNode = graphKernel(&graph, rt.queue, rt.kernel, 2, NULL,
+      globalWorkSize, localWorkSize, totalPixels, 3, deps, 
+      "batch histogram kernel");
+
+   /* Read all the histograms back at once and wait for the graph */
+   graphReadBuffer(&graph, rt.queue, bufHistograms, 0, histogramsSize, 
+      hHistograms, 1, &kernelNode, "read histograms");
+   graphWait(&graph);
+   graphRelease(&graph);
+
+   /* Verify every image */
+   profileStageBegin(&prof, "gold");
+   CompareSummary summary;
+   int failed = 0;
+   for (i = 0; i < numImages; i++) {
+      int numPixels = hOffsets[i+1] - hOffsets[i];
+      int *refHistogram = histogramGoldBytes(hPixels + hOffsets[i], 
+         numPixels, HIST_BINS);
+      if (!compareInts(hHistograms + i*HIST_BINS, refHistogram, HIST_BINS,
+             &summary)) {
+         printf("%s: ", files[i]);
+         printCompareSummary(&summary);
+         failed++;
+      }
+      free(refHistogram);
+   }
+   if (!failed) {
+      printf("Passed! (%d images)\n", numImages);
+   }
+   else {
+      printf("Failed. (%d of %d images)\n", failed, numImages);
+   }
+   profileStageEnd(&prof);
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
+
+   /* Free OpenCL resources */
+   poolReturn(&rt.pool, bufPixels);
+   poolReturn(&rt.pool, bufOffsets);
+   poolReturn(&rt.pool, bufHistograms);
+   runtimeRelease(&rt);
+
+   /* Free host resources */
+   for (i = 0; i < numImages; i++) {
+      free(files[i]);
+   }
+   free(files);
+   free(hOffsets);
+   free(hPixels);
+   free(hHistograms);
+
+   return 0;
+}
+
+/* How histogramRange output is computed (see runRange) */
+typedef enum {
+   RANGE_LOCAL,
+   RANGE_MULTIPASS,
+   RANGE_GLOBAL,
+   RANGE_AUTO
+} RangeStrategy;
+
+static const char *rangeStrategyNames[] = {"local", "multipass", "global",
+   "auto"};
+
+/* Most passes of histogramRange before histogramRangeGlobal is used
+ * instead ("--max-passes N") */
+static const int defaultMaxPasses = 4;
+
+/* Turn the 8-bit image into test data of 'type': the pixels themselves,
+ * 16-bit codes that spread each pixel over 256 codes, or floats with a
+ * fractional part, so that fine bins are all populated. Returns the
+ * array and sets the size of an element. */
+static void* rangeData(const int *pixels, int numPixels, HistogramData type,
+   size_t *elementSize)
+{
+   void *data;
+   int i;
+
+   *elementSize = type == HIST_DATA_UCHAR ? 1 : 
+                  type == HIST_DATA_USHORT ? 2 : 4;
+   data = malloc((size_t)numPixels*(*elementSize));
+   if (!data) { exit(-1); }
+   for (i = 0; i < numPixels; i++) {
+      if (type == HIST_DATA_UCHAR) {
+         ((unsigned char*)data)[i] = (unsigned char)pixels[i];
+      }
+      else if (type == HIST_DATA_USHORT) {
+         ((unsigned short*)data)[i] = 
+            (unsigned short)((pixels[i] << 8) | ((i*151) & 255));
+      }
+      else {
+         ((float*)data)[i] = pixels[i] + ((i*151) & 255)/256.0f;
+      }
+   }
+   return data;
+}
+
+/* Compute a histogram with a bin count and value range chosen at run
+ * time: "--data u8|u16|float" selects the element type (the test data is
+ * derived from the image, see rangeData), "--bins N" the number of bins
+ * and "--range MIN:MAX" the values counted (by default every 8-bit or
+ * 16-bit code, or [0, 256) for floats). When all bins fit in local
+ * memory, histogramRange privatizes them per work-group in one pass.
+ * Otherwise it makes one pass over the data per window of bins that
+ * fits, up to "--max-passes", and beyond that histogramRangeGlobal
+ * counts with global atomics. "--strategy local|multipass|global"
+ * overrides the choice. */
+static int runRange(int argc, char **argv)
+{
+   cl_int status;
+   int i;
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "histogram-range", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   /* Parse the element type, bins and range */
+   HistogramData type = HIST_DATA_UCHAR;
+   const char *typeName = getOption(argc, argv, "data", NULL);
+   if (typeName && strcmp(typeName, "u16") == 0) {
+      type = HIST_DATA_USHORT;
+   }
+   else if (typeName && strcmp(typeName, "float") == 0) {
+      type = HIST_DATA_FLOAT;
+   }
+   else if (typeName && strcmp(typeName, "u8") != 0) {
+      printf("Unknown data type %s, use u8, u16 or float\n", typeName);
+      exit(-1);
+   }
+   float minValue = 0.0f;
+   float maxValue = type == HIST_DATA_USHORT ? 65536.0f : 256.0f;
+   const char *range = getOption(argc, argv, "range", NULL);
+   if (range && (sscanf(range, "%f:%f", &minValue, &maxValue) != 2 ||
+                 !(maxValue > minValue))) {
+      printf("Invalid range %s, use MIN:MAX\n", range);
+      exit(-1);
+   }
+   int bins = getIntOption(argc, argv, "bins", NULL, 
+      type == HIST_DATA_UCHAR ? 256 : 
+      type == HIST_DATA_USHORT ? 65536 : 4096);
+   if (bins < 1) {
+      printf("Invalid bin count %d\n", bins);
+      exit(-1);
+   }
+   float scale = (float)bins/(maxValue - minValue);
+
+   RangeStrategy strategy = RANGE_AUTO;
+   const char *strategyName = getOption(argc, argv, "strategy", NULL);
+   if (strategyName) {
+      for (i = 0; i <= RANGE_AUTO; i++) {
+         if (strcmp(strategyName, rangeStrategyNames[i]) == 0) {
+            break;
+         }
+      }
+      if (i > RANGE_AUTO) {
+         printf("Unknown strategy %s, use local, multipass or global\n", 
+            strategyName);
+         exit(-1);
+      }
+      strategy = (RangeStrategy)i;
+   }
+   int maxPasses = getIntOption(argc, argv, "max-passes", NULL, 
+      defaultMaxPasses);
+
+   /* Read the image and derive the data */
+   int imageRows;
+   int imageCols;
+   int *hInputImage = readBmp("../../Images/cat.bmp", &imageRows, 
+      &imageCols);
+   int numData = imageRows*imageCols;
+   size_t elementSize;
+   void *hData = rangeData(hInputImage, numData, type, &elementSize);
+   const size_t histogramSize = (size_t)bins*sizeof(int);
+   int *hHistogram = (int*)malloc(histogramSize);
+   if (!hHistogram) { exit(-1); }
+
+   /* Select a device and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
+   cl_mem bufData = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+      numData*elementSize);
+   cl_mem bufHistogram = poolBuffer(&rt.pool, rt.context, 
+      CL_MEM_READ_WRITE, histogramSize);
+   profileStageEnd(&prof);
+
+   /* Upload the data and clear the histogram while the program is
+    * built */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
+   int deps[2];
+   deps[0] = graphWriteBuffer(&graph, rt.queue, bufData, 0, 
+      numData*elementSize, hData, 0, NULL, "write data");
+   int zero = 0;
+   deps[1] = graphFillBuffer(&graph, rt.queue, bufHistogram, &zero, 
+      sizeof(int), 0, histogramSize, 0, NULL, "fill histogram");
+
+   profileStageBegin(&prof, "build");
+   char options[64];
+   sprintf(options, "-D HIST_TYPE=%s", type == HIST_DATA_UCHAR ? "uchar" :
+      type == HIST_DATA_USHORT ? "ushort" : "float");
+   runtimeBuild(&rt, "histogram.cl", options, "histogramRange");
+   profileStageEnd(&prof);
+
+   /* The bins that fit in the local memory left to histogramRange */
+   cl_ulong localMemSize;
+   cl_ulong kernelLocalMem;
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_LOCAL_MEM_SIZE, 
+      sizeof(cl_ulong), &localMemSize, NULL));
+   check(clGetKernelWorkGroupInfo(rt.kernel, rt.device, 
+      CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &kernelLocalMem, NULL));
+   int windowBins = (int)((localMemSize - kernelLocalMem)/sizeof(int));
+   if (windowBins > bins) {
+      windowBins = bins;
+   }
+   if (windowBins < 1) {
+      windowBins = 1;
+   }
+   int passes = (bins + windowBins - 1)/windowBins;
+
+   if (strategy == RANGE_AUTO) {
+      strategy = passes == 1 ? RANGE_LOCAL : 
+                 passes <= maxPasses ? RANGE_MULTIPASS : RANGE_GLOBAL;
+   }
+   else if (strategy == RANGE_LOCAL && passes > 1) {
+      printf("%d bins do not fit in local memory\n", bins);
+      strategy = RANGE_MULTIPASS;
+   }
+   if (strategy == RANGE_GLOBAL) {
+      clReleaseKernel(rt.kernel);
+      rt.kernel = clCreateKernel(rt.program, "histogramRangeGlobal", 
+         &status);
+      check(status);
+      passes = 1;
+   }
+   printf("%d bins over [%g, %g) of %s data: %s, %d pass(es)\n", bins, 
+      minValue, maxValue, typeName ? typeName : "u8", 
+      rangeStrategyNames[strategy], passes);
+
+   /* A few work-groups per compute unit, as for histogramPacked */
+   cl_uint computeUnits;
+   size_t maxLocal;
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+      sizeof(cl_uint), &computeUnits, NULL));
+   check(clGetKernelWorkGroupInfo(rt.kernel, rt.device, 
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxLocal, NULL));
+   size_t localWorkSize = maxLocal < 256 ? maxLocal : 256;
+   size_t numGroups = computeUnits*4;
+   if (numGroups*localWorkSize > (size_t)numData) {
+      numGroups = (numData + localWorkSize - 1)/localWorkSize;
+   }
+   size_t globalWorkSize = numGroups*localWorkSize;
+
+   /* Launch the passes. They count disjoint windows of bins, so they
+    * only depend on the upload and the clearing, not on each other. */
+   int *passNodes = (int*)malloc(passes*sizeof(int));
+   if (!passNodes) { exit(-1); }
+   status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &bufData);
+   status |= clSetKernelArg(rt.kernel, 1, sizeof(int), &numData);
+   status |= clSetKernelArg(rt.kernel, 2, sizeof(float), &minValue);
+   status |= clSetKernelArg(rt.kernel, 3, sizeof(float), &scale);
+   status |= clSetKernelArg(rt.kernel, 4, sizeof(int), &bins);
+   if (strategy == RANGE_GLOBAL) {
+      status |= clSetKernelArg(rt.kernel, 5, sizeof(cl_mem), &bufHistogram);
+      check(status);
+      passNodes[0] = graphKernel(&graph, rt.queue, rt.kernel, 1, NULL, 
+         &globalWorkSize, &localWorkSize, numData, 2, deps, 
+         "histogram global kernel");
+   }
+   else {
+      status |= clSetKernelArg(rt.kernel, 7, sizeof(cl_mem), &bufHistogram);
+      status |= clSetKernelArg(rt.kernel, 8, windowBins*sizeof(int), NULL);
+      check(status);
+      for (i = 0; i < passes; i++) {
+         int firstBin = i*windowBins;
+         int passBins = bins - firstBin < windowBins ? bins - firstBin
+                                                     : windowBins;
+         status  = clSetKernelArg(rt.kernel, 5, sizeof(int), &firstBin);
+         status |= clSetKernelArg(rt.kernel, 6, sizeof(int), &passBins);
+         check(status);
+         passNodes[i] = graphKernel(&graph, rt.queue, rt.kernel, 1, NULL,
+            &globalWorkSize, &localWorkSize, numData, 2, deps, 
+            "histogram pass");
+      }
+   }
+
+   /* Read the histogram back once every pass has finished */
+   graphReadBuffer(&graph, rt.queue, bufHistogram, 0, histogramSize, 
+      hHistogram, passes, passNodes, "read histogram");
+   graphWait(&graph);
+   printTransferTime(0, graph.transferMs);
+   graphRelease(&graph);
+
+   /* Verify the output */
+   profileStageBegin(&prof, "gold");
+   int *refHistogram = histogramGoldRange(hData, type, numData, bins, 
+      minValue, scale);
+   CompareSummary summary;
+   compareInts(hHistogram, refHistogram, bins, &summary);
+   printCompareSummary(&summary);
+   free(refHistogram);
+   profileStageEnd(&prof);
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
+
+   /* Free OpenCL resources */
+   poolReturn(&rt.pool, bufData);
+   poolReturn(&rt.pool, bufHistogram);
+   runtimeRelease(&rt);
+
+   /* Free host resources */
+   free(passNodes);
+   free(hInputImage);
+   free(hData);
+   free(hHistogram);
+
+   return 0;
+}
+
+/* The lookup table of the equalize kernel, computed the same way on the
+ * host: equalization when 'clipCount' < 0, and otherwise a linear
+ * stretch of the values left after clipping 'clipCount' pixels at each
+ * end (see lutValue in histogram.cl) */
+static void equalizeLut(const int *histogram, int numPixels, int clipCount,
+   unsigned char *lut)
+{
+   int cdf[256];
+   int low = 0;
+   int high = 0;
+   int sum = 0;
+   int i;
+
+   for (i = 0; i < HIST_BINS; i++) {
+      int before = sum;
+      sum += histogram[i];
+      cdf[i] = sum;
+      if (clipCount < 0) {
+         if (sum > 0 && before == 0) {
+            low = sum;
+         }
+      }
+      else {
+         if (sum > clipCount && before <= clipCount) {
+            low = i;
+         }
+         if (sum >= numPixels - clipCount && 
+             before < numPixels - clipCount) {
+            high = i;
+         }
+      }
+   }
+
+   for (i = 0; i < HIST_BINS; i++) {
+      if (clipCount < 0) {
+         long long range = numPixels - low;
+         long long count = cdf[i] > low ? cdf[i] - low : 0;
+         lut[i] = range <= 0 ? (unsigned char)i 
+                             : (unsigned char)((count*255 + range/2)/range);
+      }
+      else if (i <= low) {
+         lut[i] = 0;
+      }
+      else if (i >= high) {
+         lut[i] = 255;
+      }
+      else {
+         lut[i] = (unsigned char)(((i - low)*255 + (high - low)/2)/
+            (high - low));
+      }
+   }
+}
+
+/* Equalize the image on the device ("--equalize"), or stretch it with
+ * "--clip PERCENT" so that PERCENT of the pixels saturate at each end.
+ * histogramPacked computes the histogram, and the equalize kernel turns
+ * it into a lookup table with a prefix scan and maps the pixels in the
+ * same launch, so only the final image comes back to the host. It is
+ * checked against the same steps on the host and written to
+ * cat-equalized.bmp. */
+static int runEqualize(int argc, char **argv)
+{
+   cl_int status;
+   int i;
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "histogram-equalize", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   /* Read the 8-bit pixels */
+   int imageRows;
+   int imageCols;
+   unsigned char *hImage = (unsigned char*)readBmpStorage(
+      "../../Images/cat.bmp", &imageRows, &imageCols, STORAGE_UNORM8);
+   int numPixels = imageRows*imageCols;
+   unsigned char *hOutput = (unsigned char*)alignedAlloc(numPixels);
+
+   /* The number of pixels clipped at each end, or -1 to equalize */
+   int clipCount = -1;
+   const char *clip = getOption(argc, argv, "clip", NULL);
+   if (clip) {
+      double percent = getDoubleOption(argc, argv, "clip", NULL, 0.0);
+      if (percent < 0.0 || percent >= 50.0) {
+         printf("The clip percentage must be in [0, 50)\n");
+         exit(-1);
+      }
+      clipCount = (int)(numPixels*percent/100.0);
+      printf("Stretching with %g%% clipped at each end\n", percent);
+   }
+   else {
+      printf("Equalizing\n");
+   }
+
+   /* Select a device and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
+   const int histogramSize = HIST_BINS*sizeof(int);
+   cl_mem bufImage = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+      numPixels);
+   cl_mem bufHistogram = poolBuffer(&rt.pool, rt.context, 
+      CL_MEM_READ_WRITE, histogramSize);
+   cl_mem bufOutput = poolBuffer(&rt.pool, rt.context, CL_MEM_WRITE_ONLY, 
+      numPixels);
+   profileStageEnd(&prof);
+
+   /* Upload the image and clear the histogram while the program is
+    * built */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
+   int deps[2];
+   deps[0] = graphWriteBuffer(&graph, rt.queue, bufImage, 0, numPixels, 
+      hImage, 0, NULL, "write image");
+   int zero = 0;
+   deps[1] = graphFillBuffer(&graph, rt.queue, bufHistogram, &zero, 
+      sizeof(int), 0, histogramSize, 0, NULL, "fill histogram");
+
+   profileStageBegin(&prof, "build");
+   char options[64];
+   sprintf(options, "-D HIST_COPIES=%d", histogramCopies(rt.device));
+   runtimeBuild(&rt, "histogram.cl", options, "histogramPacked");
+   cl_kernel equalizeKernel = clCreateKernel(rt.program, "equalize", 
+      &status);
+   check(status);
+   profileStageEnd(&prof);
+
+   /* Compute the histogram */
+   size_t globalWorkSize;
+   size_t localWorkSize;
+   packedWorkSize(rt.kernel, rt.device, numPixels, &globalWorkSize, 
+      &localWorkSize);
+   status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &bufImage);
+   status |= clSetKernelArg(rt.kernel, 1, sizeof(int), &numPixels);
+   status |= clSetKernelArg(rt.kernel, 2, sizeof(cl_mem), &bufHistogram);
+   check(status);
+   int histogramNode = graphKernel(&graph, rt.queue, rt.kernel, 1, NULL,
+      &globalWorkSize, &localWorkSize, numPixels, 2, deps, 
+      "histogram kernel");
+
+   /* Build the table and map the pixels, four per work-item and pass */
+   cl_uint computeUnits;
+   size_t maxLocal;
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+      sizeof(cl_uint), &computeUnits, NULL));
+   check(clGetKernelWorkGroupInfo(equalizeKernel, rt.device, 
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxLocal, NULL));
+   localWorkSize = maxLocal < 256 ? maxLocal : 256;
+   size_t numGroups = computeUnits*4;
+   size_t numVectors = (numPixels + 3)/4;
+   if (numGroups*localWorkSize > numVectors) {
+      numGroups = (numVectors + localWorkSize - 1)/localWorkSize;
+   }
+   globalWorkSize = numGroups*localWorkSize;
+   status  = clSetKernelArg(equalizeKernel, 0, sizeof(cl_mem), 
+      &bufHistogram);
+   status |= clSetKernelArg(equalizeKernel, 1, sizeof(int), &numPixels);
+   status |= clSetKernelArg(equalizeKernel, 2, sizeof(int), &clipCount);
+   status |= clSetKernelArg(equalizeKernel, 3, sizeof(cl_mem), &bufImage);
+   status |= clSetKernelArg(equalizeKernel, 4, sizeof(cl_mem), &bufOutput);
+   check(status);
+   int equalizeNode = graphKernel(&graph, rt.queue, equalizeKernel, 1, 
+      NULL, &globalWorkSize, &localWorkSize, numPixels, 1, &histogramNode,
+      "equalize kernel");
+
+   /* Only the final image is read back */
+   graphReadBuffer(&graph, rt.queue, bufOutput, 0, numPixels, hOutput, 1,
+      &equalizeNode, "read output");
+   graphWait(&graph);
+   printTransferTime(0, graph.transferMs);
+   graphRelease(&graph);
+   writeBmpStorage(hOutput, "cat-equalized.bmp", imageRows, imageCols, 
+      STORAGE_UNORM8);
+
+   /* Verify the output against the same steps on the host */
+   profileStageBegin(&prof, "gold");
+   int *refHistogram = histogramGoldBytes(hImage, numPixels, HIST_BINS);
+   unsigned char lut[256];
+   equalizeLut(refHistogram, numPixels, clipCount, lut);
+   int *result = (int*)malloc(numPixels*sizeof(int));
+   int *reference = (int*)malloc(numPixels*sizeof(int));
+   if (!result || !reference) { exit(-1); }
+   for (i = 0; i < numPixels; i++) {
+      result[i] = hOutput[i];
+      reference[i] = lut[hImage[i]];
+   }
+   CompareSummary summary;
+   compareInts(result, reference, numPixels, &summary);
+   printCompareSummary(&summary);
+   free(refHistogram);
+   free(result);
+   free(reference);
+   profileStageEnd(&prof);
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
+
+   /* Free OpenCL resources */
+   clReleaseKernel(equalizeKernel);
+   poolReturn(&rt.pool, bufImage);
+   poolReturn(&rt.pool, bufHistogram);
+   poolReturn(&rt.pool, bufOutput);
+   runtimeRelease(&rt);
+
+   /* Free host resources */
+   free(hImage);
+   free(hOutput);
+
+   return 0;
+}
+
 int main(int argc, char **argv) 
 {
+   /* "--batch DIR|LIST" computes the histograms of many images at once */
+   const char *batchPath = getOption(argc, argv, "batch", NULL);
+   if (batchPath && batchPath[0]) {
+      return runBatch(argc, argv, batchPath);
+   }
+
+   /* "--equalize" or "--clip PERCENT" equalize the image on the device */
+   if (hasOption(argc, argv, "equalize", NULL) || 
+       getOption(argc, argv, "clip", NULL)) {
+      return runEqualize(argc, argv);
+   }
+
+   /* "--bins", "--range" or "--data" select the ranged histogram */
+   if (getOption(argc, argv, "bins", NULL) || 
+       getOption(argc, argv, "range", NULL) || 
+       getOption(argc, argv, "data", NULL)) {
+      return runRange(argc, argv);
+   }
+
    /* Host data */
    int *hInputImage = NULL; 
    int *hOutputHistogram = NULL;
 
-   /* Allocate space for the input image and read the
-    * data from disk */
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "histogram", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   /* "--mode packed" uploads 8-bit pixels and runs histogramPacked.
+    * "--mode streaming" does the same in bands of rows, using at most
+    * "--budget-mb" (default 64) MB of device memory. */
+   const char *mode = getOption(argc, argv, "mode", NULL);
+   int packed = mode && strcmp(mode, "packed") == 0;
+   int streaming = mode && strcmp(mode, "streaming") == 0;
+   int budgetMb = getIntOption(argc, argv, "budget-mb", NULL, 64);
+   if (budgetMb < 0) {
+      printf("The budget must not be negative\n");
+      exit(-1);
+   }
+   size_t budget = (size_t)budgetMb << 20;
+
+   /* Allocate space for the input image and read the data from disk. The
+    * streaming mode only maps the file and decodes it band by band, so
+    * the image is held on the host as a whole only to verify the result
+    * (up to maxReferenceBytes). */
    int imageRows;
    int imageCols;
-   hInputImage = readBmp("../../Images/cat.bmp", &imageRows, &imageCols);
-   const int imageElements = imageRows*imageCols;
-   const size_t imageSize = imageElements*sizeof(int);
+   BmpStream bmp;
+   if (streaming) {
+      bmpOpen(&bmp, "../../Images/cat.bmp");
+      imageRows = bmp.rows;
+      imageCols = bmp.cols;
+   }
+   else {
+      hInputImage = readBmp("../../Images/cat.bmp", &imageRows, &imageCols);
+   }
+   const int imageElements = streaming ? 0 : imageRows*imageCols;
+   unsigned char *hPackedImage = NULL;
+   if (packed) {
+      hPackedImage = packPixels(hInputImage, imageElements);
+   }
+   const size_t imageSize = packed ? imageElements 
+                                   : imageElements*sizeof(int);
+   const void *hUpload = packed ? (void*)hPackedImage : (void*)hInputImage;
+
+   /* "--zero-copy" lets the input buffer use the host image in place and
+    * maps the histogram instead of reading it. The int image from readBmp
+    * is first copied to page-aligned memory. */
+   int zeroCopy = zeroCopyRequested(argc, argv) && !streaming;
+   int *hAlignedImage = NULL;
+   if (zeroCopy && !packed) {
+      hAlignedImage = (int*)alignedAlloc(imageSize);
+      memcpy(hAlignedImage, hInputImage, imageSize);
+      hUpload = hAlignedImage;
+   }
 
    /* Allocate space for the histogram on the host */
    const int histogramSize = HIST_BINS*sizeof(int);
@@ -35,121 +1052,168 @@ int main(int argc, char **argv)
    /* Use this to check the output of each API call */
    cl_int status;
 
-   /* Get the first platform */
-   cl_platform_id platform;
-   status = clGetPlatformIDs(1, &platform, NULL);
-   check(status);
-
-   /* Get the first device */
-   cl_device_id device;
-   status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-   check(status);
-
-   /* Create a context and associate it with the device */
-   cl_context context;
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-   check(status);
+   /* Select a device (a GPU unless --device says otherwise, falling back
+    * to a CPU device) and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
 
-   /* Create a command queue and associate it with the device */
-   cl_command_queue cmdQueue;
-   cmdQueue = clCreateCommandQueue(context, device, 0, &status);
-   check(status);
-
-   /* Create a buffer object for the input image */
-   cl_mem bufInputImage;
-   bufInputImage = clCreateBuffer(context, CL_MEM_READ_ONLY, imageSize, NULL, 
-         &status);
-   check(status);
+   /* Create a buffer object for the input image (the streaming mode
+    * uses chunk buffers instead). A zero-copy input wraps the host image,
+    * so it cannot come from the pool. */
+   cl_mem bufInputImage = NULL;
+   if (zeroCopy) {
+      bufInputImage = clCreateBuffer(rt.context, 
+            CL_MEM_READ_ONLY | zeroCopyFlags(hUpload), imageSize, 
+            (void*)hUpload, &status);
+      check(status);
+   }
+   else if (!streaming) {
+      bufInputImage = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+         imageSize);
+   }
 
-   /* Create a buffer object for the output histogram */
+   /* Take a buffer object for the output histogram from the pool */
    cl_mem bufOutputHistogram;
-   bufOutputHistogram = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
-      histogramSize, NULL, &status);
-   check(status);
+   bufOutputHistogram = poolBuffer(&rt.pool, rt.context, 
+      CL_MEM_WRITE_ONLY | (zeroCopy ? zeroCopyFlags(NULL) : 0), 
+      histogramSize);
 
-   /* Write the input image to the device */
-   status = clEnqueueWriteBuffer(cmdQueue, bufInputImage, CL_TRUE, 0, imageSize,
-         hInputImage, 0, NULL, NULL);
-   check(status);
+   profileStageEnd(&prof);
 
-   /* Initialize the output histogram with zeros */
+   /* The commands form a graph: the upload of the input image and the
+    * clearing of the histogram are independent and run while the program
+    * is built, and the kernel waits for both */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
+   int inputNode = GRAPH_NONE;
+   if (!streaming && !zeroCopy) {
+      inputNode = graphWriteBuffer(&graph, rt.queue, bufInputImage, 0, 
+         imageSize, hUpload, 0, NULL, "write input");
+   }
    int zero = 0;
-   status = clEnqueueFillBuffer(cmdQueue, bufOutputHistogram, &zero, 
-         sizeof(int), 0, histogramSize, 0, NULL, NULL);
-   check(status);
+   int fillNode = graphFillBuffer(&graph, rt.queue, bufOutputHistogram, 
+      &zero, sizeof(int), 0, histogramSize, 0, NULL, "fill histogram");
 
-   /* Create a program with source code */
-   char *programSource = readFile("histogram.cl");
-   size_t programSourceLen = strlen(programSource);
-   cl_program program = clCreateProgramWithSource(context, 1,
-      (const char**)&programSource, &programSourceLen, &status);
-   check(status);
+   /* Create and build the program, reusing a cached binary from an
+    * earlier run when one matches, and create the kernel */
+   profileStageBegin(&prof, "build");
+   char options[64];
+   sprintf(options, "-D HIST_COPIES=%d", histogramCopies(rt.device));
+   const char *kernelName = (packed || streaming) ? "histogramPacked" 
+                                                  : "histogram";
+   runtimeBuild(&rt, "histogram.cl", options, kernelName);
+   profileStageEnd(&prof);
 
-   /* Build (compile) the program for the device */
-   status = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
-   if (status != CL_SUCCESS) {
-      printCompilerError(program, device);
-      exit(-1);
+   int *refHistogram = NULL;
+   int kernelNode;
+   if (streaming) {
+      kernelNode = streamHistogram(&rt, &graph, &bmp, bufOutputHistogram, 
+         budget, fillNode);
+      bmpClose(&bmp);
    }
+   else {
+      /* Set the kernel arguments */
+      status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &bufInputImage);
+      status |= clSetKernelArg(rt.kernel, 1, sizeof(int), &imageElements);
+      status |= clSetKernelArg(rt.kernel, 2, sizeof(cl_mem), 
+         &bufOutputHistogram);
+      check(status);
 
-   /* Create the kernel */
-   cl_kernel kernel;
-   kernel = clCreateKernel(program, "histogram", &status);
-   check(status);
+      /* "--autotune" times the launch configurations on this image, once
+       * it has been uploaded, and stores the fastest for later runs */
+      if (autotuneRequested(argc, argv)) {
+         graphWait(&graph);
+         tuneHistogram(&rt, kernelName);
+         fillNode = graphFillBuffer(&graph, rt.queue, bufOutputHistogram, 
+            &zero, sizeof(int), 0, histogramSize, 0, NULL, 
+            "fill histogram");
+      }
 
-   /* Set the kernel arguments */
-   status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufInputImage);
-   status |= clSetKernelArg(kernel, 1, sizeof(int), &imageElements);
-   status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufOutputHistogram);
-   check(status);
+      /* Define the index space and work-group size */
+      size_t globalWorkSize[1];
+      globalWorkSize[0] = 1024;
 
-   /* Define the index space and work-group size */
-   size_t globalWorkSize[1];
-   globalWorkSize[0] = 1024;
+      size_t localWorkSize[1];
+      localWorkSize[0] = 64;
 
-   size_t localWorkSize[1];
-   localWorkSize[0] = 64;
+      LaunchConfig tuned;
+      if (packed) {
+         packedWorkSize(rt.kernel, rt.device, imageElements, 
+            &globalWorkSize[0], &localWorkSize[0]);
+      }
+      else if (loadLaunchConfig(rt.kernel, rt.device, kernelName, &tuned) 
+               && tuned.groups > 0) {
+         localWorkSize[0] = tuned.local[0];
+         globalWorkSize[0] = tuned.groups*tuned.local[0];
+      }
 
-   /* Enqueue the kernel for execution */
-   status = clEnqueueNDRangeKernel(cmdQueue, kernel, 1, NULL,
-      globalWorkSize, localWorkSize, 0, NULL, NULL);
-   check(status);
+      /* Enqueue the kernel for execution */
+      int deps[2] = {inputNode, fillNode};
+      kernelNode = graphKernel(&graph, rt.queue, rt.kernel, 1, NULL,
+         globalWorkSize, localWorkSize, imageElements, 2, deps, 
+         "histogram kernel");
+   }
 
-   /* Read the output histogram buffer to the host */
-   status = clEnqueueReadBuffer(cmdQueue, bufOutputHistogram, CL_TRUE, 0,
-         histogramSize, hOutputHistogram, 0, NULL, NULL);
-   check(status);
+   /* Read the output histogram buffer to the host, or map it, and wait
+    * for the whole graph */
+   int *result = hOutputHistogram;
+   if (zeroCopy) {
+      graphMapBuffer(&graph, rt.queue, bufOutputHistogram, CL_MAP_READ,
+         histogramSize, (void**)&result, 1, &kernelNode, "map histogram");
+   }
+   else {
+      graphReadBuffer(&graph, rt.queue, bufOutputHistogram, 0, 
+         histogramSize, hOutputHistogram, 1, &kernelNode, 
+         "read histogram");
+   }
+   graphWait(&graph);
+   printTransferTime(zeroCopy, graph.transferMs);
+   graphRelease(&graph);
 
    /* Verify the output */
-   int *refHistogram;
-   refHistogram = histogramGold(hInputImage, imageRows*imageCols, HIST_BINS);
-   int passed = 1;
-   int i;
-   for (i = 0; i < HIST_BINS; i++) {
-      if (hOutputHistogram[i] != refHistogram[i]) {
-         passed = 0;
-      }
+   profileStageBegin(&prof, "gold");
+   if (streaming && 
+       (size_t)imageRows*imageCols*sizeof(int) <= maxReferenceBytes) {
+      /* The streaming reference is decoded by readBmp, independently of
+       * the banded decoder, so that both are checked */
+      hInputImage = readBmp("../../Images/cat.bmp", &imageRows, &imageCols);
    }
-   if (passed) {
-      printf("Passed!\n");
+   if (hInputImage) {
+      refHistogram = histogramGoldParallel(hInputImage, 
+         (size_t)imageRows*imageCols, HIST_BINS);
+      CompareSummary summary;
+      compareInts(result, refHistogram, HIST_BINS, &summary);
+      printCompareSummary(&summary);
+      free(refHistogram);
    }
    else {
-      printf("Failed.\n");
+      printf("Not verified: the image exceeds the %lu MB host reference\n",
+         (unsigned long)(maxReferenceBytes >> 20));
    }
-   free(refHistogram);
+   profileStageEnd(&prof);
+   if (zeroCopy) {
+      unmapObject(rt.queue, bufOutputHistogram, result, &prof, 
+         "unmap histogram");
+   }
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
 
    /* Free OpenCL resources */
-   clReleaseKernel(kernel);
-   clReleaseProgram(program);
-   clReleaseCommandQueue(cmdQueue);
-   clReleaseMemObject(bufInputImage);
-   clReleaseMemObject(bufOutputHistogram);
-   clReleaseContext(context);
+   if (zeroCopy) {
+      clReleaseMemObject(bufInputImage);
+   }
+   else if (bufInputImage) {
+      poolReturn(&rt.pool, bufInputImage);
+   }
+   poolReturn(&rt.pool, bufOutputHistogram);
+   runtimeRelease(&rt);
 
    /* Free host resources */
    free(hInputImage);
    free(hOutputHistogram);
-   free(programSource);
+   free(hPackedImage);
+   free(hAlignedImage);
 
    return 0;
 }
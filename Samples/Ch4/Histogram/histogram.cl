@@ -41,3 +41,332 @@ void histogram(__global int *data,
       atomic_add(&histogram[i], localHistogram[i]);
    }
 }
+
+/* Number of replicated sub-histograms per work-group. Work-item i updates
+ * copy i%HIST_COPIES, so work-items that hit the same bin at the same time
+ * usually update different local memory words. */
+#ifndef HIST_COPIES
+#define HIST_COPIES 8
+#endif
+
+__kernel
+void histogramPacked(__global const uchar *data,
+                                   int  numData,
+                     __global      int *histogram)
+{
+   /* Copy c of bin b is stored at b*HIST_COPIES+c, so the copies of one
+    * bin sit in consecutive banks */
+   __local int localHistogram[HIST_BINS*HIST_COPIES];
+   int lid = get_local_id(0);
+   int gid = get_global_id(0);
+   int copy = lid % HIST_COPIES;
+
+   /* Initialize the local histograms to zero */
+   for (int i = lid;
+        i < HIST_BINS*HIST_COPIES;
+        i += get_local_size(0))
+   {
+      localHistogram[i] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Each work-item reads 16 pixels at a time */
+   int numVectors = numData/16;
+   for (int i = gid;
+        i < numVectors;
+        i += get_global_size(0))
+   {
+      uchar16 pixels = vload16(i, data);
+      atomic_inc(&localHistogram[pixels.s0*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s1*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s2*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s3*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s4*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s5*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s6*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s7*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s8*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.s9*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.sa*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.sb*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.sc*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.sd*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.se*HIST_COPIES + copy]);
+      atomic_inc(&localHistogram[pixels.sf*HIST_COPIES + copy]);
+   }
+
+   /* The pixels that do not fill a whole vector */
+   for (int i = numVectors*16 + gid;
+        i < numData;
+        i += get_global_size(0))
+   {
+      atomic_inc(&localHistogram[data[i]*HIST_COPIES + copy]);
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Merge the copies and add them to the global histogram */
+   for (int i = lid;
+        i < HIST_BINS;
+        i += get_local_size(0))
+   {
+      int sum = 0;
+      for (int c = 0; c < HIST_COPIES; c++) {
+         sum += localHistogram[i*HIST_COPIES + c];
+      }
+      if (sum) {
+         atomic_add(&histogram[i], sum);
+      }
+   }
+}
+
+/* Histograms of a batch of images packed back to back in 'data'. Image
+ * k occupies data[offsets[k]] to data[offsets[k+1]-1] and its histogram
+ * goes to histograms[k*HIST_BINS]. The second NDRange dimension selects
+ * the image, and the work-groups along the first dimension split the
+ * image into interleaved segments. */
+__kernel
+void histogramBatch(__global const uchar *data,
+                    __global const int   *offsets,
+                    __global       int   *histograms)
+{
+   __local int localHistogram[HIST_BINS];
+   int lid = get_local_id(0);
+   int image = get_group_id(1);
+   int start = offsets[image];
+   int end = offsets[image+1];
+
+   /* Initialize local histogram to zero */
+   for (int i = lid;
+        i < HIST_BINS;
+        i += get_local_size(0))
+   {
+      localHistogram[i] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Compute the local histogram of this segment */
+   for (int i = start + get_global_id(0);
+        i < end;
+        i += get_global_size(0))
+   {
+      atomic_inc(&localHistogram[data[i]]);
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Add the segment's counts to the image's histogram */
+   __global int *histogram = histograms + image*HIST_BINS;
+   for (int i = lid;
+        i < HIST_BINS;
+        i += get_local_size(0))
+   {
+      if (localHistogram[i]) {
+         atomic_add(&histogram[i], localHistogram[i]);
+      }
+   }
+}
+
+/* Histograms with a bin count and value range chosen at run time, for
+ * 8-bit (uchar), 16-bit (ushort) or float data ("-D HIST_TYPE=..."). A
+ * value v falls into bin (int)((v - minValue)*scale), where 'scale' is
+ * bins/(maxValue - minValue); values outside [minValue, maxValue) are
+ * not counted. The host reference computes the bins with the same float
+ * operations, so the counts match exactly. */
+#ifndef HIST_TYPE
+#define HIST_TYPE uchar
+#endif
+
+int rangeBin(HIST_TYPE value, float minValue, float scale, int bins)
+{
+   float x = ((float)value - minValue)*scale;
+   return (x >= 0.0f && x < (float)bins) ? (int)x : -1;
+}
+
+/* Count the bins [firstBin, firstBin+windowBins) in local memory, which
+ * holds 'windowBins' ints. When every bin fits, one launch with
+ * firstBin 0 computes the whole histogram; otherwise the host launches
+ * one pass per window of bins. */
+__kernel
+void histogramRange(__global const HIST_TYPE *data,
+                                         int  numData,
+                                       float  minValue,
+                                       float  scale,
+                                         int  bins,
+                                         int  firstBin,
+                                         int  windowBins,
+                    __global             int *histogram,
+                    __local              int *localHistogram)
+{
+   int lid = get_local_id(0);
+
+   for (int i = lid; i < windowBins; i += get_local_size(0))
+   {
+      localHistogram[i] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int i = get_global_id(0); i < numData; i += get_global_size(0))
+   {
+      int bin = rangeBin(data[i], minValue, scale, bins) - firstBin;
+      if (bin >= 0 && bin < windowBins) {
+         atomic_inc(&localHistogram[bin]);
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int i = lid; i < windowBins; i += get_local_size(0))
+   {
+      if (localHistogram[i]) {
+         atomic_add(&histogram[firstBin + i], localHistogram[i]);
+      }
+   }
+}
+
+/* Count straight into the global histogram, for bin counts that would
+ * need too many passes of histogramRange. With many bins, work-items
+ * rarely hit the same bin at once, so the atomics seldom collide. */
+__kernel
+void histogramRangeGlobal(__global const HIST_TYPE *data,
+                                               int  numData,
+                                             float  minValue,
+                                             float  scale,
+                                               int  bins,
+                          __global             int *histogram)
+{
+   for (int i = get_global_id(0); i < numData; i += get_global_size(0))
+   {
+      int bin = rangeBin(data[i], minValue, scale, bins);
+      if (bin >= 0) {
+         atomic_inc(&histogram[bin]);
+      }
+   }
+}
+
+/* Inclusive prefix sum of the HIST_BINS ints in 'data', computed by the
+ * whole work-group with the work-efficient (Blelloch) scheme: partial
+ * sums are built up a tree and then distributed back down, which takes
+ * 2*log2(HIST_BINS) steps and O(HIST_BINS) additions */
+void scanBins(__local int *data)
+{
+   int lid = get_local_id(0);
+   int size = get_local_size(0);
+
+   for (int stride = 1; stride < HIST_BINS; stride *= 2)
+   {
+      for (int i = lid; i < HIST_BINS/(2*stride); i += size)
+      {
+         int right = (2*i + 2)*stride - 1;
+         data[right] += data[right - stride];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   for (int stride = HIST_BINS/4; stride >= 1; stride /= 2)
+   {
+      for (int i = lid; i < HIST_BINS/(2*stride) - 1; i += size)
+      {
+         int right = (2*i + 2)*stride - 1;
+         data[right + stride] += data[right];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+}
+
+/* The output value of pixel value 'value' whose cumulative count is
+ * 'cdf'. With 'clipCount' < 0 this is histogram equalization, where
+ * 'low' is the cumulative count of the darkest pixel value present.
+ * Otherwise the values from 'low' to 'high' (the darkest and brightest
+ * values once 'clipCount' pixels are clipped at each end) are stretched
+ * linearly over the full range. The host reference uses the same integer
+ * arithmetic. */
+uchar lutValue(int value, int cdf, int numPixels, int clipCount, int low,
+   int high)
+{
+   if (clipCount < 0) {
+      long range = numPixels - low;
+      if (range <= 0) {
+         return (uchar)value;
+      }
+      long count = cdf > low ? cdf - low : 0;
+      return (uchar)((count*255 + range/2)/range);
+   }
+   if (value <= low) {
+      return 0;
+   }
+   if (value >= high) {
+      return 255;
+   }
+   return (uchar)(((value - low)*255 + (high - low)/2)/(high - low));
+}
+
+/* Equalize (or, with 'clipCount' >= 0, stretch) the 8-bit image with its
+ * histogram. Every work-group scans the histogram into a lookup table in
+ * local memory, which costs a few hundred additions, and then maps its
+ * share of the pixels, so the table never goes through global memory
+ * and one launch follows the histogram. */
+__kernel
+void equalize(__global const int   *histogram,
+                             int    numPixels,
+                             int    clipCount,
+              __global const uchar *image,
+              __global       uchar *output)
+{
+   __local int cdf[HIST_BINS];
+   __local uchar lut[HIST_BINS];
+   __local int limits[2];
+   int lid = get_local_id(0);
+   int size = get_local_size(0);
+
+   for (int i = lid; i < HIST_BINS; i += size)
+   {
+      cdf[i] = histogram[i];
+   }
+   if (lid == 0) {
+      limits[0] = 0;
+      limits[1] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+   scanBins(cdf);
+
+   /* The cumulative counts never decrease, so exactly one bin crosses
+    * each threshold */
+   for (int i = lid; i < HIST_BINS; i += size)
+   {
+      int before = i > 0 ? cdf[i-1] : 0;
+      if (clipCount < 0) {
+         if (cdf[i] > 0 && before == 0) {
+            limits[0] = cdf[i];
+         }
+      }
+      else {
+         if (cdf[i] > clipCount && before <= clipCount) {
+            limits[0] = i;
+         }
+         if (cdf[i] >= numPixels - clipCount && 
+             before < numPixels - clipCount) {
+            limits[1] = i;
+         }
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int i = lid; i < HIST_BINS; i += size)
+   {
+      lut[i] = lutValue(i, cdf[i], numPixels, clipCount, limits[0], 
+         limits[1]);
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Map four pixels at a time, then the remainder */
+   int numVectors = numPixels/4;
+   for (int i = get_global_id(0); i < numVectors; i += get_global_size(0))
+   {
+      uchar4 pixels = vload4(i, image);
+      vstore4((uchar4)(lut[pixels.x], lut[pixels.y], lut[pixels.z], 
+         lut[pixels.w]), i, output);
+   }
+   for (int i = numVectors*4 + get_global_id(0);
+        i < numPixels;
+        i += get_global_size(0))
+   {
+      output[i] = lut[image[i]];
+   }
+}
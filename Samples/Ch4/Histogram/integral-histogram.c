@@ -0,0 +1,269 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "bmp-utils.h"
+#include "options.h"
+#include "runtime.h"
+#include "profiler.h"
+#include "host-memory.h"
+#include "gold.h"
+#include "gold-parallel.h"
+#include "command-graph.h"
+
+/* Defaults of "--bins", "--regions" and "--max-region" */
+static const int defaultBins = 16;
+static const int defaultRegions = 4096;
+static const int defaultMaxRegion = 64;
+
+/* Random regions of 1 to 'maxSize' pixels per side inside the image, as
+ * (x0, y0, x1, y1) with exclusive ends. The seed is fixed so that runs
+ * can be compared. */
+static cl_int* randomRegions(int numRegions, int rows, int cols,
+   int maxSize)
+{
+   cl_int *regions = (cl_int*)malloc((size_t)numRegions*4*sizeof(cl_int));
+   int r;
+
+   if (!regions) { exit(-1); }
+   srand(1);
+   for (r = 0; r < numRegions; r++) {
+      int width = 1 + rand() % (maxSize < cols ? maxSize : cols);
+      int height = 1 + rand() % (maxSize < rows ? maxSize : rows);
+      int x = rand() % (cols - width + 1);
+      int y = rand() % (rows - height + 1);
+      regions[r*4 + 0] = x;
+      regions[r*4 + 1] = y;
+      regions[r*4 + 2] = x + width;
+      regions[r*4 + 3] = y + height;
+   }
+   return regions;
+}
+
+/* Check every region against histogramGold on the cropped pixels, mapped
+ * to bins like pixelBin in integral-histogram.cl */
+static void checkRegions(const int *pixels, int cols, const cl_int *regions,
+   int numRegions, int bins, const int *histograms)
+{
+   CompareSummary summary;
+   int failed = 0;
+   int r;
+
+   for (r = 0; r < numRegions; r++) {
+      const cl_int *region = regions + r*4;
+      int width = region[2] - region[0];
+      int height = region[3] - region[1];
+      int *cropped = (int*)malloc((size_t)width*height*sizeof(int));
+      int x, y;
+      if (!cropped) { exit(-1); }
+      for (y = 0; y < height; y++) {
+         for (x = 0; x < width; x++) {
+            int pixel = pixels[(size_t)(region[1] + y)*cols + region[0] + x];
+            cropped[y*width + x] = (pixel*bins) >> 8;
+         }
+      }
+      int *refHistogram = histogramGold(cropped, width*height, bins);
+      if (!compareInts(histograms + (size_t)r*bins, refHistogram, bins,
+             &summary)) {
+         if (!failed) {
+            printf("Region %d (%d,%d)-(%d,%d): ", r, region[0], region[1],
+               region[2], region[3]);
+            printCompareSummary(&summary);
+         }
+         failed++;
+      }
+      free(refHistogram);
+      free(cropped);
+   }
+   if (!failed) {
+      printf("Passed! (%d regions)\n", numRegions);
+   }
+   else {
+      printf("Failed. (%d of %d regions)\n", failed, numRegions);
+   }
+}
+
+/* Build the integral histogram of the image on the device (see
+ * integral-histogram.cl) and answer a batch of region histogram queries
+ * from it in one launch. "--bins N" (1 to 256) sets the bins, which bounds
+ * the integral to N*(rows+1)*(cols+1) ints; "--regions N" and
+ * "--max-region N" set the number and largest side of the random query
+ * regions. */
+int main(int argc, char **argv)
+{
+   cl_int status;
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "integral-histogram", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   int bins = getIntOption(argc, argv, "bins", NULL, defaultBins);
+   int numRegions = getIntOption(argc, argv, "regions", NULL,
+      defaultRegions);
+   int maxRegion = getIntOption(argc, argv, "max-region", NULL,
+      defaultMaxRegion);
+   if (bins < 1 || bins > 256 || numRegions < 1 || maxRegion < 1) {
+      printf("Use 1 to 256 bins and at least one region\n");
+      exit(-1);
+   }
+
+   /* Read the image and pack it into bytes */
+   int imageRows;
+   int imageCols;
+   int *hInputImage = readBmp("../../Images/cat.bmp", &imageRows,
+      &imageCols);
+   size_t numPixels = (size_t)imageRows*imageCols;
+   unsigned char *hPixels = (unsigned char*)malloc(numPixels);
+   if (!hPixels) { exit(-1); }
+   size_t i;
+   for (i = 0; i < numPixels; i++) {
+      hPixels[i] = (unsigned char)hInputImage[i];
+   }
+   cl_int *hRegions = randomRegions(numRegions, imageRows, imageCols,
+      maxRegion);
+   size_t regionsSize = (size_t)numRegions*4*sizeof(cl_int);
+   size_t histogramsSize = (size_t)numRegions*bins*sizeof(int);
+   int *hHistograms = (int*)malloc(histogramsSize);
+   if (!hHistograms) { exit(-1); }
+
+   /* Select a device and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
+
+   /* The integral has to fit in one buffer, as rounded up by the pool */
+   size_t integralSize = (size_t)bins*(imageRows+1)*(imageCols+1)*
+      sizeof(int);
+   cl_ulong maxAlloc;
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+      sizeof(cl_ulong), &maxAlloc, NULL));
+   printf("Integral histogram of %d bins: %.1f MB\n", bins,
+      integralSize/1048576.0);
+   if (poolSizeClass(integralSize) > maxAlloc) {
+      printf("The integral exceeds the largest buffer of %.1f MB, use "
+         "fewer bins\n", maxAlloc/1048576.0);
+      exit(-1);
+   }
+
+   cl_mem bufPixels = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY,
+      numPixels);
+   cl_mem bufIntegral = poolBuffer(&rt.pool, rt.context,
+      CL_MEM_READ_WRITE, integralSize);
+   cl_mem bufRegions = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY,
+      regionsSize);
+   cl_mem bufHistograms = poolBuffer(&rt.pool, rt.context,
+      CL_MEM_WRITE_ONLY, histogramsSize);
+   profileStageEnd(&prof);
+
+   /* The uploads and the clearing of the integral's zero border run
+    * while the program is built */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
+   int deps[2];
+   deps[0] = graphWriteBuffer(&graph, rt.queue, bufPixels, 0, numPixels,
+      hPixels, 0, NULL, "write image");
+   int zero = 0;
+   deps[1] = graphFillBuffer(&graph, rt.queue, bufIntegral, &zero,
+      sizeof(int), 0, integralSize, 0, NULL, "fill integral");
+   int regionsNode = graphWriteBuffer(&graph, rt.queue, bufRegions, 0,
+      regionsSize, hRegions, 0, NULL, "write regions");
+
+   profileStageBegin(&prof, "build");
+   runtimeBuild(&rt, "integral-histogram.cl", "", "integralRows");
+   cl_kernel columnsKernel = clCreateKernel(rt.program, "integralColumns",
+      &status);
+   check(status);
+   cl_kernel queryKernel = clCreateKernel(rt.program, "regionHistograms",
+      &status);
+   check(status);
+   profileStageEnd(&prof);
+
+   /* Scan the rows, one work-group per row and bin. The scan needs a
+    * power-of-two work-group size. */
+   size_t maxLocal;
+   check(clGetKernelWorkGroupInfo(rt.kernel, rt.device,
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxLocal, NULL));
+   size_t scanLocal = 1;
+   while (scanLocal*2 <= maxLocal && scanLocal*2 <= 256 &&
+          scanLocal < (size_t)imageCols) {
+      scanLocal *= 2;
+   }
+   size_t rowsLocal[2] = {scanLocal, 1};
+   size_t rowsGlobal[2] = {scanLocal, (size_t)imageRows*bins};
+   status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &bufPixels);
+   status |= clSetKernelArg(rt.kernel, 1, sizeof(int), &imageRows);
+   status |= clSetKernelArg(rt.kernel, 2, sizeof(int), &imageCols);
+   status |= clSetKernelArg(rt.kernel, 3, sizeof(int), &bins);
+   status |= clSetKernelArg(rt.kernel, 4, sizeof(cl_mem), &bufIntegral);
+   status |= clSetKernelArg(rt.kernel, 5, scanLocal*sizeof(int), NULL);
+   check(status);
+   int rowsNode = graphKernel(&graph, rt.queue, rt.kernel, 2, NULL,
+      rowsGlobal, rowsLocal, (double)numPixels*bins, 2, deps,
+      "integral rows");
+
+   /* Scan the columns, one work-item per column and bin */
+   size_t columnsGlobal[2] = {(size_t)imageCols, (size_t)bins};
+   status  = clSetKernelArg(columnsKernel, 0, sizeof(int), &imageRows);
+   status |= clSetKernelArg(columnsKernel, 1, sizeof(int), &imageCols);
+   status |= clSetKernelArg(columnsKernel, 2, sizeof(int), &bins);
+   status |= clSetKernelArg(columnsKernel, 3, sizeof(cl_mem), &bufIntegral);
+   check(status);
+   int columnsNode = graphKernel(&graph, rt.queue, columnsKernel, 2, NULL,
+      columnsGlobal, NULL, (double)numPixels*bins, 1, &rowsNode,
+      "integral columns");
+
+   /* Answer every query in one launch, one work-item per region and bin */
+   size_t queryGlobal[2] = {(size_t)bins, (size_t)numRegions};
+   status  = clSetKernelArg(queryKernel, 0, sizeof(cl_mem), &bufIntegral);
+   status |= clSetKernelArg(queryKernel, 1, sizeof(int), &imageRows);
+   status |= clSetKernelArg(queryKernel, 2, sizeof(int), &imageCols);
+   status |= clSetKernelArg(queryKernel, 3, sizeof(int), &bins);
+   status |= clSetKernelArg(queryKernel, 4, sizeof(cl_mem), &bufRegions);
+   status |= clSetKernelArg(queryKernel, 5, sizeof(int), &numRegions);
+   status |= clSetKernelArg(queryKernel, 6, sizeof(cl_mem),
+      &bufHistograms);
+   check(status);
+   int queryDeps[2] = {columnsNode, regionsNode};
+   int queryNode = graphKernel(&graph, rt.queue, queryKernel, 2, NULL,
+      queryGlobal, NULL, (double)numRegions*bins, 2, queryDeps,
+      "region histograms");
+
+   /* Read the histograms back and wait for the graph */
+   graphReadBuffer(&graph, rt.queue, bufHistograms, 0, histogramsSize,
+      hHistograms, 1, &queryNode, "read histograms");
+   graphWait(&graph);
+   printTransferTime(0, graph.transferMs);
+   graphRelease(&graph);
+
+   /* Verify the output */
+   profileStageBegin(&prof, "gold");
+   checkRegions(hInputImage, imageCols, hRegions, numRegions, bins,
+      hHistograms);
+   profileStageEnd(&prof);
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
+
+   /* Free OpenCL resources */
+   clReleaseKernel(columnsKernel);
+   clReleaseKernel(queryKernel);
+   poolReturn(&rt.pool, bufPixels);
+   poolReturn(&rt.pool, bufIntegral);
+   poolReturn(&rt.pool, bufRegions);
+   poolReturn(&rt.pool, bufHistograms);
+   runtimeRelease(&rt);
+
+   /* Free host resources */
+   free(hInputImage);
+   free(hPixels);
+   free(hRegions);
+   free(hHistograms);
+
+   return 0;
+}
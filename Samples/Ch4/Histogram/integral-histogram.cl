@@ -0,0 +1,107 @@
+/* Integral histogram of an 8-bit image. Bin b of the integral at (y, x)
+ * counts the pixels of rows [0, y) and columns [0, x) that fall into bin
+ * b, so it has (rows+1) x (cols+1) entries per bin, and the first row and
+ * column stay zero. Pixel p falls into bin p*bins/256. The bins are
+ * stored one plane after the other. */
+
+int pixelBin(uchar pixel, int bins)
+{
+   return (pixel*bins) >> 8;
+}
+
+/* Prefix sums along the rows. Work-group (row, bin) scans its row of the
+ * image in chunks of one element per work-item, carrying the total of
+ * the chunks before. 'scan' holds one int per work-item, and the local
+ * size must be a power of two. */
+__kernel
+void integralRows(__global const uchar *image,
+                                  int  rows,
+                                  int  cols,
+                                  int  bins,
+                  __global        int *integral,
+                  __local         int *scan)
+{
+   int lid = get_local_id(0);
+   int size = get_local_size(0);
+   int row = get_group_id(1) % rows;
+   int bin = get_group_id(1) / rows;
+   __global int *out = integral + (size_t)bin*(rows+1)*(cols+1) +
+      (size_t)(row+1)*(cols+1) + 1;
+   int carry = 0;
+
+   for (int base = 0; base < cols; base += size)
+   {
+      int x = base + lid;
+      scan[lid] = (x < cols &&
+                   pixelBin(image[(size_t)row*cols + x], bins) == bin) ? 1 : 0;
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      /* Inclusive scan of the chunk */
+      for (int offset = 1; offset < size; offset *= 2)
+      {
+         int t = lid >= offset ? scan[lid - offset] : 0;
+         barrier(CLK_LOCAL_MEM_FENCE);
+         scan[lid] += t;
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      if (x < cols) {
+         out[x] = carry + scan[lid];
+      }
+      carry += scan[size - 1];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+}
+
+/* Prefix sums down the columns of the row sums, in place. Work-item
+ * (x, bin) walks column x+1 of its bin; neighbouring work-items read
+ * neighbouring words of each row. */
+__kernel
+void integralColumns(int  rows,
+                     int  cols,
+                     int  bins,
+           __global  int *integral)
+{
+   int x = get_global_id(0);
+   int bin = get_global_id(1);
+   if (x >= cols || bin >= bins) {
+      return;
+   }
+
+   __global int *column = integral + (size_t)bin*(rows+1)*(cols+1) + x + 1;
+   int sum = 0;
+   for (int y = 1; y <= rows; y++)
+   {
+      sum += column[(size_t)y*(cols+1)];
+      column[(size_t)y*(cols+1)] = sum;
+   }
+}
+
+/* Histograms of many regions at once. Region r covers columns
+ * [regions[r].x, regions[r].z) and rows [regions[r].y, regions[r].w),
+ * and work-item (bin, r) computes its count for 'bin' from four entries
+ * of the integral. */
+__kernel
+void regionHistograms(__global const int  *integral,
+                                     int   rows,
+                                     int   cols,
+                                     int   bins,
+                      __global const int4 *regions,
+                                     int   numRegions,
+                      __global       int  *histograms)
+{
+   int bin = get_global_id(0);
+   int r = get_global_id(1);
+   if (bin >= bins || r >= numRegions) {
+      return;
+   }
+
+   int4 region = regions[r];
+   size_t stride = cols + 1;
+   __global const int *plane = integral + (size_t)bin*(rows+1)*stride;
+   histograms[(size_t)r*bins + bin] =
+        plane[region.w*stride + region.z]
+      - plane[region.y*stride + region.z]
+      - plane[region.w*stride + region.x]
+      + plane[region.y*stride + region.x];
+}
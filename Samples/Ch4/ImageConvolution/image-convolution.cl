@@ -6,9 +6,16 @@ void convolution(
                       int filterWidth,
                 sampler_t sampler)
 {
-   /* Store each work-item’s unique row and column */
+   /* Store each work-item’s unique row and column. The NDRange is
+    * padded to whole work-groups, so work-items past the edge of the
+    * image do nothing. */
    int column = get_global_id(0);
    int row = get_global_id(1);
+   if (column >= get_image_width(outputImage) || 
+       row >= get_image_height(outputImage))
+   {
+      return;
+   }
    
    /* Half the width of the filter is needed for indexing
     * memory later */
@@ -49,3 +56,419 @@ void convolution(
    coords.y = row;
    write_imagef(outputImage, coords, sum);
 }
+
+/* First pass of a separable filter: convolve each row with the 1D
+ * horizontal factor of the filter */
+__kernel
+void convolutionRow(
+    __read_only image2d_t inputImage,
+   __write_only image2d_t outputImage,
+        __constant float* filter,
+                      int filterWidth,
+                sampler_t sampler)
+{
+   int column = get_global_id(0);
+   int row = get_global_id(1);
+   int halfWidth = (int)(filterWidth/2);
+   float sum = 0.0f;
+
+   if (column >= get_image_width(outputImage) || 
+       row >= get_image_height(outputImage))
+   {
+      return;
+   }
+
+   for(int j = -halfWidth; j <= halfWidth; j++) 
+   {
+      float4 pixel = read_imagef(inputImage, sampler, 
+         (int2)(column + j, row));
+      sum += pixel.x * filter[j + halfWidth];
+   }
+
+   write_imagef(outputImage, (int2)(column, row), 
+      (float4)(sum, 0.0f, 0.0f, 0.0f));
+}
+
+/* Second pass of a separable filter: convolve each column of the first
+ * pass's output with the 1D vertical factor. Clamping to the edge in
+ * both passes gives the same result as clamping the 2D coordinates. */
+__kernel
+void convolutionColumn(
+    __read_only image2d_t inputImage,
+   __write_only image2d_t outputImage,
+        __constant float* filter,
+                      int filterWidth,
+                sampler_t sampler)
+{
+   int column = get_global_id(0);
+   int row = get_global_id(1);
+   int halfWidth = (int)(filterWidth/2);
+   float sum = 0.0f;
+
+   if (column >= get_image_width(outputImage) || 
+       row >= get_image_height(outputImage))
+   {
+      return;
+   }
+
+   for(int i = -halfWidth; i <= halfWidth; i++) 
+   {
+      float4 pixel = read_imagef(inputImage, sampler, 
+         (int2)(column, row + i));
+      sum += pixel.x * filter[i + halfWidth];
+   }
+
+   write_imagef(outputImage, (int2)(column, row), 
+      (float4)(sum, 0.0f, 0.0f, 0.0f));
+}
+
+#ifdef FILTER_WIDTH
+/* Tiled variant, built with -D FILTER_WIDTH=<width> so that the filter
+ * loops have constant bounds and unroll completely. Each work-group
+ * stages its block of the input plus a halo of FILTER_WIDTH/2 pixels in
+ * local memory once, and each work-item then computes PIXELS_PER_ITEM
+ * output pixels of a row, reusing every filter tap it loads. The pixels
+ * of a work-item are TILE_WIDTH columns apart, so neighbouring work-items
+ * read neighbouring local memory words. */
+#ifndef TILE_WIDTH
+#define TILE_WIDTH 16
+#endif
+#ifndef TILE_HEIGHT
+#define TILE_HEIGHT 16
+#endif
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 4
+#endif
+
+#define HALF_WIDTH (FILTER_WIDTH/2)
+#define BLOCK_WIDTH (TILE_WIDTH*PIXELS_PER_ITEM)
+#define LOCAL_WIDTH (BLOCK_WIDTH + FILTER_WIDTH - 1)
+#define LOCAL_HEIGHT (TILE_HEIGHT + FILTER_WIDTH - 1)
+
+__kernel __attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))
+void convolutionTiled(
+    __read_only image2d_t inputImage,
+   __write_only image2d_t outputImage,
+        __constant float* filter,
+                sampler_t sampler)
+{
+   __local float tile[LOCAL_HEIGHT][LOCAL_WIDTH];
+
+   int localColumn = get_local_id(0);
+   int localRow = get_local_id(1);
+
+   /* Top-left output pixel of this work-group's block */
+   int blockColumn = get_group_id(0)*BLOCK_WIDTH;
+   int blockRow = get_group_id(1)*TILE_HEIGHT;
+
+   /* Stage the block and its halo. The sampler clamps reads outside the
+    * image to the edge, as in the untiled kernel. */
+   for (int y = localRow; y < LOCAL_HEIGHT; y += TILE_HEIGHT)
+   {
+      for (int x = localColumn; x < LOCAL_WIDTH; x += TILE_WIDTH)
+      {
+         int2 coords = (int2)(blockColumn + x - HALF_WIDTH,
+                              blockRow + y - HALF_WIDTH);
+         tile[y][x] = read_imagef(inputImage, sampler, coords).x;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Accumulate in the same tap order as the untiled kernel */
+   float sum[PIXELS_PER_ITEM];
+   #pragma unroll
+   for (int p = 0; p < PIXELS_PER_ITEM; p++)
+   {
+      sum[p] = 0.0f;
+   }
+
+   #pragma unroll
+   for (int i = 0; i < FILTER_WIDTH; i++)
+   {
+      #pragma unroll
+      for (int j = 0; j < FILTER_WIDTH; j++)
+      {
+         float tap = filter[i*FILTER_WIDTH + j];
+         #pragma unroll
+         for (int p = 0; p < PIXELS_PER_ITEM; p++)
+         {
+            sum[p] += tile[localRow + i][localColumn + p*TILE_WIDTH + j]*tap;
+         }
+      }
+   }
+
+   /* Write the pixels that fall inside the image */
+   int row = blockRow + localRow;
+   int width = get_image_width(outputImage);
+   int height = get_image_height(outputImage);
+   #pragma unroll
+   for (int p = 0; p < PIXELS_PER_ITEM; p++)
+   {
+      int column = blockColumn + localColumn + p*TILE_WIDTH;
+      if (column < width && row < height)
+      {
+         write_imagef(outputImage, (int2)(column, row),
+            (float4)(sum[p], 0.0f, 0.0f, 0.0f));
+      }
+   }
+}
+#endif
+
+#ifdef FIRST_WIDTH
+/* Two filters applied back to back, built with -D FIRST_WIDTH=<width>
+ * -D SECOND_WIDTH=<width>. Each work-group stages its tile of the input
+ * with the halo of both filters in local memory, computes the first
+ * filter's output for the tile plus the second filter's halo, and then
+ * applies the second filter from local memory, so the intermediate image
+ * never goes to global memory.
+ *
+ * The unfused second pass would read the intermediate image through a
+ * clamp-to-edge sampler, so the intermediate pixels of the halo are
+ * computed at coordinates clamped to the image. */
+#ifndef TILE_WIDTH
+#define TILE_WIDTH 16
+#endif
+#ifndef TILE_HEIGHT
+#define TILE_HEIGHT 16
+#endif
+
+#define FIRST_HALF (FIRST_WIDTH/2)
+#define SECOND_HALF (SECOND_WIDTH/2)
+#define MID_WIDTH (TILE_WIDTH + SECOND_WIDTH - 1)
+#define MID_HEIGHT (TILE_HEIGHT + SECOND_WIDTH - 1)
+#define IN_WIDTH (MID_WIDTH + FIRST_WIDTH - 1)
+#define IN_HEIGHT (MID_HEIGHT + FIRST_WIDTH - 1)
+
+__kernel __attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))
+void convolutionFused(
+    __read_only image2d_t inputImage,
+   __write_only image2d_t outputImage,
+        __constant float* firstFilter,
+        __constant float* secondFilter,
+                sampler_t sampler)
+{
+   __local float inTile[IN_HEIGHT][IN_WIDTH];
+   __local float midTile[MID_HEIGHT][MID_WIDTH];
+
+   int localColumn = get_local_id(0);
+   int localRow = get_local_id(1);
+   int width = get_image_width(outputImage);
+   int height = get_image_height(outputImage);
+
+   /* Image coordinates of the first output pixel, the first intermediate
+    * pixel and the first input pixel of this work-group */
+   int blockColumn = get_group_id(0)*TILE_WIDTH;
+   int blockRow = get_group_id(1)*TILE_HEIGHT;
+   int midColumn = blockColumn - SECOND_HALF;
+   int midRow = blockRow - SECOND_HALF;
+   int inColumn = midColumn - FIRST_HALF;
+   int inRow = midRow - FIRST_HALF;
+
+   /* Stage the input */
+   for (int y = localRow; y < IN_HEIGHT; y += TILE_HEIGHT)
+   {
+      for (int x = localColumn; x < IN_WIDTH; x += TILE_WIDTH)
+      {
+         inTile[y][x] = read_imagef(inputImage, sampler,
+            (int2)(inColumn + x, inRow + y)).x;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* First filter. A clamped coordinate stays within the intermediate
+    * tile because every work-group starts inside the image. */
+   for (int y = localRow; y < MID_HEIGHT; y += TILE_HEIGHT)
+   {
+      int cy = clamp(midRow + y, 0, height - 1) - midRow;
+      for (int x = localColumn; x < MID_WIDTH; x += TILE_WIDTH)
+      {
+         int cx = clamp(midColumn + x, 0, width - 1) - midColumn;
+         float sum = 0.0f;
+         #pragma unroll
+         for (int i = 0; i < FIRST_WIDTH; i++)
+         {
+            #pragma unroll
+            for (int j = 0; j < FIRST_WIDTH; j++)
+            {
+               sum += inTile[cy + i][cx + j]*firstFilter[i*FIRST_WIDTH + j];
+            }
+         }
+         midTile[y][x] = sum;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Second filter */
+   float sum = 0.0f;
+   #pragma unroll
+   for (int i = 0; i < SECOND_WIDTH; i++)
+   {
+      #pragma unroll
+      for (int j = 0; j < SECOND_WIDTH; j++)
+      {
+         sum += midTile[localRow + i][localColumn + j]*
+            secondFilter[i*SECOND_WIDTH + j];
+      }
+   }
+
+   int column = blockColumn + localColumn;
+   int row = blockRow + localRow;
+   if (column < width && row < height)
+   {
+      write_imagef(outputImage, (int2)(column, row),
+         (float4)(sum, 0.0f, 0.0f, 0.0f));
+   }
+}
+#endif
+
+/* FFT convolution. The image is padded to a power-of-two size
+ * fftWidth x fftHeight that holds the filter's halo on both sides, so the
+ * circular correlation computed through the FFT never wraps around. The
+ * padding replicates the edge pixels, like the clamp-to-edge sampler of
+ * the direct kernels. Complex values are stored as float2 (re, im). */
+
+/* Copy the image into the transform buffer, shifted by the filter's half
+ * width */
+__kernel
+void fftPadImage(
+    __read_only image2d_t inputImage,
+      __global float2* data,
+                   int halfWidth,
+             sampler_t sampler)
+{
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+   int fftWidth = get_global_size(0);
+
+   float4 pixel = read_imagef(inputImage, sampler, 
+      (int2)(x - halfWidth, y - halfWidth));
+   data[y*fftWidth + x] = (float2)(pixel.x, 0.0f);
+}
+
+/* Copy the filter into the top-left corner of a zeroed transform buffer */
+__kernel
+void fftPadFilter(
+   __constant float* filter,
+                 int filterWidth,
+    __global float2* data)
+{
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+   int fftWidth = get_global_size(0);
+
+   float tap = 0.0f;
+   if (x < filterWidth && y < filterWidth) 
+   {
+      tap = filter[y*filterWidth + x];
+   }
+   data[y*fftWidth + x] = (float2)(tap, 0.0f);
+}
+
+/* Reverse the low 'bits' bits of 'value' */
+int reverseBits(int value, int bits)
+{
+   int reversed = 0;
+   for (int b = 0; b < bits; b++) 
+   {
+      reversed = (reversed << 1) | (value & 1);
+      value >>= 1;
+   }
+   return reversed;
+}
+
+/* Reorder both dimensions into bit-reversed order for the decimation in
+ * time butterflies below */
+__kernel
+void fftBitReverse(
+   __global const float2* input,
+         __global float2* output,
+                      int widthBits,
+                      int heightBits)
+{
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+   int fftWidth = get_global_size(0);
+
+   output[reverseBits(y, heightBits)*fftWidth + reverseBits(x, widthBits)] =
+      input[y*fftWidth + x];
+}
+
+/* One radix-2 stage on every row (elementStride 1, lineStride fftWidth)
+ * or every column (elementStride fftWidth, lineStride 1). Each work-item
+ * computes one butterfly of size 2*span. 'sign' is -1 for the forward
+ * and +1 for the inverse transform. */
+__kernel
+void fftButterfly(
+   __global float2* data,
+                int span,
+                int elementStride,
+                int lineStride,
+              float sign)
+{
+   int k = get_global_id(0);
+   int line = get_global_id(1);
+
+   int position = k % span;
+   int first = (k/span)*2*span + position;
+   int i0 = line*lineStride + first*elementStride;
+   int i1 = i0 + span*elementStride;
+
+   float cosine;
+   float sine = sincos(sign*M_PI_F*position/span, &cosine);
+   float2 a = data[i0];
+   float2 b = data[i1];
+   float2 t = (float2)(b.x*cosine - b.y*sine, b.x*sine + b.y*cosine);
+   data[i0] = a + t;
+   data[i1] = a - t;
+}
+
+/* Multiply the image spectrum by the conjugate filter spectrum, which
+ * turns the convolution theorem's product into a correlation (the
+ * direct kernels do not flip the filter). 'scale' normalizes the
+ * inverse transform. */
+__kernel
+void fftMultiply(
+         __global float2* data,
+   __global const float2* filter,
+                    float scale)
+{
+   int i = get_global_id(0);
+   float2 a = data[i];
+   float2 b = filter[i];
+   data[i] = (float2)(a.x*b.x + a.y*b.y, a.y*b.x - a.x*b.y)*scale;
+}
+
+/* Write the real part of the image-sized top-left corner */
+__kernel
+void fftExtract(
+   __global const float2* data,
+                      int fftWidth,
+   __write_only image2d_t outputImage)
+{
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+
+   write_imagef(outputImage, (int2)(x, y), 
+      (float4)(data[y*fftWidth + x].x, 0.0f, 0.0f, 0.0f));
+}
+
+/* Copy an image multiplied by 'scale'. Reading or writing an 8-bit or
+ * half-precision image converts its pixels, so this moves images between
+ * their storage format and the float images the filters work on (see
+ * image-storage.h). */
+__kernel
+void convertImage(
+    __read_only image2d_t inputImage,
+   __write_only image2d_t outputImage,
+                    float scale)
+{
+   int2 coords = (int2)(get_global_id(0), get_global_id(1));
+   if (coords.x >= get_image_width(outputImage) || 
+       coords.y >= get_image_height(outputImage))
+   {
+      return;
+   }
+   float4 pixel = read_imagef(inputImage, coords);
+   write_imagef(outputImage, coords, (float4)(pixel.x*scale, 0.0f, 0.0f, 
+      0.0f));
+}
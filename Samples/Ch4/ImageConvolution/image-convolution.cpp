@@ -1,14 +1,34 @@
 #define __CL_ENABLE_EXCEPTIONS
 
-#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <string>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <CL/cl.hpp>
 
 #include "utils.h"
 #include "bmp-utils.h"
 #include "gold.h"
+#include "gold-parallel.h"
+#include "options.h"
+#include "program-cache.h"
+#include "runtime.h"
+#include "profiler.h"
+#include "image-storage.h"
+#include "host-memory.h"
+#include "autotune.h"
+#include "command-graph.h"
+#include "memory-pool.h"
 
 static const char* inputImagePath = "../../Images/cat.bmp";
 
@@ -60,176 +80,1698 @@ enum filterList
    EDGE_SHARPEN, 
    VERT_EDGE_DETECT, 
    EMBOSS, 
+   DISK,
    FILTER_LIST_SIZE
 };
 static const int filterSelection = VERT_EDGE_DETECT;
 
-int main() 
+/* Names accepted by "--filter", in filterList order */
+static const char* filterNames[FILTER_LIST_SIZE] = {
+   "gaussian-blur",
+   "sharpen",
+   "edge-sharpen",
+   "vert-edge-detect",
+   "emboss",
+   "disk"};
+
+/* Width of the generated disk filter ("--disk-width N") */
+static const int defaultDiskWidth = 31;
+
+/* Output pixels per work-item of the tiled kernel */
+static const int tiledPixelsPerItem = 4;
+
+/* Ways of applying a filter ("--kernel NAME") */
+enum convolutionMethod
 {
-   float *hInputImage;
-   float *hOutputImage;
+   METHOD_AUTO,
+   METHOD_2D,
+   METHOD_TILED,
+   METHOD_SEPARABLE,
+   METHOD_FFT,
+   METHOD_LIST_SIZE
+};
+static const char* methodNames[METHOD_LIST_SIZE] = {
+   "auto",
+   "2d",
+   "tiled",
+   "separable",
+   "fft"};
 
-   int imageRows;
-   int imageCols;
+/* Relative cost of one FFT butterfly operation compared to one
+ * multiply-add of the direct kernels. The butterfly passes read and
+ * write the whole transform from global memory each time, while the
+ * direct kernels mostly hit the texture cache. */
+static const double fftCostFactor = 4.0;
+
+/* A normalized filter. If it is the outer product of a column and a row
+ * vector, 'separable' is set and the two factors are stored as well. */
+struct Filter
+{
+   int width;
+   std::vector<float> taps;
+   bool separable;
+   std::vector<float> columnTaps;
+   std::vector<float> rowTaps;
+};
+
+/* OpenCL objects shared by every convolution of a run. Kernels, filter
+ * buffers and intermediate images are created on first use and kept, so
+ * that later frames only set arguments and enqueue. */
+struct Convolver
+{
+   cl::Context context;
+   cl::Device device;
+   cl::CommandQueue queue;
+   cl::Sampler sampler;
+   std::map<std::string, cl::Program> programs;
+   std::map<std::string, cl::Kernel> kernels;
+   std::map<const float*, cl::Buffer> tapBuffers;
+   std::map<std::string, cl::Image2D> scratchImages;
+   std::map<std::string, cl::Buffer> scratchBuffers;
+   int tileSize;
+   size_t localMemSize;
+   Profiler *prof;
+   std::map<std::string, LaunchConfig> launch;
+   bool logStages;
+   MemPool *pool;
+};
+
+/* Check whether 'filter' has rank one, i.e., every row is a multiple of
+ * the row holding the largest tap. If so, store the factors such that
+ * filter[i][j] == columnTaps[i]*rowTaps[j] to within float rounding. */
+static void separateFilter(Filter &filter)
+{
+   int width = filter.width;
+   int pivot = 0;
+   float maxTap = 0.0f;
+
+   for (int i = 0; i < width*width; i++) 
+   {
+      if (fabs(filter.taps[i]) > maxTap) 
+      {
+         maxTap = fabs(filter.taps[i]);
+         pivot = i;
+      }
+   }
+
+   filter.separable = false;
+   if (maxTap == 0.0f) 
+   {
+      return;
+   }
+
+   int pivotRow = pivot/width;
+   int pivotColumn = pivot%width;
+   filter.rowTaps.resize(width);
+   filter.columnTaps.resize(width);
+   for (int j = 0; j < width; j++) 
+   {
+      filter.rowTaps[j] = filter.taps[pivotRow*width + j];
+   }
+   for (int i = 0; i < width; i++) 
+   {
+      filter.columnTaps[i] = filter.taps[i*width + pivotColumn]/
+         filter.taps[pivot];
+   }
+
+   /* The reconstruction must match every tap */
+   for (int i = 0; i < width; i++) 
+   {
+      for (int j = 0; j < width; j++) 
+      {
+         float product = filter.columnTaps[i]*filter.rowTaps[j];
+         if (fabs(product - filter.taps[i*width + j]) > 1e-6f*maxTap) 
+         {
+            return;
+         }
+      }
+   }
+   filter.separable = true;
+}
+
+/* A normalized width x width Gaussian with sigma = width/6. It is
+ * separable by construction, like the large blurs used in production. */
+static void makeGaussianFilter(int width, Filter &filter)
+{
+   std::vector<float> taps1D(width);
+   float sigma = width/6.0f;
+   float sum = 0.0f;
+   for (int i = 0; i < width; i++) 
+   {
+      float x = (float)(i - width/2);
+      taps1D[i] = exp(-x*x/(2.0f*sigma*sigma));
+      sum += taps1D[i];
+   }
+   filter.width = width;
+   filter.taps.resize(width*width);
+   for (int i = 0; i < width; i++) 
+   {
+      for (int j = 0; j < width; j++) 
+      {
+         filter.taps[i*width + j] = (taps1D[i]/sum)*(taps1D[j]/sum);
+      }
+   }
+}
+
+/* A normalized width x width disk (a box blur with rounded corners), as
+ * used for background estimation. Unlike the Gaussian it is not
+ * separable. */
+static void makeDiskFilter(int width, Filter &filter)
+{
+   float radius = width/2 + 0.5f;
+   float sum = 0.0f;
+   filter.width = width;
+   filter.taps.resize(width*width);
+   for (int i = 0; i < width; i++) 
+   {
+      for (int j = 0; j < width; j++) 
+      {
+         float y = (float)(i - width/2);
+         float x = (float)(j - width/2);
+         filter.taps[i*width + j] = (x*x + y*y <= radius*radius) ? 1.0f : 0.0f;
+         sum += filter.taps[i*width + j];
+      }
+   }
+   for (int i = 0; i < width*width; i++) 
+   {
+      filter.taps[i] /= sum;
+   }
+}
 
-   /* Set the filter here */
+/* Load filter 'selection' of filterList, normalized by its factor. A
+ * positive 'blurWidth' replaces the Gaussian blur with a generated
+ * blurWidth x blurWidth Gaussian; the disk is diskWidth wide. */
+static void loadFilter(int selection, int blurWidth, int diskWidth, 
+   Filter &filter)
+{
    int filterWidth;
    float filterFactor;
-   float *filter;
+   float *filterTaps;
 
-   switch (filterSelection) 
+   switch (selection) 
    {
     case GAUSSIAN_BLUR:
       filterWidth = gaussianBlurFilterWidth;
       filterFactor = gaussianBlurFilterFactor;
-      filter = gaussianBlurFilter;
+      filterTaps = gaussianBlurFilter;
       break;
     case SHARPEN:
       filterWidth = sharpenFilterWidth;
       filterFactor = sharpenFilterFactor;
-      filter = sharpenFilter;
+      filterTaps = sharpenFilter;
       break;
     case EDGE_SHARPEN:
       filterWidth = edgeSharpenFilterWidth;
       filterFactor = edgeSharpenFilterFactor;
-      filter = edgeSharpenFilter;
+      filterTaps = edgeSharpenFilter;
       break;
     case VERT_EDGE_DETECT:
       filterWidth = vertEdgeDetectFilterWidth;
       filterFactor = vertEdgeDetectFilterFactor;
-      filter = vertEdgeDetectFilter;
+      filterTaps = vertEdgeDetectFilter;
       break;
     case EMBOSS:
       filterWidth = embossFilterWidth;
       filterFactor = embossFilterFactor;
-      filter = embossFilter;
+      filterTaps = embossFilter;
       break;
+    case DISK:
+      makeDiskFilter(diskWidth | 1, filter);
+      separateFilter(filter);
+      return;
     default:  
       std::cout << "Invalid filter selection." << std::endl;
-      return 1;
+      exit(-1);
    }
 
+   filter.width = filterWidth;
+   filter.taps.clear();
    for (int i = 0; i < filterWidth*filterWidth; i++) 
    {
-      filter[i] = filter[i]/filterFactor;
+      filter.taps.push_back(filterTaps[i]/filterFactor);
+   }
+   if (selection == GAUSSIAN_BLUR && blurWidth > 0) 
+   {
+      makeGaussianFilter(blurWidth | 1, filter);
+   }
+   separateFilter(filter);
+}
+
+/* Return the filterList entry called 'name', or FILTER_LIST_SIZE */
+static int findFilter(const char *name)
+{
+   for (int f = 0; f < FILTER_LIST_SIZE; f++) 
+   {
+      if (strcmp(name, filterNames[f]) == 0) 
+      {
+         return f;
+      }
+   }
+   return FILTER_LIST_SIZE;
+}
+
+/* Return the program built with 'options', building it on first use */
+static cl::Program& getProgram(Convolver &cv, const std::string &options)
+{
+   std::map<std::string, cl::Program>::iterator it = 
+      cv.programs.find(options);
+   if (it != cv.programs.end()) 
+   {
+      return it->second;
+   }
+
+   profileStageBegin(cv.prof, "build");
+   cl_device_id deviceId = cv.device();
+   cl::Program program = cl::Program(buildProgramCached(cv.context(), 1, 
+      &deviceId, "image-convolution.cl", options.c_str()));
+   profileStageEnd(cv.prof);
+   return cv.programs[options] = program;
+}
+
+/* Return the kernel 'name' of the program built with 'options' */
+static cl::Kernel getKernel(Convolver &cv, const std::string &options,
+   const char *name)
+{
+   std::string key = options + "/" + name;
+   std::map<std::string, cl::Kernel>::iterator it = cv.kernels.find(key);
+   if (it != cv.kernels.end()) 
+   {
+      return it->second;
+   }
+   return cv.kernels[key] = cl::Kernel(getProgram(cv, options), name);
+}
+
+/* Take a single-channel image of 'type' from the pool. The pool keeps
+ * its own reference, so the image stays valid until it is returned or
+ * the pool is released. */
+static cl::Image2D pooledImage(Convolver &cv, cl_mem_flags flags,
+   cl_channel_type type, int rows, int cols)
+{
+   cl_image_format format;
+   format.image_channel_order = CL_R;
+   format.image_channel_data_type = type;
+   cl_mem mem = poolImage2D(cv.pool, cv.context(), flags, &format, cols, 
+      rows);
+   check(clRetainMemObject(mem));
+   return cl::Image2D(mem);
+}
+
+/* Take a buffer of at least 'bytes' bytes from the pool */
+static cl::Buffer pooledBuffer(Convolver &cv, cl_mem_flags flags, 
+   size_t bytes)
+{
+   cl_mem mem = poolBuffer(cv.pool, cv.context(), flags, bytes);
+   check(clRetainMemObject(mem));
+   return cl::Buffer(mem);
+}
+
+/* Return a buffer holding 'taps', uploading them on first use. The taps
+ * of a run's filters never change. */
+static cl::Buffer filterBuffer(Convolver &cv, const std::vector<float> &taps)
+{
+   std::map<const float*, cl::Buffer>::iterator it = 
+      cv.tapBuffers.find(&taps[0]);
+   if (it != cv.tapBuffers.end()) 
+   {
+      return it->second;
+   }
+
+   cl::Buffer buffer = pooledBuffer(cv, CL_MEM_READ_ONLY,
+        taps.size()*sizeof(float));
+   cl::Event event;
+   cv.queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, 
+        taps.size()*sizeof(float), &taps[0], NULL, &event);
+   profileAddEvent(cv.prof, "write filter", event(), 
+        taps.size()*sizeof(float), 0);
+   return cv.tapBuffers[&taps[0]] = buffer;
+}
+
+/* Return the intermediate float image 'name', taking it from the pool
+ * when it does not exist yet or has another size (the old one goes back
+ * to the pool). The queue is in order, so every launch may reuse the
+ * images of the one before. */
+static cl::Image2D scratchImage(Convolver &cv, const std::string &name,
+   int rows, int cols)
+{
+   std::map<std::string, cl::Image2D>::iterator it = 
+      cv.scratchImages.find(name);
+   if (it != cv.scratchImages.end()) 
+   {
+      if (it->second.getImageInfo<CL_IMAGE_WIDTH>() == (size_t)cols &&
+          it->second.getImageInfo<CL_IMAGE_HEIGHT>() == (size_t)rows) 
+      {
+         return it->second;
+      }
+      poolReturn(cv.pool, it->second());
+   }
+   return cv.scratchImages[name] = pooledImage(cv, CL_MEM_READ_WRITE, 
+      CL_FLOAT, rows, cols);
+}
+
+/* Return the intermediate buffer 'name' of at least 'bytes' bytes */
+static cl::Buffer scratchBuffer(Convolver &cv, const std::string &name,
+   size_t bytes)
+{
+   std::map<std::string, cl::Buffer>::iterator it = 
+      cv.scratchBuffers.find(name);
+   if (it != cv.scratchBuffers.end()) 
+   {
+      if (it->second.getInfo<CL_MEM_SIZE>() >= bytes) 
+      {
+         return it->second;
+      }
+      poolReturn(cv.pool, it->second());
+   }
+   return cv.scratchBuffers[name] = pooledBuffer(cv, CL_MEM_READ_WRITE, 
+      bytes);
+}
+
+static void enqueueKernel(Convolver &cv, const cl::Kernel &kernel, 
+   const cl::NDRange &global, const cl::NDRange &local, const char *name,
+   int pixels)
+{
+   cl::Event event;
+   cv.queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL,
+        &event);
+   profileAddEvent(cv.prof, name, event(), 0, pixels);
+}
+
+/* The work-group size of the kernel 'name': 8x8 unless --autotune stored
+ * a faster one for the device (see autotune.h) */
+static const LaunchConfig& launchConfig(Convolver &cv, const char *name)
+{
+   std::map<std::string, LaunchConfig>::iterator it = cv.launch.find(name);
+   if (it == cv.launch.end()) 
+   {
+      LaunchConfig config = {{8, 8}, 1, 0};
+      loadLaunchConfig(getKernel(cv, "", name)(), cv.device(), name, 
+         &config);
+      it = cv.launch.insert(std::make_pair(std::string(name), config)).first;
+   }
+   return it->second;
+}
+
+/* The NDRange of a per-pixel kernel, padded to whole work-groups. The
+ * kernels skip the work-items past the edge of the image, so slices of
+ * the split mode can have any height. */
+static void pixelRange(const LaunchConfig &config, int rows, int cols,
+   cl::NDRange &global, cl::NDRange &local)
+{
+   global = cl::NDRange(roundUp(cols, config.local[0]), 
+      roundUp(rows, config.local[1]));
+   local = cl::NDRange(config.local[0], config.local[1]);
+}
+
+/* Smallest power of two that is at least 'n' */
+static int fftSize(int n)
+{
+   int size = 1;
+   while (size < n) 
+   {
+      size *= 2;
+   }
+   return size;
+}
+
+static int log2Int(int n)
+{
+   int bits = 0;
+   while ((1 << bits) < n) 
+   {
+      bits++;
+   }
+   return bits;
+}
+
+/* Resolve METHOD_AUTO with a simple cost model. The direct kernels do
+ * width*width (or 2*width when separable) multiply-adds per pixel. The
+ * FFT path transforms the padded image, the padded filter and the
+ * product, i.e., three times N/2*log2(N) butterflies for N padded
+ * pixels, plus a few passes to pad, multiply and extract. */
+static convolutionMethod chooseMethod(const Filter &filter, 
+   convolutionMethod method, int rows, int cols)
+{
+   if (method == METHOD_AUTO) 
+   {
+      double directCost = (double)rows*cols*(filter.separable ? 
+         2.0*filter.width : (double)filter.width*filter.width);
+      double fftPixels = (double)fftSize(cols + filter.width - 1)*
+         fftSize(rows + filter.width - 1);
+      double fftCost = fftCostFactor*fftPixels*
+         (1.5*log2Int((int)fftPixels) + 4.0);
+      if (fftCost < directCost) 
+      {
+         method = METHOD_FFT;
+      }
+      else 
+      {
+         method = filter.separable ? METHOD_SEPARABLE : METHOD_2D;
+      }
+   }
+   if (method == METHOD_SEPARABLE && !filter.separable) 
+   {
+      std::cout << "Filter is not separable, using the 2D kernel" 
+         << std::endl;
+      method = METHOD_2D;
+   }
+   return method;
+}
+
+/* Transform the width x height complex values of 'input' into 'output'
+ * (sign -1 forward, +1 inverse without normalization) */
+static void enqueueFFT(Convolver &cv, const cl::Buffer &input, 
+   const cl::Buffer &output, int width, int height, float sign)
+{
+   cl::Kernel reverse = getKernel(cv, "", "fftBitReverse");
+   reverse.setArg(0, input);
+   reverse.setArg(1, output);
+   reverse.setArg(2, log2Int(width));
+   reverse.setArg(3, log2Int(height));
+   enqueueKernel(cv, reverse, cl::NDRange(width, height), cl::NullRange,
+      "fft bit reverse", width*height);
+
+   /* Rows, then columns */
+   cl::Kernel butterfly = getKernel(cv, "", "fftButterfly");
+   butterfly.setArg(0, output);
+   butterfly.setArg(4, sign);
+   butterfly.setArg(2, 1);
+   butterfly.setArg(3, width);
+   for (int span = 1; span < width; span *= 2) 
+   {
+      butterfly.setArg(1, span);
+      enqueueKernel(cv, butterfly, cl::NDRange(width/2, height), 
+         cl::NullRange, "fft row pass", width*height);
+   }
+   butterfly.setArg(2, width);
+   butterfly.setArg(3, 1);
+   for (int span = 1; span < height; span *= 2) 
+   {
+      butterfly.setArg(1, span);
+      enqueueKernel(cv, butterfly, cl::NDRange(height/2, width), 
+         cl::NullRange, "fft column pass", width*height);
+   }
+}
+
+/* Convolve through the frequency domain. The cost does not depend on
+ * the filter width, which pays off for large filters that are not
+ * separable. */
+static void enqueueFFTConvolution(Convolver &cv, const Filter &filter,
+   const cl::Image2D &input, const cl::Image2D &output, int rows, int cols)
+{
+   int fftWidth = fftSize(cols + filter.width - 1);
+   int fftHeight = fftSize(rows + filter.width - 1);
+   size_t bytes = (size_t)fftWidth*fftHeight*sizeof(cl_float2);
+   cl::NDRange fftRange(fftWidth, fftHeight);
+
+   cl::Buffer imageSpectrum = scratchBuffer(cv, "fft image", bytes);
+   cl::Buffer filterSpectrum = scratchBuffer(cv, "fft filter", bytes);
+   cl::Buffer scratch = scratchBuffer(cv, "fft scratch", bytes);
+   cl::Buffer taps = filterBuffer(cv, filter.taps);
+
+   /* Forward transforms of the padded image and filter */
+   cl::Kernel padImage = getKernel(cv, "", "fftPadImage");
+   padImage.setArg(0, input);
+   padImage.setArg(1, scratch);
+   padImage.setArg(2, filter.width/2);
+   padImage.setArg(3, cv.sampler);
+   enqueueKernel(cv, padImage, fftRange, cl::NullRange, "fft pad image",
+      fftWidth*fftHeight);
+   enqueueFFT(cv, scratch, imageSpectrum, fftWidth, fftHeight, 
+      -1.0f);
+
+   cl::Kernel padFilter = getKernel(cv, "", "fftPadFilter");
+   padFilter.setArg(0, taps);
+   padFilter.setArg(1, filter.width);
+   padFilter.setArg(2, scratch);
+   enqueueKernel(cv, padFilter, fftRange, cl::NullRange, "fft pad filter",
+      fftWidth*fftHeight);
+   enqueueFFT(cv, scratch, filterSpectrum, fftWidth, fftHeight, 
+      -1.0f);
+
+   /* Pointwise product and inverse transform */
+   cl::Kernel multiply = getKernel(cv, "", "fftMultiply");
+   multiply.setArg(0, imageSpectrum);
+   multiply.setArg(1, filterSpectrum);
+   multiply.setArg(2, 1.0f/((float)fftWidth*fftHeight));
+   enqueueKernel(cv, multiply, cl::NDRange(fftWidth*fftHeight), 
+      cl::NullRange, "fft multiply", fftWidth*fftHeight);
+   enqueueFFT(cv, imageSpectrum, scratch, fftWidth, fftHeight, 
+      1.0f);
+
+   cl::Kernel extract = getKernel(cv, "", "fftExtract");
+   extract.setArg(0, scratch);
+   extract.setArg(1, fftWidth);
+   extract.setArg(2, output);
+   enqueueKernel(cv, extract, cl::NDRange(cols, rows), cl::NullRange,
+      "fft extract", rows*cols);
+}
+
+/* Enqueue the convolution of 'input' with 'filter' into 'output' */
+static void enqueueConvolution(Convolver &cv, const Filter &filter,
+   convolutionMethod method, const cl::Image2D &input, 
+   const cl::Image2D &output, int rows, int cols)
+{
+   cl::NDRange global;
+   cl::NDRange local;
+
+   if (method == METHOD_FFT) 
+   {
+      enqueueFFTConvolution(cv, filter, input, output, rows, cols);
+      return;
+   }
+
+   if (method == METHOD_SEPARABLE) 
+   {
+      /* Row pass into an intermediate image, then the column pass. This
+       * reads 2*width instead of width*width pixels per output pixel. */
+      cl::Image2D tempImage = scratchImage(cv, "separable", rows, cols);
+      cl::Buffer rowBuffer = filterBuffer(cv, filter.rowTaps);
+      cl::Buffer columnBuffer = filterBuffer(cv, filter.columnTaps);
+
+      cl::Kernel rowKernel = getKernel(cv, "", "convolutionRow");
+      rowKernel.setArg(0, input);
+      rowKernel.setArg(1, tempImage);
+      rowKernel.setArg(2, rowBuffer);
+      rowKernel.setArg(3, filter.width);
+      rowKernel.setArg(4, cv.sampler);
+      pixelRange(launchConfig(cv, "convolutionRow"), rows, cols, global, 
+         local);
+      enqueueKernel(cv, rowKernel, global, local, "convolution row pass",
+         rows*cols);
+
+      cl::Kernel columnKernel = getKernel(cv, "", "convolutionColumn");
+      columnKernel.setArg(0, tempImage);
+      columnKernel.setArg(1, output);
+      columnKernel.setArg(2, columnBuffer);
+      columnKernel.setArg(3, filter.width);
+      columnKernel.setArg(4, cv.sampler);
+      pixelRange(launchConfig(cv, "convolutionColumn"), rows, cols, global, 
+         local);
+      enqueueKernel(cv, columnKernel, global, local, 
+         "convolution column pass", rows*cols);
+      return;
+   }
+
+   cl::Buffer taps = filterBuffer(cv, filter.taps);
+   if (method == METHOD_TILED) 
+   {
+      /* The tiled kernel is specialized for the filter width. A
+       * work-group covers tileSize*tiledPixelsPerItem x tileSize output
+       * pixels. */
+      char options[128];
+      sprintf(options, "-D FILTER_WIDTH=%d -D TILE_WIDTH=%d "
+         "-D TILE_HEIGHT=%d -D PIXELS_PER_ITEM=%d", filter.width, 
+         cv.tileSize, cv.tileSize, tiledPixelsPerItem);
+      cl::Kernel kernel = getKernel(cv, options, "convolutionTiled");
+      kernel.setArg(0, input);
+      kernel.setArg(1, output);
+      kernel.setArg(2, taps);
+      kernel.setArg(3, cv.sampler);
+
+      int blockWidth = cv.tileSize*tiledPixelsPerItem;
+      global = cl::NDRange(
+         (cols + blockWidth - 1)/blockWidth*cv.tileSize,
+         (rows + cv.tileSize - 1)/cv.tileSize*cv.tileSize);
+      local = cl::NDRange(cv.tileSize, cv.tileSize);
+      enqueueKernel(cv, kernel, global, local, "convolution kernel", 
+         rows*cols);
+      return;
+   }
+
+   cl::Kernel kernel = getKernel(cv, "", "convolution");
+   kernel.setArg(0, input);
+   kernel.setArg(1, output);
+   kernel.setArg(2, taps);
+   kernel.setArg(3, filter.width);
+   kernel.setArg(4, cv.sampler);
+   pixelRange(launchConfig(cv, "convolution"), rows, cols, global, local);
+   enqueueKernel(cv, kernel, global, local, "convolution kernel", rows*cols);
+}
+
+/* Enqueue a copy of 'input' into 'output' multiplied by 'scale', which
+ * converts between image storage formats */
+static void enqueueConvert(Convolver &cv, const cl::Image2D &input,
+   const cl::Image2D &output, float scale, int rows, int cols)
+{
+   cl::Kernel kernel = getKernel(cv, "", "convertImage");
+   kernel.setArg(0, input);
+   kernel.setArg(1, output);
+   kernel.setArg(2, scale);
+   cl::NDRange global;
+   cl::NDRange local;
+   pixelRange(launchConfig(cv, "convertImage"), rows, cols, global, local);
+   enqueueKernel(cv, kernel, global, local, "convert image", rows*cols);
+}
+
+/* One kernel timed by the autotuner */
+struct PixelLaunch
+{
+   cl::CommandQueue queue;
+   cl::Kernel kernel;
+   int rows;
+   int cols;
+};
+
+static cl_event launchPixels(void *arg, const LaunchConfig *config)
+{
+   PixelLaunch *launch = (PixelLaunch*)arg;
+   cl::NDRange global;
+   cl::NDRange local;
+   cl::Event event;
+
+   pixelRange(*config, launch->rows, launch->cols, global, local);
+   try 
+   {
+      launch->queue.enqueueNDRangeKernel(launch->kernel, cl::NullRange, 
+         global, local, NULL, &event);
+   }
+   catch (cl::Error error) 
+   {
+      return NULL;
+   }
+   /* The autotuner releases the event */
+   clRetainEvent(event());
+   return event();
+}
+
+/* Time the per-pixel kernels for every work-group shape on the actual
+ * images and store the fastest shapes. The filter kernels only read the
+ * first 'width' taps in the separable passes, so all of them can share
+ * the taps of 'filter'. */
+static void tuneKernels(Convolver &cv, const Filter &filter, 
+   const cl::Image2D &input, const cl::Image2D &output, int rows, int cols)
+{
+   static const char *kernelNames[] = {
+      "convolution", "convolutionRow", "convolutionColumn", "convertImage"
+   };
+   cl::Buffer taps = filterBuffer(cv, filter.taps);
+   cl::Program &program = getProgram(cv, "");
+
+   for (int k = 0; k < 4; k++) 
+   {
+      PixelLaunch launch;
+      launch.queue = cv.queue;
+      launch.kernel = cl::Kernel(program, kernelNames[k]);
+      launch.rows = rows;
+      launch.cols = cols;
+      launch.kernel.setArg(0, input);
+      launch.kernel.setArg(1, output);
+      if (k < 3) 
+      {
+         launch.kernel.setArg(2, taps);
+         launch.kernel.setArg(3, filter.width);
+         launch.kernel.setArg(4, cv.sampler);
+      }
+      else 
+      {
+         launch.kernel.setArg(2, 1.0f);
+      }
+
+      size_t sizes[64][2];
+      LaunchConfig candidates[64];
+      int numSizes = localSizeCandidates(launch.kernel(), cv.device(), 2, 
+         sizes, 64);
+      for (int c = 0; c < numSizes; c++) 
+      {
+         candidates[c].local[0] = sizes[c][0];
+         candidates[c].local[1] = sizes[c][1];
+         candidates[c].items = 1;
+         candidates[c].groups = 0;
+      }
+      if (numSizes > 0) 
+      {
+         cv.launch[kernelNames[k]] = autotuneKernel(cv.device(), 
+            kernelNames[k], candidates, numSizes, launchPixels, &launch);
+      }
+   }
+}
+
+/* Whether two adjacent stages of a chain can run as one fused kernel.
+ * Separable and FFT stages are cheaper on their own, and the tiles of
+ * both filters must fit in local memory. */
+static bool canFuse(const Convolver &cv, const Filter &first, 
+   convolutionMethod firstMethod, const Filter &second, 
+   convolutionMethod secondMethod)
+{
+   if (firstMethod == METHOD_SEPARABLE || secondMethod == METHOD_SEPARABLE ||
+       firstMethod == METHOD_FFT || secondMethod == METHOD_FFT) 
+   {
+      return false;
+   }
+   size_t midWidth = cv.tileSize + second.width - 1;
+   size_t inWidth = midWidth + first.width - 1;
+   size_t localBytes = (midWidth*midWidth + inWidth*inWidth)*sizeof(float);
+   return localBytes <= cv.localMemSize;
+}
+
+/* Enqueue 'first' followed by 'second' as one kernel */
+static void enqueueFused(Convolver &cv, const Filter &first, 
+   const Filter &second, const cl::Image2D &input, const cl::Image2D &output,
+   int rows, int cols)
+{
+   char options[128];
+   sprintf(options, "-D FIRST_WIDTH=%d -D SECOND_WIDTH=%d -D TILE_WIDTH=%d "
+      "-D TILE_HEIGHT=%d", first.width, second.width, cv.tileSize, 
+      cv.tileSize);
+   cl::Buffer firstTaps = filterBuffer(cv, first.taps);
+   cl::Buffer secondTaps = filterBuffer(cv, second.taps);
+
+   cl::Kernel kernel = getKernel(cv, options, "convolutionFused");
+   kernel.setArg(0, input);
+   kernel.setArg(1, output);
+   kernel.setArg(2, firstTaps);
+   kernel.setArg(3, secondTaps);
+   kernel.setArg(4, cv.sampler);
+
+   cl::NDRange global((cols + cv.tileSize - 1)/cv.tileSize*cv.tileSize,
+      (rows + cv.tileSize - 1)/cv.tileSize*cv.tileSize);
+   cl::NDRange local(cv.tileSize, cv.tileSize);
+   enqueueKernel(cv, kernel, global, local, "fused convolution kernel",
+      rows*cols);
+}
+
+/* Apply the filters of 'chain' in order, each with the method chosen
+ * for it in 'methods'. Intermediate results ping-pong
+ * between two images that stay on the device; adjacent stages are fused
+ * into one kernel when 'fuse' is set and canFuse() allows it. */
+static void enqueueChain(Convolver &cv, const std::vector<Filter> &chain,
+   const std::vector<convolutionMethod> &methods, bool fuse, 
+   const cl::Image2D &input, const cl::Image2D &output, int rows, int cols)
+{
+   /* Group the stages into launches of one or two filters */
+   std::vector<int> launchSizes;
+   for (size_t s = 0; s < chain.size(); s += launchSizes.back()) 
+   {
+      if (fuse && s + 1 < chain.size() && canFuse(cv, chain[s], 
+         methods[s], chain[s + 1], methods[s + 1])) 
+      {
+         launchSizes.push_back(2);
+      }
+      else 
+      {
+         launchSizes.push_back(1);
+      }
+   }
+
+   cl::Image2D pingPong[2];
+   if (launchSizes.size() > 1) 
+   {
+      pingPong[0] = scratchImage(cv, "ping", rows, cols);
+      pingPong[1] = scratchImage(cv, "pong", rows, cols);
+   }
+
+   size_t s = 0;
+   for (size_t l = 0; l < launchSizes.size(); l++) 
+   {
+      const cl::Image2D &src = (l == 0) ? input : pingPong[(l - 1)%2];
+      const cl::Image2D &dst = (l == launchSizes.size() - 1) ? 
+         output : pingPong[l%2];
+      if (launchSizes[l] == 2) 
+      {
+         if (cv.logStages) 
+         {
+            std::cout << "Stages " << s + 1 << "-" << s + 2 << ": fused" 
+               << std::endl;
+         }
+         enqueueFused(cv, chain[s], chain[s + 1], src, dst, rows, cols);
+      }
+      else 
+      {
+         if (cv.logStages) 
+         {
+            std::cout << "Stage " << s + 1 << ": " 
+               << methodNames[methods[s]] << std::endl;
+         }
+         enqueueConvolution(cv, chain[s], methods[s], src, dst, rows, cols);
+      }
+      s += launchSizes[l];
+   }
+}
+
+/* Select a device (a GPU unless --device says otherwise, falling back
+ * to a CPU device) and create the context, command queue and sampler of
+ * a single-device run, whose objects come from 'pool' */
+static void initConvolver(Convolver &cv, int argc, char **argv, 
+   MemPool *pool, Profiler *prof)
+{
+   cv.prof = prof;
+   cv.pool = pool;
+   cv.logStages = true;
+   cv.device = cl::Device(selectDevice(getOption(argc, argv, "device", 
+      "OCL_DEVICE"), CL_DEVICE_TYPE_GPU, NULL));
+   printDevice("Device", cv.device());
+
+   /* Create a context and a command queue for the device. The queue is
+    * in-order, as most paths chain their commands without events, and
+    * profiles so that the command graph can time the transfers. */
+   cv.context = cl::Context(cv.device);
+   cv.queue = cl::CommandQueue(cv.context, cv.device,
+      queueProperties(argc, argv, cv.device()) | CL_QUEUE_PROFILING_ENABLE);
+
+   /* The tiled kernel uses 16x16 work-groups where the device allows
+    * them */
+   cv.tileSize = 
+      cv.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= 256 ? 16 : 8;
+   cv.localMemSize = cv.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+   /* Create the sampler */
+   cv.sampler = cl::Sampler(cv.context, CL_FALSE, 
+      CL_ADDRESS_CLAMP_TO_EDGE, CL_FILTER_NEAREST);
+}
+
+/* Default number of frames of the split mode ("--frames N") */
+static const int defaultSplitFrames = 5;
+
+/* One device of the split mode and its share of the image rows */
+struct SplitDevice
+{
+   Convolver cv;
+   double share;
+   int firstRow;
+   int numRows;
+};
+
+/* Return every device of 'platform'. CPU devices are partitioned into
+ * sub-devices of 'cpuUnits' compute units each when 'cpuUnits' is
+ * positive, so that each sub-device gets its own slice and queue. */
+static std::vector<cl::Device> splitDevices(cl_platform_id platform,
+   int cpuUnits)
+{
+   cl_uint numDevices = 0;
+   check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices));
+   std::vector<cl_device_id> ids(numDevices);
+   check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, numDevices, &ids[0],
+      NULL));
+
+   std::vector<cl::Device> devices;
+   for (cl_uint d = 0; d < numDevices; d++) 
+   {
+      cl_device_type type;
+      check(clGetDeviceInfo(ids[d], CL_DEVICE_TYPE, sizeof(type), &type,
+         NULL));
+      if (cpuUnits > 0 && (type & CL_DEVICE_TYPE_CPU)) 
+      {
+         cl_device_partition_property properties[] = {
+            CL_DEVICE_PARTITION_EQUALLY, cpuUnits, 0};
+         cl_uint numSubDevices = 0;
+         if (clCreateSubDevices(ids[d], properties, 0, NULL, 
+               &numSubDevices) == CL_SUCCESS && numSubDevices > 0) 
+         {
+            std::vector<cl_device_id> subIds(numSubDevices);
+            check(clCreateSubDevices(ids[d], properties, numSubDevices,
+               &subIds[0], NULL));
+            for (cl_uint s = 0; s < numSubDevices; s++) 
+            {
+               devices.push_back(cl::Device(subIds[s]));
+            }
+            continue;
+         }
+         std::cout << "Cannot partition the CPU device, using it whole" 
+            << std::endl;
+      }
+      devices.push_back(cl::Device(ids[d]));
+   }
+   return devices;
+}
+
+/* Split the rows of the image across every device of the selected
+ * device's platform ("--split"). Each device convolves a slice of rows
+ * plus the halo rows the filter chain needs, and its rows of the result
+ * are read straight into their place in 'output'. The image is processed
+ * for "--frames" frames; the first split follows compute units times
+ * clock rate, and each later one the rows per second every device
+ * achieved in the previous frame, measured from its events. The slices
+ * come from 'pool', so a frame reuses the slices of the one before when
+ * the split has not changed. Returns the first device for the timing
+ * report. */
+static cl_device_id runSplit(int argc, char **argv, 
+   const std::vector<Filter> &chain, 
+   const std::vector<convolutionMethod> &methods, bool fuse, float *input, 
+   float *output, int rows, int cols, MemPool *pool, Profiler *prof)
+{
+   cl_device_id selected = selectDevice(getOption(argc, argv, "device", 
+      "OCL_DEVICE"), CL_DEVICE_TYPE_GPU, NULL);
+   cl_platform_id platform;
+   check(clGetDeviceInfo(selected, CL_DEVICE_PLATFORM, sizeof(platform),
+      &platform, NULL));
+   std::vector<cl::Device> devices = splitDevices(platform, 
+      getIntOption(argc, argv, "cpu-partition", NULL, 0));
+   cl::Context context(devices);
+   cl::Sampler sampler(context, CL_FALSE, CL_ADDRESS_CLAMP_TO_EDGE, 
+      CL_FILTER_NEAREST);
+
+   /* Rows above and below a slice that the chain reads */
+   int halo = 0;
+   for (size_t s = 0; s < chain.size(); s++) 
+   {
+      halo += chain[s].width/2;
+   }
+
+   std::vector<SplitDevice> split(devices.size());
+   double totalGuess = 0.0;
+   for (size_t d = 0; d < devices.size(); d++) 
+   {
+      cl_device_id id = devices[d]();
+      Convolver &cv = split[d].cv;
+      cv.context = context;
+      cv.device = devices[d];
+      cv.queue = cl::CommandQueue(context, devices[d], 
+         queueProperties(argc, argv, id) | CL_QUEUE_PROFILING_ENABLE);
+      cv.sampler = sampler;
+      cv.tileSize = 
+         cv.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= 256 ? 16 : 8;
+      cv.localMemSize = cv.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+      cv.prof = prof;
+      cv.pool = pool;
+      cv.logStages = true;
+
+      cl_uint units;
+      cl_uint clock;
+      check(clGetDeviceInfo(id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units),
+         &units, NULL));
+      check(clGetDeviceInfo(id, CL_DEVICE_MAX_CLOCK_FREQUENCY, 
+         sizeof(clock), &clock, NULL));
+      split[d].share = (double)units*(clock > 0 ? clock : 1);
+      totalGuess += split[d].share;
+      printDevice("Split device", id);
+   }
+   for (size_t d = 0; d < split.size(); d++) 
+   {
+      split[d].share /= totalGuess;
+   }
+   profileStageEnd(prof);
+
+   int frames = getIntOption(argc, argv, "frames", NULL, defaultSplitFrames);
+   for (int frame = 0; frame < frames; frame++) 
+   {
+      /* Assign consecutive rows by rounding the cumulative shares */
+      double cumulative = 0.0;
+      int firstRow = 0;
+      for (size_t d = 0; d < split.size(); d++) 
+      {
+         cumulative += split[d].share;
+         int endRow = (d == split.size() - 1) ? rows : 
+            std::min(rows, (int)(cumulative*rows + 0.5));
+         split[d].firstRow = firstRow;
+         split[d].numRows = std::max(0, endRow - firstRow);
+         firstRow += split[d].numRows;
+      }
+
+      /* Enqueue every slice before waiting for any of them */
+      std::vector<cl::Event> writeEvents(split.size());
+      std::vector<cl::Event> readEvents(split.size());
+      for (size_t d = 0; d < split.size(); d++) 
+      {
+         SplitDevice &sd = split[d];
+         if (sd.numRows == 0) 
+         {
+            continue;
+         }
+         int haloTop = std::min(halo, sd.firstRow);
+         int haloBottom = std::min(halo, rows - sd.firstRow - sd.numRows);
+         int sliceRows = sd.numRows + haloTop + haloBottom;
+
+         cl::Image2D sliceInput = pooledImage(sd.cv, CL_MEM_READ_ONLY, 
+            CL_FLOAT, sliceRows, cols);
+         cl::Image2D sliceOutput = pooledImage(sd.cv, CL_MEM_READ_WRITE, 
+            CL_FLOAT, sliceRows, cols);
+
+         cl::size_t<3> origin;
+         origin[0] = 0;
+         origin[1] = 0;
+         origin[2] = 0;
+         cl::size_t<3> region;
+         region[0] = cols;
+         region[1] = sliceRows;
+         region[2] = 1;
+         sd.cv.queue.enqueueWriteImage(sliceInput, CL_FALSE, origin, region,
+            0, 0, input + (size_t)(sd.firstRow - haloTop)*cols, NULL, 
+            &writeEvents[d]);
+         profileAddEvent(prof, "write slice", writeEvents[d](), 
+            (double)sliceRows*cols*sizeof(float), 0);
+
+         enqueueChain(sd.cv, chain, methods, fuse, sliceInput, sliceOutput,
+            sliceRows, cols);
+
+         /* Only the slice's own rows are read back */
+         origin[1] = haloTop;
+         region[1] = sd.numRows;
+         sd.cv.queue.enqueueReadImage(sliceOutput, CL_FALSE, origin, region,
+            0, 0, output + (size_t)sd.firstRow*cols, NULL, &readEvents[d]);
+         profileAddEvent(prof, "read slice", readEvents[d](), 
+            (double)sd.numRows*cols*sizeof(float), 0);
+         sd.cv.queue.flush();
+
+         /* The slices can be taken again once they have been read */
+         poolReturnAfter(pool, sliceInput(), readEvents[d]());
+         poolReturnAfter(pool, sliceOutput(), readEvents[d]());
+      }
+
+      /* Measure each device from the start of its upload to the end of
+       * its read-back and re-balance the shares */
+      double totalRate = 0.0;
+      std::vector<double> rates(split.size(), 0.0);
+      std::cout << "Frame " << frame + 1 << ":";
+      for (size_t d = 0; d < split.size(); d++) 
+      {
+         SplitDevice &sd = split[d];
+         if (sd.numRows == 0) 
+         {
+            std::cout << " 0 rows";
+            continue;
+         }
+         readEvents[d].wait();
+         cl_ulong start = 
+            writeEvents[d].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+         cl_ulong end = 
+            readEvents[d].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+         double ms = (end - start)*1e-6;
+         rates[d] = sd.numRows/std::max(ms, 1e-3);
+         totalRate += rates[d];
+         std::cout << " " << sd.numRows << " rows in " << ms << " ms";
+      }
+      std::cout << std::endl;
+
+      /* A device that got no rows keeps a small share so that it is
+       * measured again */
+      for (size_t d = 0; d < split.size(); d++) 
+      {
+         split[d].share = (rates[d] > 0.0) ? rates[d]/totalRate : 0.01;
+      }
+   }
+
+   return devices[0]();
+}
+
+/* Frames of the serve mode in flight at once: one being uploaded, one
+ * convolved and one downloaded */
+static const int serveSlots = 3;
+
+/* One buffer set of the serve pipeline */
+struct ServeSlot
+{
+   cl::Image2D input;
+   cl::Image2D output;
+   std::vector<char> hInput;
+   std::vector<char> hOutput;
+   cl::Event downloaded;
+   double start;
+   bool busy;
+};
+
+/* Open 'path' for the frames of the serve mode: "-" (or nothing) is
+ * stdin, or 'stdoutFd' for the output, a UNIX socket is connected to,
+ * and anything else, such as a file or a named pipe, is opened as a
+ * file */
+static FILE* openFrameStream(const char *path, bool output, int stdoutFd)
+{
+   if (!path || !path[0] || strcmp(path, "-") == 0) 
+   {
+      return output ? fdopen(stdoutFd, "wb") : stdin;
+   }
+
+   struct stat st;
+   if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) 
+   {
+      struct sockaddr_un addr;
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+      if (fd < 0 || 
+          connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) 
+      {
+         std::cout << "Cannot connect to " << path << std::endl;
+         exit(-1);
+      }
+      return fdopen(fd, output ? "wb" : "rb");
+   }
+
+   FILE *fp = fopen(path, output ? "wb" : "rb");
+   if (!fp) 
+   {
+      std::cout << "Cannot open " << path << std::endl;
+      exit(-1);
+   }
+   return fp;
+}
+
+/* Wait for the frame of 'slot', write it out and record its latency */
+static void finishFrame(ServeSlot &slot, FILE *out, 
+   std::vector<double> &latencies)
+{
+   slot.downloaded.wait();
+   if (fwrite(&slot.hOutput[0], 1, slot.hOutput.size(), out) != 
+       slot.hOutput.size()) 
+   {
+      std::cout << "Cannot write a frame" << std::endl;
+      exit(-1);
+   }
+   fflush(out);
+   latencies.push_back(wallTime() - slot.start);
+   slot.busy = false;
+}
+
+/* The nearest-rank 'percent' percentile of the ascending 'sorted', the
+ * entry at ceil(percent/100*n) - 1, computed in integers */
+static double nearestRank(const std::vector<double> &sorted, int percent)
+{
+   size_t n = sorted.size();
+   size_t rank = (percent*n + 99)/100;
+   return sorted[rank > 0 ? std::min(rank, n) - 1 : 0];
+}
+
+/* Run as a service ("--serve [PATH]"): initialize once, then filter raw
+ * frames of rows x cols pixels in the input storage format read from
+ * PATH (stdin by default) and write them in the output storage format
+ * to "--serve-output PATH" (by default 'stdoutFd', the original stdout,
+ * as main sends the messages to stderr) until the input ends.
+ * Uploads and downloads have their own queues, so with three buffer
+ * sets frame N+1 is uploaded and frame N-1 downloaded while frame N is
+ * convolved; the kernels, filter buffers and intermediate images stay
+ * warm across frames. Prints the p50/p99 latency from reading a frame to
+ * writing it and the sustained frame rate. The images come from 'pool'. */
+static cl_device_id runServe(int argc, char **argv, 
+   const std::vector<Filter> &chain, 
+   const std::vector<convolutionMethod> &methods, bool fuse, int rows, 
+   int cols, ImageStorage inputStorage, ImageStorage outputStorage, 
+   int stdoutFd, MemPool *pool, Profiler *prof)
+{
+   Convolver cv;
+   initConvolver(cv, argc, argv, pool, prof);
+   checkStorageSupported(cv.context(), CL_MEM_READ_ONLY, 
+      CL_MEM_OBJECT_IMAGE2D, inputStorage);
+   checkStorageSupported(cv.context(), CL_MEM_WRITE_ONLY, 
+      CL_MEM_OBJECT_IMAGE2D, outputStorage);
+   cl::CommandQueue uploadQueue(cv.context, cv.device, 
+      queueProperties(argc, argv, cv.device()));
+   cl::CommandQueue downloadQueue(cv.context, cv.device, 
+      queueProperties(argc, argv, cv.device()));
+
+   ServeSlot slots[serveSlots];
+   for (int i = 0; i < serveSlots; i++) 
+   {
+      slots[i].input = pooledImage(cv, CL_MEM_READ_ONLY, 
+         storageFormat(inputStorage).image_channel_data_type, rows, cols);
+      slots[i].output = pooledImage(cv, CL_MEM_WRITE_ONLY, 
+         storageFormat(outputStorage).image_channel_data_type, rows, cols);
+      slots[i].hInput.resize((size_t)rows*cols*storagePixelSize(inputStorage));
+      slots[i].hOutput.resize(
+         (size_t)rows*cols*storagePixelSize(outputStorage));
+      slots[i].busy = false;
+   }
+
+   FILE *in = openFrameStream(getOption(argc, argv, "serve", NULL), false,
+      stdoutFd);
+   FILE *out = openFrameStream(getOption(argc, argv, "serve-output", NULL),
+      true, stdoutFd);
+   if (!out) 
+   {
+      std::cout << "Cannot open the frame output" << std::endl;
+      exit(-1);
+   }
+   profileStageEnd(prof);
+
+   cl::size_t<3> origin;
+   origin[0] = 0;
+   origin[1] = 0;
+   origin[2] = 0;
+   cl::size_t<3> region;
+   region[0] = cols;
+   region[1] = rows;
+   region[2] = 1;
+
+   std::vector<double> latencies;
+   double firstStart = 0.0;
+   for (long frame = 0; ; frame++) 
+   {
+      ServeSlot &slot = slots[frame % serveSlots];
+      if (slot.busy) 
+      {
+         finishFrame(slot, out, latencies);
+      }
+
+      /* At the end of the input, drain the older frames in order */
+      if (fread(&slot.hInput[0], 1, slot.hInput.size(), in) != 
+          slot.hInput.size()) 
+      {
+         for (int i = 1; i < serveSlots; i++) 
+         {
+            ServeSlot &older = slots[(frame + i) % serveSlots];
+            if (older.busy) 
+            {
+               finishFrame(older, out, latencies);
+            }
+         }
+         break;
+      }
+      slot.start = wallTime();
+      if (frame == 0) 
+      {
+         firstStart = slot.start;
+      }
+
+      /* Upload, convolve after the upload, download after the kernels */
+      std::vector<cl::Event> waitList(1);
+      uploadQueue.enqueueWriteImage(slot.input, CL_FALSE, origin, region, 
+         0, 0, &slot.hInput[0], NULL, &waitList[0]);
+      uploadQueue.flush();
+      cv.queue.enqueueBarrierWithWaitList(&waitList);
+      if (inputStorage != STORAGE_FLOAT || outputStorage != STORAGE_FLOAT) 
+      {
+         cl::Image2D filterInput = slot.input;
+         cl::Image2D filterOutput = slot.output;
+         if (inputStorage != STORAGE_FLOAT) 
+         {
+            filterInput = scratchImage(cv, "filter input", rows, cols);
+            enqueueConvert(cv, slot.input, filterInput, 
+               storageScale(inputStorage), rows, cols);
+         }
+         if (outputStorage != STORAGE_FLOAT) 
+         {
+            filterOutput = scratchImage(cv, "filter output", rows, cols);
+         }
+         enqueueChain(cv, chain, methods, fuse, filterInput, filterOutput, 
+            rows, cols);
+         if (outputStorage != STORAGE_FLOAT) 
+         {
+            enqueueConvert(cv, filterOutput, slot.output, 
+               1.0f/storageScale(outputStorage), rows, cols);
+         }
+      }
+      else 
+      {
+         enqueueChain(cv, chain, methods, fuse, slot.input, slot.output, 
+            rows, cols);
+      }
+      cv.queue.enqueueMarkerWithWaitList(NULL, &waitList[0]);
+      cv.queue.flush();
+      cv.logStages = false;
+      downloadQueue.enqueueReadImage(slot.output, CL_FALSE, origin, region,
+         0, 0, &slot.hOutput[0], &waitList, &slot.downloaded);
+      downloadQueue.flush();
+      slot.busy = true;
+   }
+
+   /* Report the latency percentiles and the sustained frame rate */
+   if (latencies.empty()) 
+   {
+      std::cout << "No frames of " << cols << "x" << rows << " received" 
+         << std::endl;
+   }
+   else 
+   {
+      double elapsed = wallTime() - firstStart;
+      std::vector<double> sorted = latencies;
+      std::sort(sorted.begin(), sorted.end());
+      size_t n = sorted.size();
+      double p50 = nearestRank(sorted, 50);
+      double p99 = nearestRank(sorted, 99);
+      printf("Served %lu frames of %dx%d: latency p50 %.3f ms, "
+         "p99 %.3f ms, %.1f frames/s\n", (unsigned long)n, cols, rows, 
+         p50, p99, elapsed > 0.0 ? n*1000.0/elapsed : 0.0);
+   }
+
+   if (in != stdin) 
+   {
+      fclose(in);
+   }
+   fclose(out);
+   return cv.device();
+}
+
+int main(int argc, char **argv) 
+{
+   void *hInputImage;
+   char *hOutputData;
+   float *hOutputImage;
+
+   int imageRows;
+   int imageCols;
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "image-convolution", argc, argv);
+   cl_device_id deviceId = NULL;
+
+   /* The device buffers and images come from a pool (see memory-pool.h).
+    * Its objects are released at the end, after the wrappers. */
+   MemPool pool;
+   poolInit(&pool);
+
+   /* "--serve [PATH]" filters a stream of raw frames (see runServe). When
+    * the frames go to stdout, the messages are moved to stderr. */
+   bool serve = getOption(argc, argv, "serve", NULL) != NULL;
+   int stdoutFd = 1;
+   const char *serveOutput = getOption(argc, argv, "serve-output", NULL);
+   if (serve && (!serveOutput || strcmp(serveOutput, "-") == 0)) 
+   {
+      fflush(stdout);
+      stdoutFd = dup(1);
+      dup2(2, 1);
+   }
+
+   /* "--filter NAME" overrides the selection above, "--blur-width N"
+    * replaces the Gaussian blur with an N x N Gaussian and "--disk-width N"
+    * sets the width of the disk filter */
+   int selection = filterSelection;
+   int blurWidth = getIntOption(argc, argv, "blur-width", NULL, 0);
+   int diskWidth = getIntOption(argc, argv, "disk-width", NULL, 
+      defaultDiskWidth);
+   const char *filterName = getOption(argc, argv, "filter", NULL);
+   if (filterName) 
+   {
+      selection = findFilter(filterName);
+   }
+   else if (blurWidth > 0) 
+   {
+      selection = GAUSSIAN_BLUR;
+   }
+
+   /* "--chain NAME,NAME,..." applies several filters in order without
+    * copying the intermediate images back to the host */
+   std::vector<Filter> chain;
+   const char *chainNames = getOption(argc, argv, "chain", NULL);
+   if (chainNames) 
+   {
+      std::string names = chainNames;
+      size_t start = 0;
+      while (start <= names.size()) 
+      {
+         size_t end = names.find(',', start);
+         if (end == std::string::npos) 
+         {
+            end = names.size();
+         }
+         std::string name = names.substr(start, end - start);
+         Filter filter;
+         loadFilter(findFilter(name.c_str()), blurWidth, diskWidth, 
+            filter);
+         chain.push_back(filter);
+         start = end + 1;
+      }
+   }
+   else 
+   {
+      Filter filter;
+      loadFilter(selection, blurWidth, diskWidth, filter);
+      chain.push_back(filter);
+   }
+
+   /* Adjacent stages are fused unless "--no-fuse" is given */
+   bool fuse = !hasOption(argc, argv, "no-fuse", NULL);
+
+   /* "--kernel auto|2d|tiled|separable|fft" selects how the filters are
+    * applied. The default runs separable filters as two 1D passes and
+    * switches to the FFT when the cost model favours it. */
+   convolutionMethod method = METHOD_AUTO;
+   const char *methodName = getOption(argc, argv, "kernel", NULL);
+   if (methodName) 
+   {
+      int m = 0;
+      while (m < METHOD_LIST_SIZE && strcmp(methodName, methodNames[m]) != 0)
+      {
+         m++;
+      }
+      if (m == METHOD_LIST_SIZE) 
+      {
+         std::cout << "Unknown kernel " << methodName 
+            << ", use auto, 2d, tiled, separable or fft" << std::endl;
+         exit(-1);
+      }
+      method = (convolutionMethod)m;
    }
 
+   /* Pixel storage of the input and output images ("--format", or
+    * "--input-format" and "--output-format", see image-storage.h). The
+    * filters always run on float images; the other formats are converted
+    * on the device and only reduce the data transferred. */
+   ImageStorage inputStorage = getImageStorage(argc, argv, "input-format",
+      STORAGE_FLOAT);
+   ImageStorage outputStorage = getImageStorage(argc, argv, 
+      "output-format", STORAGE_FLOAT);
+
+   /* "--split" spreads the rows over all devices (see runSplit). It works
+    * on float images only. */
+   bool split = hasOption(argc, argv, "split", NULL) && !serve;
+   if (split && (inputStorage != STORAGE_FLOAT || 
+      outputStorage != STORAGE_FLOAT)) 
+   {
+      std::cout << "The split mode uses float images" << std::endl;
+      inputStorage = STORAGE_FLOAT;
+      outputStorage = STORAGE_FLOAT;
+   }
+
+   profileStageBegin(&prof, "setup");
 
    /* Read in the BMP image */
-   hInputImage = readBmpFloat(inputImagePath, &imageRows, &imageCols);
+   hInputImage = readBmpStorage(inputImagePath, &imageRows, &imageCols,
+      inputStorage);
+
+   /* The served frames are "--frame-size COLSxROWS", by default the size
+    * of the input image */
+   const char *frameSize = getOption(argc, argv, "frame-size", NULL);
+   if (serve && frameSize) 
+   {
+      if (sscanf(frameSize, "%dx%d", &imageCols, &imageRows) != 2 ||
+          imageCols <= 0 || imageRows <= 0) 
+      {
+         std::cout << "Invalid frame size " << frameSize << std::endl;
+         exit(-1);
+      }
+   }
+   size_t outputSize = imageRows*imageCols*storagePixelSize(outputStorage);
+
+   /* Choose the method of each stage, which depends on the image size */
+   std::vector<convolutionMethod> methods;
+   for (size_t s = 0; s < chain.size(); s++) 
+   {
+      methods.push_back(chooseMethod(chain[s], method, imageRows, 
+         imageCols));
+      std::cout << "Filter " << s + 1 << ": " << chain[s].width << "x" 
+         << chain[s].width 
+         << (chain[s].separable ? ", separable" : ", not separable") 
+         << ", method: " << methodNames[methods[s]] << std::endl;
+   }
 
    /* Allocate space for the output image */
-   hOutputImage = new float [imageRows*imageCols];
+   hOutputData = new char [outputSize]();
 
    try 
    {
-      /* Query for platforms */
-      std::vector<cl::Platform> platforms;
-      cl::Platform::get(&platforms);
-
-      /* Get a list of devices on this platform */
-      std::vector<cl::Device> devices;
-      platforms[0].getDevices(CL_DEVICE_TYPE_GPU, &devices);
+      if (serve) 
+      {
+         deviceId = runServe(argc, argv, chain, methods, fuse, imageRows, 
+            imageCols, inputStorage, outputStorage, stdoutFd, &pool, &prof);
+      }
+      else if (split) 
+      {
+         deviceId = runSplit(argc, argv, chain, methods, fuse, 
+            (float*)hInputImage, (float*)hOutputData, imageRows, imageCols,
+            &pool, &prof);
+         writeBmpStorage(hOutputData, "cat-filtered.bmp", imageRows, 
+            imageCols, outputStorage);
+      }
+      else 
+      {
+         Convolver cv;
+         initConvolver(cv, argc, argv, &pool, &prof);
+         deviceId = cv.device();
 
-      /* Create a context for the devices */
-      cl::Context context(devices);
-      
-      /* Create a command queue for the first device */
-      cl::CommandQueue queue = cl::CommandQueue(context, devices[0]);
-
-      /* Create the images */
-      cl::ImageFormat imageFormat = cl::ImageFormat(CL_R, CL_FLOAT);
-      cl::Image2D inputImage = cl::Image2D(context, CL_MEM_READ_ONLY,
-           imageFormat, imageCols, imageRows);
-      cl::Image2D outputImage = cl::Image2D(context, CL_MEM_WRITE_ONLY,
-           imageFormat, imageCols, imageRows);
-      
-      /* Create a buffer for the filter */
-      cl::Buffer filterBuffer = cl::Buffer(context, CL_MEM_READ_ONLY,
-           filterWidth*filterWidth*sizeof(float));
-      
-      /* Copy the input data to the input image */
-      cl::size_t<3> origin;
-      origin[0] = 0;
-      origin[1] = 0;
-      origin[2] = 0;
-      cl::size_t<3> region;
-      region[0] = imageCols;
-      region[1] = imageRows;
-      region[2] = 1;
-      queue.enqueueWriteImage(inputImage, CL_TRUE, origin, region, 0, 0,
-           hInputImage);
-
-      /* Copy the filter to the buffer */
-      queue.enqueueWriteBuffer(filterBuffer, CL_TRUE, 0,
-           filterWidth*filterWidth*sizeof(float), filter);
-
-      /* Create the sampler */
-      cl::Sampler sampler = cl::Sampler(context, CL_FALSE, 
-         CL_ADDRESS_CLAMP_TO_EDGE, CL_FILTER_NEAREST);
-      
-      /* Read the program source */
-      std::ifstream sourceFile("image-convolution.cl");
-      std::string sourceCode(
-         std::istreambuf_iterator<char>(sourceFile),
-         (std::istreambuf_iterator<char>()));
-      cl::Program::Sources source(1,
-         std::make_pair(sourceCode.c_str(),
-         sourceCode.length() + 1));
-      
-      /* Make program from the source code */
-      cl::Program program = cl::Program(context, source);
+         /* Create the images. When the input or output is not stored as
+          * float, the filters read and write float copies. */
+         checkStorageSupported(cv.context(), CL_MEM_READ_ONLY, 
+            CL_MEM_OBJECT_IMAGE2D, inputStorage);
+         checkStorageSupported(cv.context(), CL_MEM_WRITE_ONLY, 
+            CL_MEM_OBJECT_IMAGE2D, outputStorage);
+         /* "--zero-copy" lets the input image use the (page-aligned) host
+          * data in place and maps the output image instead of reading it.
+          * The other images come from the pool. */
+         bool zeroCopy = zeroCopyRequested(argc, argv) != 0;
+         cl::Image2D inputImage;
+         if (zeroCopy) 
+         {
+            inputImage = cl::Image2D(cv.context, 
+                 CL_MEM_READ_ONLY | zeroCopyFlags(hInputImage),
+                 cl::ImageFormat(CL_R, 
+                    storageFormat(inputStorage).image_channel_data_type), 
+                 imageCols, imageRows, 0, hInputImage);
+         }
+         else 
+         {
+            inputImage = pooledImage(cv, CL_MEM_READ_ONLY, 
+               storageFormat(inputStorage).image_channel_data_type, 
+               imageRows, imageCols);
+         }
+         cl::Image2D outputImage = pooledImage(cv, 
+              CL_MEM_WRITE_ONLY | (zeroCopy ? zeroCopyFlags(NULL) : 0),
+              storageFormat(outputStorage).image_channel_data_type, 
+              imageRows, imageCols);
+         cl::Image2D filterInput = inputImage;
+         cl::Image2D filterOutput = outputImage;
+         if (inputStorage != STORAGE_FLOAT) 
+         {
+            filterInput = scratchImage(cv, "filter input", imageRows, 
+               imageCols);
+         }
+         if (outputStorage != STORAGE_FLOAT) 
+         {
+            filterOutput = scratchImage(cv, "filter output", imageRows, 
+               imageCols);
+         }
+         profileStageEnd(&prof);
       
-      /* Build the program for the devices */
-      program.build(devices);
-      
-      /* Create the kernel */
-      cl::Kernel kernel(program, "convolution");
-      
-      /* Set the kernel arguments */
-      kernel.setArg(0, inputImage);
-      kernel.setArg(1, outputImage);
-      kernel.setArg(2, filterBuffer);
-      kernel.setArg(3, filterWidth);
-      kernel.setArg(4, sampler);
-      
-      /* Execute the kernel */
-      cl::NDRange global(imageCols, imageRows);
-      cl::NDRange local(8, 8);
-      queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+         /* Copy the input data to the input image */
+         cl::size_t<3> origin;
+         origin[0] = 0;
+         origin[1] = 0;
+         origin[2] = 0;
+         cl::size_t<3> region;
+         region[0] = imageCols;
+         region[1] = imageRows;
+         region[2] = 1;
+         CommandGraph graph;
+         graphInit(&graph, &prof);
+         if (!zeroCopy) 
+         {
+            graphWriteImage(&graph, cv.queue(), inputImage(), &origin[0], 
+               &region[0], hInputImage, 0, NULL, "write input");
+         }
+
+         /* "--autotune" picks the work-group sizes on the input image */
+         if (autotuneRequested(argc, argv)) 
+         {
+            graphWait(&graph);
+            tuneKernels(cv, chain[0], filterInput, filterOutput, imageRows,
+               imageCols);
+         }
+
+         /* Apply the filters. Only the final image is read back. */
+         if (inputStorage != STORAGE_FLOAT) 
+         {
+            enqueueConvert(cv, inputImage, filterInput, 
+               storageScale(inputStorage), imageRows, imageCols);
+         }
+         enqueueChain(cv, chain, methods, fuse, filterInput, filterOutput, 
+            imageRows, imageCols);
+         if (outputStorage != STORAGE_FLOAT) 
+         {
+            enqueueConvert(cv, filterOutput, outputImage, 
+               1.0f/storageScale(outputStorage), imageRows, imageCols);
+         }
       
-      /* Copy the output data back to the host */
-      queue.enqueueReadImage(outputImage, CL_TRUE, origin, region, 0, 0,
-           hOutputImage);
+         /* The filters are a chain of stages that each need the one
+          * before, so they stay on the in-order queue. A marker ends the
+          * chain in the graph. */
+         cl_event chainDone;
+         check(clEnqueueMarkerWithWaitList(cv.queue(), 0, NULL, 
+            &chainDone));
+         int chainNode = graphAddEvent(&graph, chainDone, "filter chain");
+
+         /* Copy the output data back to the host and wait for the graph.
+          * The gold check runs after the images are gone, so mapped
+          * pixels are copied out. */
+         size_t rowPitch;
+         void *mapped = NULL;
+         if (zeroCopy) 
+         {
+            graphMapImage(&graph, cv.queue(), outputImage(), CL_MAP_READ,
+               &origin[0], &region[0], &rowPitch, NULL, &mapped, 1, 
+               &chainNode, "map output");
+         }
+         else 
+         {
+            graphReadImage(&graph, cv.queue(), outputImage(), &origin[0], 
+               &region[0], hOutputData, 1, &chainNode, "read output");
+         }
+         graphWait(&graph);
+         printTransferTime(zeroCopy, graph.transferMs);
+         graphRelease(&graph);
+         if (zeroCopy) 
+         {
+            copyRows(hOutputData, mapped, 
+               imageCols*storagePixelSize(outputStorage), imageRows, 
+               rowPitch);
+            unmapObject(cv.queue(), outputImage(), mapped, &prof, 
+               "unmap output");
+         }
 
-      /* Save the output bmp */
-      writeBmpFloat(hOutputImage, "cat-filtered.bmp", imageRows, imageCols,
-           inputImagePath);
+         /* Save the output bmp */
+         writeBmpStorage(hOutputData, "cat-filtered.bmp", imageRows, imageCols,
+              outputStorage);
+      }
    }
    catch(cl::Error error)
    {
       std::cout << error.what() << "(" << error.err() << ")" << std::endl;
    }
 
-   /* Verify result */
-   float *refOutput = convolutionGoldFloat(hInputImage, imageRows, imageCols,
-      filter, filterWidth);
-   int i;
-   bool passed = true;
-   for (i = 0; i < imageRows*imageCols; i++) {
-      if (abs(refOutput[i]-hOutputImage[i]) > 0.001f) {
-         passed = false;
+   poolPrintStats(&pool);
+   poolRelease(&pool);
+
+   /* The served frames are not checked */
+   if (serve) 
+   {
+      if (deviceId) 
+      {
+         profilerReport(&prof, deviceId);
       }
+      free(hInputImage);
+      delete[] hOutputData;
+      return 0;
    }
-   if (passed) {
-      std::cout << "Passed!" << std::endl;
-   }
-   else {
-      std::cout << "Failed." << std::endl;
+
+   hOutputImage = storageToFloat(hOutputData, imageRows*imageCols, 
+      outputStorage);
+
+   /* Verify result by applying the filters one after the other. The
+    * separable and fused kernels sum in a different order, and a later
+    * filter amplifies the rounding error of an earlier one by the sum of
+    * its absolute taps, so the tolerance grows along the chain. The FFT
+    * spreads its rounding error over the whole image, so it is allowed
+    * an error relative to the largest input value. The reference is
+    * finally rounded like the output storage format. */
+   profileStageBegin(&prof, "gold");
+   float *inputPixels = storageToFloat(hInputImage, imageRows*imageCols,
+      inputStorage);
+   float *refOutput = NULL;
+   float tolerance = 0.0f;
+   for (size_t s = 0; s < chain.size(); s++) {
+      float *stageInput = refOutput ? refOutput : inputPixels;
+      float gain = 0.0f;
+      for (size_t t = 0; t < chain[s].taps.size(); t++) {
+         gain += fabs(chain[s].taps[t]);
+      }
+      float stageError = 0.001f;
+      if (methods[s] == METHOD_FFT) {
+         float peak = 0.0f;
+         for (int p = 0; p < imageRows*imageCols; p++) {
+            peak = std::max(peak, (float)fabs(stageInput[p]));
+         }
+         stageError += 2e-4f*peak*gain;
+      }
+      tolerance = tolerance*gain + stageError;
+
+      float *stageOutput = convolutionGoldParallel(stageInput, imageRows, 
+         imageCols, &chain[s].taps[0], chain[s].width);
+      free(refOutput);
+      refOutput = stageOutput;
    }
+   CompareSummary summary;
+   compareFloats(hOutputImage, refOutput, imageRows*imageCols, tolerance, 
+      1e-5f, outputStorage, &summary);
+   printCompareSummary(&summary);
+   free(inputPixels);
    free(refOutput);
+   profileStageEnd(&prof);
+
+   /* Write the timing report */
+   if (deviceId) {
+      profilerReport(&prof, deviceId);
+   }
 
    free(hInputImage);
-   delete hOutputImage;
+   free(hOutputImage);
+   delete[] hOutputData;
    return 0;
 }
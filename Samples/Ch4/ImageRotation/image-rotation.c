@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 /* OpenCL includes */
 #include <CL/cl.h>
@@ -9,50 +10,274 @@
 /* Utility functions */
 #include "utils.h"
 #include "bmp-utils.h"
+#include "options.h"
+#include "image-storage.h"
+#include "runtime.h"
+#include "profiler.h"
+#include "host-memory.h"
+#include "program-cache.h"
+#include "autotune.h"
+#include "command-graph.h"
+
+/* Largest number of transforms per run */
+#define MAX_TRANSFORMS 1024
+
+/* A 2x3 affine matrix, row-major: (x', y') = (m0*x + m1*y + m2,
+ * m3*x + m4*y + m5) */
+typedef struct {
+   float m[6];
+} Affine;
+
+static Affine affine(float m0, float m1, float m2, float m3, float m4,
+   float m5)
+{
+   Affine a;
+   a.m[0] = m0; a.m[1] = m1; a.m[2] = m2;
+   a.m[3] = m3; a.m[4] = m4; a.m[5] = m5;
+   return a;
+}
+
+/* Return the transform that applies 'b' first and then 'a' */
+static Affine affineMultiply(Affine a, Affine b)
+{
+   return affine(
+      a.m[0]*b.m[0] + a.m[1]*b.m[3],
+      a.m[0]*b.m[1] + a.m[1]*b.m[4],
+      a.m[0]*b.m[2] + a.m[1]*b.m[5] + a.m[2],
+      a.m[3]*b.m[0] + a.m[4]*b.m[3],
+      a.m[3]*b.m[1] + a.m[4]*b.m[4],
+      a.m[3]*b.m[2] + a.m[4]*b.m[5] + a.m[5]);
+}
+
+/* Build the matrix that maps an output pixel to the input location it
+ * samples. The output is the input scaled by 'scale', sheared by 'shear'
+ * (x += shear*y), rotated by -'degrees' and shifted by (dx, dy), all
+ * about the image center. Since the kernel maps output to input, the
+ * inverse of each step is applied in reverse order; the inverse rotation
+ * is R(+degrees), which samples the input like the original rotation
+ * kernel. */
+static Affine warpMatrix(float degrees, float scale, float shear, float dx,
+   float dy, int imageCols, int imageRows)
+{
+   /* Degrees are converted to radians here, once per transform */
+   float theta = degrees*(float)M_PI/180.0f;
+   float x0 = imageCols/2.0f;
+   float y0 = imageRows/2.0f;
+
+   Affine m = affine(1.0f, 0.0f, -x0 - dx, 0.0f, 1.0f, -y0 - dy);
+   m = affineMultiply(affine(cosf(theta), -sinf(theta), 0.0f, 
+      sinf(theta), cosf(theta), 0.0f), m);
+   m = affineMultiply(affine(1.0f, -shear, 0.0f, 0.0f, 1.0f, 0.0f), m);
+   m = affineMultiply(affine(1.0f/scale, 0.0f, 0.0f, 0.0f, 1.0f/scale, 
+      0.0f), m);
+   return affineMultiply(affine(1.0f, 0.0f, x0, 0.0f, 1.0f, y0), m);
+}
+
+/* Parse a comma-separated list of angles (degrees) into 'angles' and
+ * return how many there are */
+static int parseAngles(const char *list, float *angles)
+{
+   int count = 0;
+   const char *p = list;
+   while (*p && count < MAX_TRANSFORMS) {
+      char *end;
+      angles[count++] = (float)strtod(p, &end);
+      if (end == p) {
+         printf("Invalid angle list '%s'\n", list);
+         exit(-1);
+      }
+      p = (*end == ',') ? end + 1 : end;
+   }
+   return count;
+}
+
+/* The NDRange of affineWarp for 'config', padded to whole work-groups.
+ * The third dimension selects the transform. */
+static void warpWorkSize(const LaunchConfig *config, int cols, int rows,
+   int numTransforms, size_t globalWorkSize[3], size_t localWorkSize[3])
+{
+   localWorkSize[0] = config->local[0];
+   localWorkSize[1] = config->local[1];
+   localWorkSize[2] = 1;
+   globalWorkSize[0] = roundUp((cols + config->items - 1)/config->items,
+      config->local[0]);
+   globalWorkSize[1] = roundUp(rows, config->local[1]);
+   globalWorkSize[2] = numTransforms;
+}
+
+/* affineWarp built for 1, 2 and 4 pixels per work-item, for the
+ * autotuner */
+#define WARP_VARIANTS 3
+
+typedef struct {
+   cl_command_queue queue;
+   cl_kernel kernels[WARP_VARIANTS];
+   int cols;
+   int rows;
+   int numTransforms;
+} WarpLaunch;
+
+static cl_event launchWarp(void *arg, const LaunchConfig *config)
+{
+   WarpLaunch *launch = (WarpLaunch*)arg;
+   size_t globalWorkSize[3];
+   size_t localWorkSize[3];
+   cl_kernel kernel = launch->kernels[config->items == 1 ? 0 : 
+                                      (config->items == 2 ? 1 : 2)];
+   cl_event event;
+
+   warpWorkSize(config, launch->cols, launch->rows, launch->numTransforms,
+      globalWorkSize, localWorkSize);
+   if (clEnqueueNDRangeKernel(launch->queue, kernel, 3, NULL, 
+          globalWorkSize, localWorkSize, 0, NULL, &event) != CL_SUCCESS) {
+      return NULL;
+   }
+   return event;
+}
+
+/* Time affineWarp for every work-group shape and pixels per work-item on
+ * the actual images and store the fastest configuration */
+static void tuneWarp(Runtime *rt, const char *options, cl_mem *args, 
+   int cols, int rows, int numTransforms)
+{
+   static LaunchConfig candidates[MAX_TUNE_CANDIDATES];
+   cl_program programs[WARP_VARIANTS];
+   size_t sizes[64][2];
+   WarpLaunch launch;
+   cl_int status;
+   int count = 0;
+   int v, s, a;
+
+   launch.queue = rt->queue;
+   launch.cols = cols;
+   launch.rows = rows;
+   launch.numTransforms = numTransforms;
+   for (v = 0; v < WARP_VARIANTS; v++) {
+      char variantOptions[192];
+      int items = 1 << v;
+      snprintf(variantOptions, sizeof(variantOptions), 
+         "%s -D ITEMS_PER_WORK_ITEM=%d", options, items);
+      programs[v] = buildProgramCached(rt->context, 1, &rt->device, 
+         "image-rotation.cl", variantOptions);
+      launch.kernels[v] = clCreateKernel(programs[v], "affineWarp", &status);
+      check(status);
+      for (a = 0; a < 3; a++) {
+         check(clSetKernelArg(launch.kernels[v], a, sizeof(cl_mem), 
+            &args[a]));
+      }
+
+      int numSizes = localSizeCandidates(launch.kernels[v], rt->device, 2,
+         sizes, 64);
+      for (s = 0; s < numSizes && count < MAX_TUNE_CANDIDATES; s++) {
+         candidates[count].local[0] = sizes[s][0];
+         candidates[count].local[1] = sizes[s][1];
+         candidates[count].items = items;
+         candidates[count].groups = 0;
+         count++;
+      }
+   }
+
+   autotuneKernel(rt->device, "affineWarp", candidates, count, launchWarp,
+      &launch);
+
+   for (v = 0; v < WARP_VARIANTS; v++) {
+      clReleaseKernel(launch.kernels[v]);
+      clReleaseProgram(programs[v]);
+   }
+}
 
 int main(int argc, char **argv) 
 {
    /* Host data */
-   float *hInputImage = NULL; 
-   float *hOutputImage = NULL;
+   void *hInputImage = NULL; 
+   char *hOutputImage = NULL;
 
-   /* Angle for rotation (degrees) */
-   const float theta = 45.0f;
+   /* Angles for rotation (degrees). "--angles A,B,..." lists them and
+    * "--rotations N" spreads N angles evenly over a full turn. Every
+    * output is also scaled by "--scale", sheared by "--shear" and shifted
+    * by "--dx" and "--dy". */
+   static float angles[MAX_TRANSFORMS];
+   int numTransforms = 1;
+   angles[0] = 45.0f;
+   const char *angleList = getOption(argc, argv, "angles", NULL);
+   int rotations = getIntOption(argc, argv, "rotations", NULL, 0);
+   if (angleList) {
+      numTransforms = parseAngles(angleList, angles);
+   }
+   else if (rotations > 0) {
+      numTransforms = rotations < MAX_TRANSFORMS ? rotations : MAX_TRANSFORMS;
+      int t;
+      for (t = 0; t < numTransforms; t++) {
+         angles[t] = 360.0f*t/numTransforms;
+      }
+   }
+   float scale = (float)getDoubleOption(argc, argv, "scale", NULL, 1.0);
+   if (!(scale > 0.0f)) {
+      printf("The scale must be greater than 0\n");
+      exit(-1);
+   }
+   float shear = (float)getDoubleOption(argc, argv, "shear", NULL, 0.0);
+   float dx = (float)getDoubleOption(argc, argv, "dx", NULL, 0.0);
+   float dy = (float)getDoubleOption(argc, argv, "dy", NULL, 0.0);
+
+   /* Pixel storage of the input and output images ("--format", or
+    * "--input-format" and "--output-format", see image-storage.h) */
+   ImageStorage inputStorage = getImageStorage(argc, argv, "input-format",
+      STORAGE_FLOAT);
+   ImageStorage outputStorage = getImageStorage(argc, argv, 
+      "output-format", STORAGE_FLOAT);
+
+   /* "--zero-copy" lets the input image use the host data in place and
+    * maps the output images instead of reading them */
+   int zeroCopy = zeroCopyRequested(argc, argv);
+
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "image-rotation", argc, argv);
+   profileStageBegin(&prof, "setup");
 
    /* Allocate space for the input image and read the
     * data from disk */
    int imageRows;
    int imageCols;
-   hInputImage = readBmpFloat("../../Images/cat-face.bmp", &imageRows, &imageCols);
+   hInputImage = readBmpStorage("../../Images/cat-face.bmp", &imageRows, 
+      &imageCols, inputStorage);
    const int imageElements = imageRows*imageCols;
-   const size_t imageSize = imageElements*sizeof(float);
+   const size_t outputSize = imageElements*storagePixelSize(outputStorage);
 
-   /* Allocate space for the output image */
-   hOutputImage = (float*)malloc(imageSize);
+   /* Allocate space for the output images */
+   hOutputImage = (char*)malloc(outputSize*numTransforms);
    if (!hOutputImage) { exit(-1); }
 
+   /* Compute the matrices once on the host */
+   static Affine matrices[MAX_TRANSFORMS];
+   int t;
+   for (t = 0; t < numTransforms; t++) {
+      matrices[t] = warpMatrix(angles[t], scale, shear, dx, dy, imageCols,
+         imageRows);
+   }
+   const size_t matricesSize = numTransforms*sizeof(Affine);
+
    /* Use this to check the output of each API call */
    cl_int status;
 
-   /* Get the first platform */
-   cl_platform_id platform;
-   status = clGetPlatformIDs(1, &platform, NULL);
-   check(status);
-
-   /* Get the first device */
-   cl_device_id device;
-   status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-   check(status);
+   /* Select a device (a GPU unless --device says otherwise, falling back
+    * to a CPU device) and create a context and command queue for it */
+   Runtime rt;
+   runtimeInit(&rt, argc, argv);
 
-   /* Create a context and associate it with the device */
-   cl_context context;
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-   check(status);
-
-   /* Create a command queue and associate it with the device */
-   cl_command_queue cmdQueue;
-   cmdQueue = clCreateCommandQueue(context, device, 0, &status);
-   check(status);
+   /* All transforms must fit in one image array and in constant memory */
+   size_t maxArraySize;
+   cl_ulong maxConstantSize;
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, 
+      sizeof(size_t), &maxArraySize, NULL));
+   check(clGetDeviceInfo(rt.device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+      sizeof(cl_ulong), &maxConstantSize, NULL));
+   if ((size_t)numTransforms > maxArraySize || 
+       matricesSize > maxConstantSize) {
+      printf("Too many transforms for the device (%d)\n", numTransforms);
+      exit(-1);
+   }
 
    /* The image descriptor describes how the data will be stored 
     * in memory. This descriptor initializes a 2D image with no pitch */
@@ -68,90 +293,171 @@ int main(int argc, char **argv)
    desc.num_samples = 0;
    desc.buffer = NULL;
 
-   /* The image format describes the properties of each pixel */
-   cl_image_format format;
-   format.image_channel_order = CL_R; // single channel
-   format.image_channel_data_type = CL_FLOAT;
+   /* The image formats describe the properties of each pixel */
+   cl_image_format inputFormat = storageFormat(inputStorage);
+   cl_image_format outputFormat = storageFormat(outputStorage);
+   checkStorageSupported(rt.context, CL_MEM_READ_ONLY, 
+      CL_MEM_OBJECT_IMAGE2D, inputStorage);
+   checkStorageSupported(rt.context, CL_MEM_WRITE_ONLY, 
+      CL_MEM_OBJECT_IMAGE2D_ARRAY, outputStorage);
+
+   /* Create the input image. A zero-copy image uses the (page-aligned)
+    * host data in place, so only the copied one comes from the pool. */
+   cl_mem inputImage;
+   if (zeroCopy) {
+      inputImage = clCreateImage(rt.context, 
+         CL_MEM_READ_ONLY | zeroCopyFlags(hInputImage), &inputFormat, 
+         &desc, hInputImage, &status);
+      check(status);
+   }
+   else {
+      inputImage = poolImage(&rt.pool, rt.context, CL_MEM_READ_ONLY, 
+         &inputFormat, &desc);
+   }
 
-   /* Create the input image and initialize it using a 
-    * pointer to the image data on the host. */
-   cl_mem inputImage = clCreateImage(context, CL_MEM_READ_ONLY,
-      &format, &desc, NULL, NULL);
+   /* Take the output image array, one layer per transform, and the
+    * buffer for the matrices from the pool */
+   cl_image_desc arrayDesc = desc;
+   arrayDesc.image_type = CL_MEM_OBJECT_IMAGE2D_ARRAY;
+   arrayDesc.image_array_size = numTransforms;
+   cl_mem outputImage = poolImage(&rt.pool, rt.context, 
+      CL_MEM_WRITE_ONLY | (zeroCopy ? zeroCopyFlags(NULL) : 0),
+      &outputFormat, &arrayDesc);
+   cl_mem matrixBuffer = poolBuffer(&rt.pool, rt.context, CL_MEM_READ_ONLY,
+      matricesSize);
 
-   /* Create the output image */
-   cl_mem outputImage = clCreateImage(context, CL_MEM_WRITE_ONLY,
-      &format, &desc, NULL, NULL);
+   profileStageEnd(&prof);
 
-   /* Copy the host image data to the device */
+   /* Copy the host image data and the matrices to the device. The two
+    * uploads are independent and run while the program is built. */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
    size_t origin[3] = {0, 0, 0}; // Offset within the image to copy from
    size_t region[3] = {imageCols, imageRows, 1}; // Elements to per dimension
-   clEnqueueWriteImage(cmdQueue, inputImage, CL_TRUE, 
-      origin, region, 0 /* row-pitch */, 0 /* slice-pitch */, 
-      hInputImage, 0, NULL, NULL);
-
-   /* Create a program with source code */
-   char *programSource = readFile("image-rotation.cl");
-   size_t programSourceLen = strlen(programSource);
-   cl_program program = clCreateProgramWithSource(context, 1,
-      (const char**)&programSource, &programSourceLen, &status);
-   check(status);
+   int deps[2];
+   deps[0] = GRAPH_NONE;
+   if (!zeroCopy) {
+      deps[0] = graphWriteImage(&graph, rt.queue, inputImage, origin, 
+         region, hInputImage, 0, NULL, "write input");
+   }
+   deps[1] = graphWriteBuffer(&graph, rt.queue, matrixBuffer, 0, 
+      matricesSize, matrices, 0, NULL, "write matrices");
 
-   /* Build (compile) the program for the device */
-   status = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
-   if (status != CL_SUCCESS) {
-      printCompilerError(program, device);
-      exit(-1);
+   /* The launch configuration: 8x8 work-groups and one pixel per
+    * work-item, unless --autotune found a faster one for this device */
+   char options[192];
+   storageBuildOptions(options, sizeof(options), inputStorage, 
+      outputStorage);
+   cl_mem kernelArgs[3] = {inputImage, outputImage, matrixBuffer};
+   LaunchConfig config = {{8, 8}, 1, 0};
+   if (autotuneRequested(argc, argv)) {
+      graphWait(&graph);
+      tuneWarp(&rt, options, kernelArgs, imageCols, imageRows, 
+         numTransforms);
    }
+   /* The items per work-item are built into the program, so the stored
+    * configuration is loaded against the device's limits first and its
+    * work-group checked against the kernel once that is built */
+   loadLaunchConfig(NULL, rt.device, "affineWarp", &config);
+   size_t optionsLen = strlen(options);
+   snprintf(options + optionsLen, sizeof(options) - optionsLen, 
+      " -D ITEMS_PER_WORK_ITEM=%d", config.items);
 
-   /* Create the kernel */
-   cl_kernel kernel;
-   kernel = clCreateKernel(program, "rotation", &status);
-   check(status);
+   /* Create and build the program, reusing a cached binary from an
+    * earlier run when one matches, and create the kernel. The sampler
+    * and write_imagef convert between the storage formats and float. */
+   profileStageBegin(&prof, "build");
+   runtimeBuild(&rt, "image-rotation.cl", options, "affineWarp");
+   profileStageEnd(&prof);
+   if (!checkLaunchConfig(rt.kernel, rt.device, &config)) {
+      config.local[0] = 8;
+      config.local[1] = 8;
+   }
 
    /* Set the kernel arguments */
-   status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &inputImage);
-   status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &outputImage);
-   status |= clSetKernelArg(kernel, 2, sizeof(int), &imageCols);
-   status |= clSetKernelArg(kernel, 3, sizeof(int), &imageRows);
-   status |= clSetKernelArg(kernel, 4, sizeof(float), &theta);
+   status  = clSetKernelArg(rt.kernel, 0, sizeof(cl_mem), &inputImage);
+   status |= clSetKernelArg(rt.kernel, 1, sizeof(cl_mem), &outputImage);
+   status |= clSetKernelArg(rt.kernel, 2, sizeof(cl_mem), &matrixBuffer);
    check(status);
 
    /* Define the index space and work-group size */
-   size_t globalWorkSize[2];
-   globalWorkSize[0] = imageCols;
-   globalWorkSize[1] = imageRows;
-
-   size_t localWorkSize[2];
-   localWorkSize[0] = 8;
-   localWorkSize[1] = 8;
+   size_t globalWorkSize[3];
+   size_t localWorkSize[3];
+   warpWorkSize(&config, imageCols, imageRows, numTransforms, 
+      globalWorkSize, localWorkSize);
 
    /* Enqueue the kernel for execution */
-   status = clEnqueueNDRangeKernel(cmdQueue, kernel, 2, NULL,
-      globalWorkSize, localWorkSize, 0, NULL, NULL);
-   check(status);
+   int kernelNode = graphKernel(&graph, rt.queue, rt.kernel, 3, NULL,
+      globalWorkSize, localWorkSize, (double)imageElements*numTransforms,
+      2, deps, "affine kernel");
 
-   /* Read the output image buffer to the host */
-   status = clEnqueueReadImage(cmdQueue, outputImage, CL_TRUE, 
-      origin, region, 0 /* row-pitch */, 0 /* slice-pitch */, 
-      hOutputImage, 0, NULL, NULL);
-   check(status);
+   /* Read the output image array to the host, and wait for the graph. A
+    * mapped array is used directly unless the implementation pads its
+    * rows or layers. */
+   size_t arrayRegion[3] = {imageCols, imageRows, numTransforms};
+   char *result = hOutputImage;
+   void *mapped = NULL;
+   size_t rowPitch;
+   size_t slicePitch;
+   if (zeroCopy) {
+      graphMapImage(&graph, rt.queue, outputImage, CL_MAP_READ, origin, 
+         arrayRegion, &rowPitch, &slicePitch, &mapped, 1, &kernelNode, 
+         "map output");
+   }
+   else {
+      graphReadImage(&graph, rt.queue, outputImage, origin, arrayRegion, 
+         hOutputImage, 1, &kernelNode, "read output");
+   }
+   graphWait(&graph);
+   printTransferTime(zeroCopy, graph.transferMs);
+   graphRelease(&graph);
+   if (zeroCopy) {
+      const size_t rowSize = imageCols*storagePixelSize(outputStorage);
+      if (rowPitch == rowSize && slicePitch == outputSize) {
+         result = (char*)mapped;
+      }
+      else {
+         for (t = 0; t < numTransforms; t++) {
+            copyRows(hOutputImage + t*outputSize, 
+               (char*)mapped + t*slicePitch, rowSize, imageRows, rowPitch);
+         }
+      }
+   }
 
-   /* Write the output image to file */
-   writeBmpFloat(hOutputImage, "rotated-cat.bmp", imageRows, imageCols, 
-      "../../Images/cat-face.bmp"); 
+   /* Write the output images to file */
+   if (numTransforms == 1) {
+      writeBmpStorage(result, "rotated-cat.bmp", imageRows, imageCols, 
+         outputStorage); 
+   }
+   else {
+      for (t = 0; t < numTransforms; t++) {
+         char outputPath[64];
+         sprintf(outputPath, "rotated-cat-%d.bmp", t);
+         writeBmpStorage(result + t*outputSize, outputPath, 
+            imageRows, imageCols, outputStorage); 
+      }
+   }
+   if (mapped) {
+      unmapObject(rt.queue, outputImage, mapped, &prof, "unmap output");
+   }
+
+   /* Write the timing report */
+   profilerReport(&prof, rt.device);
 
    /* Free OpenCL resources */
-   clReleaseKernel(kernel);
-   clReleaseProgram(program);
-   clReleaseCommandQueue(cmdQueue);
-   clReleaseMemObject(inputImage);
-   clReleaseMemObject(outputImage);
-   clReleaseContext(context);
+   if (zeroCopy) {
+      clReleaseMemObject(inputImage);
+   }
+   else {
+      poolReturn(&rt.pool, inputImage);
+   }
+   poolReturn(&rt.pool, outputImage);
+   poolReturn(&rt.pool, matrixBuffer);
+   runtimeRelease(&rt);
 
    /* Free host resources */
    free(hInputImage);
    free(hOutputImage);
-   free(programSource);
 
    return 0;
 }
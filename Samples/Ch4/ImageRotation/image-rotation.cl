@@ -3,41 +3,66 @@ __constant sampler_t sampler =
    CLK_FILTER_LINEAR           |
    CLK_ADDRESS_CLAMP;
 
+/* Scale factors for 8-bit images (see image-storage.h) */
+#ifndef INPUT_SCALE
+#define INPUT_SCALE 1.0f
+#endif
+#ifndef OUTPUT_SCALE
+#define OUTPUT_SCALE 1.0f
+#endif
+
+/* Output pixels each work-item computes. A work-group covers
+ * ITEMS_PER_WORK_ITEM blocks of get_local_size(0) consecutive pixels of
+ * a row, so neighbouring work-items still write neighbouring pixels. */
+#ifndef ITEMS_PER_WORK_ITEM
+#define ITEMS_PER_WORK_ITEM 1
+#endif
+
+/* Apply one affine transform per layer of the output image array. Each
+ * transform is a 2x3 matrix (6 floats, row-major) computed on the host
+ * that maps output pixel coordinates to input coordinates, so a single
+ * launch can produce many rotated, scaled, sheared or translated variants
+ * of the input. The third dimension of the index space selects the
+ * transform. The NDRange is padded to whole work-groups, so work-items
+ * outside the image do nothing. */
 __kernel 
-void rotation(
-    __read_only image2d_t inputImage, 
-   __write_only image2d_t outputImage,
-                      int imageWidth,
-                      int imageHeight,
-                    float theta)
+void affineWarp(
+          __read_only image2d_t inputImage, 
+   __write_only image2d_array_t outputImages,
+              __constant float* matrices)
 {
    /* Get global ID for output coordinates */
-   int x = get_global_id(0);
+   int localWidth = get_local_size(0);
+   int firstX = get_group_id(0)*localWidth*ITEMS_PER_WORK_ITEM + 
+      get_local_id(0);
    int y = get_global_id(1);
+   int layer = get_global_id(2);
+   int width = get_image_width(outputImages);
+   if (y >= get_image_height(outputImages)) 
+   {
+      return;
+   }
 
-   /* Compute image center */
-   float x0 = imageWidth/2.0f;
-   float y0 = imageHeight/2.0f;
-
-   /* Compute the work-item's location relative
-    * to the image center */
-   int xprime = x-x0;
-   int yprime = y-y0;
-
-   /* Compute sine and cosine */
-   float sinTheta = sin(theta);
-   float cosTheta = cos(theta);
-
-   /* Compute the input location */
-   float2 readCoord;
-   readCoord.x = xprime*cosTheta - yprime*sinTheta + x0;
-   readCoord.y = xprime*sinTheta + yprime*cosTheta + y0;
+   __constant float *m = matrices + 6*layer;
+   for (int i = 0; i < ITEMS_PER_WORK_ITEM; i++) 
+   {
+      int x = firstX + i*localWidth;
+      if (x >= width) 
+      {
+         break;
+      }
 
-   /* Read the input image */
-   float value;   
-   value = read_imagef(inputImage, sampler, readCoord).x;
+      /* Compute the input location */
+      float2 readCoord;
+      readCoord.x = m[0]*x + m[1]*y + m[2];
+      readCoord.y = m[3]*x + m[4]*y + m[5];
 
-   /* Write the output image */
-   write_imagef(outputImage, (int2)(x, y), (float4)(value, 0.f, 0.f, 0.f));
+      /* Read the input image */
+      float value;   
+      value = read_imagef(inputImage, sampler, readCoord).x*INPUT_SCALE;
 
+      /* Write the output image */
+      write_imagef(outputImages, (int4)(x, y, layer, 0), 
+         (float4)(value*OUTPUT_SCALE, 0.f, 0.f, 0.f));
+   }
 }
@@ -9,7 +9,17 @@
 /* Utility functions */
 #include "utils.h"
 #include "bmp-utils.h"
+#include "options.h"
+#include "program-cache.h"
+#include "runtime.h"
+#include "profiler.h"
+#include "image-storage.h"
+#include "host-memory.h"
+#include "autotune.h"
+#include "command-graph.h"
+#include "memory-pool.h"
 #include "gold.h"
+#include "gold-parallel.h"
 
 /* Filter for the convolution */
 static float gaussianBlurFilter[25] = {
@@ -24,19 +34,126 @@ static const int filterSize = 25*sizeof(float);
 /* Number of histogram bins */
 static const int HIST_BINS = 256; 
 
+/* Default capacity of the pipe in pixels ("--pipe-packets N") */
+static const int defaultPipePackets = 16384;
+
+/* Work-items of the consumer work-group in the pipe version */
+static const size_t pipeConsumerGroupSize = 64;
+
+/* Without pipes, the image is produced and consumed in bands of
+ * "--band-rows" rows that cycle through a ring of "--ring-bands" band
+ * buffers */
+static const int defaultBandRows = 64;
+static const int defaultRingBands = 3;
+#define MAX_RING_BANDS 16
+
+/* Return 1 if 'device' supports OpenCL 2.0 pipes of floats */
+static int pipesSupported(cl_device_id device)
+{
+#ifdef CL_VERSION_2_0
+   char version[128];
+   cl_uint maxPacketSize = 0;
+   int major = 0;
+
+   version[0] = '\0';
+   clGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, sizeof(version), 
+      version, NULL);
+   /* The version reads "OpenCL C <major>.<minor> ..." */
+   sscanf(version, "OpenCL C %d", &major);
+   if (major < 2) {
+      return 0;
+   }
+   if (clGetDeviceInfo(device, CL_DEVICE_PIPE_MAX_PACKET_SIZE, 
+          sizeof(cl_uint), &maxPacketSize, NULL) != CL_SUCCESS) {
+      return 0;
+   }
+   return maxPacketSize >= sizeof(cl_float);
+#else
+   (void)device;
+   return 0;
+#endif
+}
+
+/* The producer of one band timed by the autotuner */
+typedef struct {
+   cl_command_queue queue;
+   cl_kernel kernel;
+   int cols;
+   int bandRows;
+} ProducerLaunch;
+
+static cl_event launchProducer(void *arg, const LaunchConfig *config)
+{
+   ProducerLaunch *launch = (ProducerLaunch*)arg;
+   size_t globalSize[2];
+   cl_event event;
+
+   globalSize[0] = roundUp(launch->cols, config->local[0]);
+   globalSize[1] = roundUp(launch->bandRows, config->local[1]);
+   if (clEnqueueNDRangeKernel(launch->queue, launch->kernel, 2, NULL,
+          globalSize, config->local, 0, NULL, &event) != CL_SUCCESS) {
+      return NULL;
+   }
+   return event;
+}
+
+/* Time the producer of the first band for every work-group shape, with
+ * all of its arguments but the end row already set, and store the
+ * fastest shape */
+static LaunchConfig tuneProducer(cl_command_queue queue, cl_device_id device,
+   cl_kernel kernel, int cols, int bandRows)
+{
+   LaunchConfig candidates[64];
+   size_t sizes[64][2];
+   ProducerLaunch launch;
+   int numSizes;
+   int c;
+
+   launch.queue = queue;
+   launch.kernel = kernel;
+   launch.cols = cols;
+   launch.bandRows = bandRows;
+   check(clSetKernelArg(kernel, 1, sizeof(int), &bandRows));
+
+   numSizes = localSizeCandidates(kernel, device, 2, sizes, 64);
+   for (c = 0; c < numSizes; c++) {
+      candidates[c].local[0] = sizes[c][0];
+      candidates[c].local[1] = sizes[c][1];
+      candidates[c].items = 1;
+      candidates[c].groups = 0;
+   }
+   return autotuneKernel(device, "producerKernel", candidates, numSizes,
+      launchProducer, &launch);
+}
+
 int main(int argc, char **argv) 
 {
    /* Host data */
-   float *hInputImage = NULL; 
+   void *hInputImage = NULL; 
    int *hOutputHistogram = NULL;
 
+   /* Optional per-stage profiling (--profile [FILE]) */
+   Profiler prof;
+   profilerInit(&prof, "producer-consumer", argc, argv);
+   profileStageBegin(&prof, "setup");
+
+   /* "--zero-copy" lets the input image use the host data in place and
+    * maps the histogram instead of reading it */
+   int zeroCopy = zeroCopyRequested(argc, argv);
+
+   /* Pixel storage of the input image ("--format" or "--input-format",
+    * see image-storage.h). The pixels are integers, which all three
+    * formats represent exactly. */
+   ImageStorage inputStorage = getImageStorage(argc, argv, "input-format",
+      STORAGE_FLOAT);
+
    /* Allocate space for the input image and read the
     * data from disk */
    int imageRows;
    int imageCols;
-   hInputImage = readBmpFloat("../../Images/cat.bmp", &imageRows, &imageCols);
+   hInputImage = readBmpStorage("../../Images/cat.bmp", &imageRows, 
+      &imageCols, inputStorage);
    const int imageElements = imageRows*imageCols;
-   const size_t imageSize = imageElements*sizeof(float);
 
    /* Allocate space for the histogram on the host */
    const int histogramSize = HIST_BINS*sizeof(int);
@@ -46,33 +163,45 @@ int main(int argc, char **argv)
    /* Use this to check the output of each API call */
    cl_int status;
 
-   /* Get the first platform */
-   cl_platform_id platform;
-   status = clGetPlatformIDs(1, &platform, NULL);
-   check(status);
-
-   /* Get the devices */
+   /* Get the devices. The producer prefers a GPU and the consumer a CPU
+    * device of the same platform; --producer-device and --consumer-device
+    * override the choice (see runtime.h). On a machine with a single
+    * device both stages share it. */
    cl_device_id devices[2];
    cl_device_id gpuDevice;
    cl_device_id cpuDevice;
-   status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &gpuDevice, NULL);
-   check(status);
-   status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &cpuDevice, NULL);
+   cl_platform_id platform;
+   gpuDevice = selectDevice(getOption(argc, argv, "producer-device",
+      "OCL_PRODUCER_DEVICE"), CL_DEVICE_TYPE_GPU, NULL);
+   status = clGetDeviceInfo(gpuDevice, CL_DEVICE_PLATFORM, 
+      sizeof(cl_platform_id), &platform, NULL);
    check(status);
+   cpuDevice = selectDevice(getOption(argc, argv, "consumer-device",
+      "OCL_CONSUMER_DEVICE"), CL_DEVICE_TYPE_CPU, platform);
    devices[0] = gpuDevice;
    devices[1] = cpuDevice;
+   cl_uint numDevices = (gpuDevice == cpuDevice) ? 1 : 2;
+   printDevice("Producer device", gpuDevice);
+   printDevice("Consumer device", cpuDevice);
 
    /* Create a context and associate it with the devices */
    cl_context context;
-   context = clCreateContext(NULL, 2, devices, NULL, NULL, &status);
+   context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &status);
    check(status);
 
+   /* The buffers, images and the pipe come from a pool (see
+    * memory-pool.h) */
+   MemPool pool;
+   poolInit(&pool);
+
    /* Create the command queues */
    cl_command_queue gpuQueue;
    cl_command_queue cpuQueue;
-   gpuQueue = clCreateCommandQueue(context, gpuDevice, 0, &status);
+   gpuQueue = clCreateCommandQueue(context, gpuDevice, 
+      graphQueueProperties(argc, argv, gpuDevice), &status);
    check(status);
-   cpuQueue = clCreateCommandQueue(context, cpuDevice, 0, &status);
+   cpuQueue = clCreateCommandQueue(context, cpuDevice, 
+      graphQueueProperties(argc, argv, cpuDevice), &status);
    check(status);
 
    /* The image descriptor describes how the data will be stored 
@@ -90,68 +219,103 @@ int main(int argc, char **argv)
    desc.buffer = NULL;
 
    /* The image format describes the properties of each pixel */
-   cl_image_format format;
-   format.image_channel_order = CL_R; // single channel
-   format.image_channel_data_type = CL_FLOAT;
+   cl_image_format format = storageFormat(inputStorage);
+   checkStorageSupported(context, CL_MEM_READ_ONLY, CL_MEM_OBJECT_IMAGE2D,
+      inputStorage);
 
-   /* Create the input image and initialize it using a 
-    * pointer to the image data on the host. */
+   /* Create the input image. A zero-copy image uses the (page-aligned)
+    * host data in place, so only the copied one comes from the pool. */
    cl_mem inputImage;
-   inputImage = clCreateImage(context, CL_MEM_READ_ONLY,
-      &format, &desc, NULL, NULL);
+   if (zeroCopy) {
+      inputImage = clCreateImage(context, 
+         CL_MEM_READ_ONLY | zeroCopyFlags(hInputImage), &format, &desc, 
+         hInputImage, &status);
+      check(status);
+   }
+   else {
+      inputImage = poolImage(&pool, context, CL_MEM_READ_ONLY, &format, 
+         &desc);
+   }
 
-   /* Create a buffer object for the output histogram */
+   /* Take a buffer object for the output histogram */
    cl_mem outputHistogram;
-   outputHistogram = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 
-      histogramSize, NULL, &status);
-   check(status);
+   outputHistogram = poolBuffer(&pool, context, 
+      CL_MEM_WRITE_ONLY | (zeroCopy ? zeroCopyFlags(NULL) : 0), 
+      histogramSize);
 
-     /* Create a buffer for the filter */
+   /* Take a buffer for the filter */
    cl_mem filter;
-   filter = clCreateBuffer(context, CL_MEM_READ_ONLY, filterSize, 
-      NULL, &status);
-   check(status);
+   filter = poolBuffer(&pool, context, CL_MEM_READ_ONLY, filterSize);
+
+   /* Stream the convolved pixels through an OpenCL 2.0 pipe when both
+    * devices support pipes (unless "--no-pipes" is given), and through
+    * a ring of band buffers otherwise. With two devices the
+    * kernels run concurrently, so the pipe only needs to hold
+    * "--pipe-packets" pixels. On a single device the consumer may only
+    * start once the producer has finished, so the pipe then holds the
+    * whole image to keep the producer from waiting forever, and the
+    * consumer is ordered after the producer. */
+   int usePipes = pipesSupported(gpuDevice) && pipesSupported(cpuDevice) &&
+      !hasOption(argc, argv, "no-pipes", "OCL_NO_PIPES");
+   cl_mem pipe = NULL;
+   cl_mem bands[MAX_RING_BANDS];
+   int bandRows = getIntOption(argc, argv, "band-rows", NULL, 
+      defaultBandRows);
+   int ringBands = getIntOption(argc, argv, "ring-bands", NULL,
+      defaultRingBands);
+   int numBands = 0;
+   int b;
+   if (!usePipes) {
+      if (bandRows < 8) { bandRows = 8; }
+      if (ringBands < 2) { ringBands = 2; }
+      if (ringBands > MAX_RING_BANDS) { ringBands = MAX_RING_BANDS; }
+      numBands = (imageRows + bandRows - 1)/bandRows;
+      if (ringBands > numBands) { ringBands = numBands; }
+      printf("Pipes are not available, using %d band buffers of %d rows\n",
+         ringBands, bandRows);
+      for (b = 0; b < ringBands; b++) {
+         bands[b] = poolBuffer(&pool, context, CL_MEM_READ_WRITE, 
+            bandRows*imageCols*sizeof(float));
+      }
+   }
 
-   cl_mem pipe;
-#ifdef OCL_PIPES
-   assert(0);
-#else
-   pipe = clCreateBuffer(context, CL_MEM_READ_WRITE, imageSize, NULL, &status);
-   check(status);
-#endif
+   profileStageEnd(&prof);
+
+   /* The commands form a graph across both queues. The image and
+    * filter uploads and the clearing of the histogram are independent,
+    * and they run while the program is built. */
+   CommandGraph graph;
+   graphInit(&graph, &prof);
 
-   /* Copy the host image data to the GPU */
+   /* Copy the host image data and the filter to the GPU */
    size_t origin[3] = {0, 0, 0}; // Offset within the image to copy from
    size_t region[3] = {imageCols, imageRows, 1}; // Elements to per dimension
-   status = clEnqueueWriteImage(gpuQueue, inputImage, CL_TRUE, 
-      origin, region, 0 /* row-pitch */, 0 /* slice-pitch */, 
-      hInputImage, 0, NULL, NULL);
-   check(status);
-
-   /* Write the filter to the GPU */
-   status = clEnqueueWriteBuffer(gpuQueue, filter, CL_TRUE, 0, 
-      filterSize, gaussianBlurFilter, 0, NULL, NULL);
-   check(status);
+   int uploads[2];
+   uploads[0] = GRAPH_NONE;
+   if (!zeroCopy) {
+      uploads[0] = graphWriteImage(&graph, gpuQueue, inputImage, origin, 
+         region, hInputImage, 0, NULL, "write input");
+   }
+   uploads[1] = graphWriteBuffer(&graph, gpuQueue, filter, 0, filterSize,
+      gaussianBlurFilter, 0, NULL, "write filter");
 
    /* Initialize the output histogram with zeros */
    int zero = 0;
-   status = clEnqueueFillBuffer(cpuQueue, outputHistogram, &zero, 
-      sizeof(int), 0, histogramSize, 0, NULL, NULL);
-   check(status);
-
-   /* Create a program with source code */
-   char *programSource = readFile("producer-consumer.cl");
-   size_t programSourceLen = strlen(programSource);
-   cl_program program = clCreateProgramWithSource(context, 1,
-      (const char**)&programSource, &programSourceLen, &status);
-   check(status);
-
-   /* Build (compile) the program for the devices */
-   status = clBuildProgram(program, 2, devices, NULL, NULL, NULL);
-   if (status != CL_SUCCESS) {
-      printCompilerError(program, gpuDevice);
-      exit(-1);
+   int fillNode = graphFillBuffer(&graph, cpuQueue, outputHistogram, &zero,
+      sizeof(int), 0, histogramSize, 0, NULL, "fill histogram");
+
+   /* Create and build the program, reusing a cached binary from an
+    * earlier run when one matches */
+   profileStageBegin(&prof, "build");
+   char options[160];
+   storageBuildOptions(options, sizeof(options), inputStorage, 
+      STORAGE_FLOAT);
+   if (usePipes) {
+      strcat(options, " -cl-std=CL2.0 -D OCL_PIPES");
    }
+   cl_program program = buildProgramCached(context, numDevices, devices,
+      "producer-consumer.cl", options);
+   profileStageEnd(&prof);
 
    /* Create the kernels */
    cl_kernel producerKernel;
@@ -161,82 +325,213 @@ int main(int argc, char **argv)
    consumerKernel = clCreateKernel(program, "consumerKernel", &status);
    check(status);
 
-   /* Set the kernel arguments */
-#ifdef OCL_PIPES
-   status  = clSetKernelArg(producerKernel, 0, sizeof(cl_mem), &inputImage);
-   status |= clSetKernelArg(producerKernel, 1, sizeof(cl_mem), &pipe);
-   status |= clSetKernelArg(producerKernel, 2, sizeof(cl_mem), &filter);
-   status |= clSetKernelArg(producerKernel, 3, sizeof(int), &filterWidth);
-   check(status);
-#else
-   status  = clSetKernelArg(producerKernel, 0, sizeof(cl_mem), &inputImage);
-   status |= clSetKernelArg(producerKernel, 1, sizeof(int), &imageRows);
-   status |= clSetKernelArg(producerKernel, 2, sizeof(int), &imageCols);
-   status |= clSetKernelArg(producerKernel, 3, sizeof(cl_mem), &pipe);
-   status |= clSetKernelArg(producerKernel, 4, sizeof(cl_mem), &filter);
-   status |= clSetKernelArg(producerKernel, 5, sizeof(int), &filterWidth);
-   check(status);
-#endif
-
-   status  = clSetKernelArg(consumerKernel, 0, sizeof(cl_mem), &pipe);
-   status |= clSetKernelArg(consumerKernel, 1, sizeof(int), &imageElements);
-   status |= clSetKernelArg(consumerKernel, 2, sizeof(cl_mem), &outputHistogram);
-   check(status);
-
-   /* Define the index space and work-group size */
+   /* Define the index space and work-group size: 8x8 work-groups unless
+    * --autotune stored a faster shape for the producer. The NDRange is
+    * padded to whole work-groups. */
+   LaunchConfig producerConfig = {{8, 8}, 1, 0};
+   loadLaunchConfig(producerKernel, gpuDevice, "producerKernel", 
+      &producerConfig);
    size_t producerGlobalSize[2];
-   producerGlobalSize[0] = imageCols;
-   producerGlobalSize[1] = imageRows;
-
-   size_t producerLocalSize[2];
-   producerLocalSize[0] = 8;
-   producerLocalSize[1] = 8;
-
-   size_t consumerGlobalSize[1];
-   consumerGlobalSize[0] = 1;
-
-   size_t consumerLocalSize[1];
-   consumerLocalSize[0] = 1;
-
-   /* Enqueue the kernels for execution */
-   status = clEnqueueNDRangeKernel(gpuQueue, producerKernel, 2, NULL,
-      producerGlobalSize, producerLocalSize, 0, NULL, NULL);
-   check(status);
-
-#ifndef OCL_PIPES
-   /* If pipes aren't supported, we need to run sequentially */
-   clFinish(gpuQueue);
+   producerGlobalSize[0] = roundUp(imageCols, producerConfig.local[0]);
+   producerGlobalSize[1] = roundUp(imageRows, producerConfig.local[1]);
+
+   size_t *producerLocalSize = producerConfig.local;
+
+#ifdef CL_VERSION_2_0
+   /* Every reservation of a work-group of either kernel has to fit in
+    * the pipe, or it never succeeds and both kernels spin forever */
+   if (usePipes) {
+      int pipePackets = getIntOption(argc, argv, "pipe-packets", NULL, 
+         defaultPipePackets);
+      int minPackets = (int)(producerLocalSize[0]*producerLocalSize[1]);
+      if (minPackets < (int)pipeConsumerGroupSize) {
+         minPackets = (int)pipeConsumerGroupSize;
+      }
+      if (pipePackets < minPackets) {
+         printf("A pipe of %d pixels is too small, using %d\n", 
+            pipePackets, minPackets);
+         pipePackets = minPackets;
+      }
+      if (numDevices == 1 || pipePackets > imageElements) {
+         pipePackets = imageElements;
+      }
+      printf("Using a pipe of %d pixels\n", pipePackets);
+      pipe = poolPipe(&pool, context, 
+         CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizeof(cl_float), 
+         (cl_uint)pipePackets);
+   }
 #endif
 
-   status = clEnqueueNDRangeKernel(cpuQueue, consumerKernel, 1, NULL,
-      consumerGlobalSize, consumerLocalSize, 0, NULL, NULL);
-   check(status);
-
-   /* Read the output histogram buffer to the host */
-   status = clEnqueueReadBuffer(cpuQueue, outputHistogram, CL_TRUE, 0,
-         histogramSize, hOutputHistogram, 0, NULL, NULL);
-   check(status);
+   int histogramDeps[2] = {GRAPH_NONE, GRAPH_NONE};
+   if (usePipes) {
+      /* Set the kernel arguments */
+      status  = clSetKernelArg(producerKernel, 0, sizeof(cl_mem), 
+         &inputImage);
+      status |= clSetKernelArg(producerKernel, 1, sizeof(cl_mem), &pipe);
+      status |= clSetKernelArg(producerKernel, 2, sizeof(cl_mem), &filter);
+      status |= clSetKernelArg(producerKernel, 3, sizeof(int), &filterWidth);
+      check(status);
+
+      status  = clSetKernelArg(consumerKernel, 0, sizeof(cl_mem), &pipe);
+      status |= clSetKernelArg(consumerKernel, 1, sizeof(int), 
+         &imageElements);
+      status |= clSetKernelArg(consumerKernel, 2, sizeof(cl_mem), 
+         &outputHistogram);
+      check(status);
+
+      /* The consumer is a single work-group */
+      size_t consumerGlobalSize[1];
+      consumerGlobalSize[0] = pipeConsumerGroupSize;
+
+      size_t consumerLocalSize[1];
+      consumerLocalSize[0] = pipeConsumerGroupSize;
+
+      /* Enqueue the kernels for execution. On two devices the consumer
+       * runs alongside the producer, so it must not depend on it. One
+       * device need not run them concurrently, and a consumer started
+       * first would spin forever, so it waits for the producer; the
+       * pipe then holds the whole image. */
+      int kernels[2];
+      kernels[0] = graphKernel(&graph, gpuQueue, producerKernel, 2, NULL,
+         producerGlobalSize, producerLocalSize, imageElements, 2, uploads,
+         "producer kernel");
+      int consumerDeps[2] = {fillNode, GRAPH_NONE};
+      if (numDevices == 1) {
+         consumerDeps[1] = kernels[0];
+      }
+      kernels[1] = graphKernel(&graph, cpuQueue, consumerKernel, 1, NULL,
+         consumerGlobalSize, consumerLocalSize, imageElements, 2, 
+         consumerDeps, "consumer kernel");
+      histogramDeps[0] = kernels[0];
+      histogramDeps[1] = kernels[1];
+   }
+   else {
+      /* The consumer of a band runs one work-group per compute unit */
+      size_t consumerLocalSize[1];
+      size_t consumerGlobalSize[1];
+      cl_uint computeUnits;
+      check(clGetKernelWorkGroupInfo(consumerKernel, cpuDevice, 
+         CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), consumerLocalSize, 
+         NULL));
+      if (consumerLocalSize[0] > 256) { consumerLocalSize[0] = 256; }
+      check(clGetDeviceInfo(cpuDevice, CL_DEVICE_MAX_COMPUTE_UNITS, 
+         sizeof(cl_uint), &computeUnits, NULL));
+      consumerGlobalSize[0] = consumerLocalSize[0]*computeUnits;
+
+      status  = clSetKernelArg(producerKernel, 0, sizeof(cl_mem), 
+         &inputImage);
+      status |= clSetKernelArg(producerKernel, 2, sizeof(int), &imageCols);
+      status |= clSetKernelArg(producerKernel, 3, sizeof(cl_mem), 
+         &bands[0]);
+      status |= clSetKernelArg(producerKernel, 4, sizeof(cl_mem), &filter);
+      status |= clSetKernelArg(producerKernel, 5, sizeof(int), &filterWidth);
+      status |= clSetKernelArg(consumerKernel, 2, sizeof(cl_mem), 
+         &outputHistogram);
+      check(status);
+
+      /* "--autotune" times the producer on the first band, once the
+       * uploads are done. With pipes the producer cannot run without its
+       * consumer, so only the band version is tuned. */
+      if (autotuneRequested(argc, argv)) {
+         graphWait(&graph);
+         producerConfig = tuneProducer(gpuQueue, gpuDevice, producerKernel,
+            imageCols, imageRows < bandRows ? imageRows : bandRows);
+      }
 
-   /* Verify the result */
-   float *refConvolution = convolutionGoldFloat(hInputImage, 
-      imageRows, imageCols, gaussianBlurFilter, filterWidth);
-   int *refHistogram = histogramGoldFloat(refConvolution, imageRows*imageCols,
-         HIST_BINS);
-   int i;
-   int passed = 1;
-   for (i = 0; i < HIST_BINS; i++) {
-      if (hOutputHistogram[i] != refHistogram[i]) {
-         passed = 0;
+      /* Band b is produced into ring slot b % ringBands after the
+       * uploads and once the consumer of band b - ringBands has released
+       * the slot. It is consumed once it has been produced and the
+       * previous band has been consumed (the first band after the
+       * histogram is cleared), so the producer computes band b+1 while
+       * the consumer works on band b. */
+      int *produced = (int*)malloc(numBands*sizeof(int));
+      int *consumed = (int*)malloc(numBands*sizeof(int));
+      if (!produced || !consumed) { exit(-1); }
+
+      for (b = 0; b < numBands; b++) {
+         int slot = b % ringBands;
+         int firstRow = b*bandRows;
+         int endRow = (imageRows - firstRow < bandRows) ? 
+            imageRows : firstRow + bandRows;
+         int bandPixels = (endRow - firstRow)*imageCols;
+
+         size_t bandOffset[2];
+         bandOffset[0] = 0;
+         bandOffset[1] = firstRow;
+         size_t bandGlobalSize[2];
+         bandGlobalSize[0] = roundUp(imageCols, producerLocalSize[0]);
+         bandGlobalSize[1] = roundUp(endRow - firstRow, 
+            producerLocalSize[1]);
+
+         status  = clSetKernelArg(producerKernel, 1, sizeof(int), &endRow);
+         status |= clSetKernelArg(producerKernel, 3, sizeof(cl_mem), 
+            &bands[slot]);
+         check(status);
+         int producerDeps[3];
+         producerDeps[0] = uploads[0];
+         producerDeps[1] = uploads[1];
+         producerDeps[2] = b >= ringBands ? consumed[b - ringBands] 
+                                          : GRAPH_NONE;
+         produced[b] = graphKernel(&graph, gpuQueue, producerKernel, 2, 
+            bandOffset, bandGlobalSize, producerLocalSize, bandPixels, 3,
+            producerDeps, "producer band");
+
+         status  = clSetKernelArg(consumerKernel, 0, sizeof(cl_mem), 
+            &bands[slot]);
+         status |= clSetKernelArg(consumerKernel, 1, sizeof(int), 
+            &bandPixels);
+         check(status);
+         int consumerDeps[2];
+         consumerDeps[0] = produced[b];
+         consumerDeps[1] = b > 0 ? consumed[b - 1] : fillNode;
+         consumed[b] = graphKernel(&graph, cpuQueue, consumerKernel, 1, 
+            NULL, consumerGlobalSize, consumerLocalSize, bandPixels, 2, 
+            consumerDeps, "consumer band");
       }
+
+      histogramDeps[0] = consumed[numBands - 1];
+      free(produced);
+      free(consumed);
    }
-   if (passed) {
-      printf("Passed!\n");
+
+   /* Read the output histogram buffer to the host, or map it, and wait
+    * for the whole graph */
+   int *result = hOutputHistogram;
+   if (zeroCopy) {
+      graphMapBuffer(&graph, cpuQueue, outputHistogram, CL_MAP_READ,
+         histogramSize, (void**)&result, 2, histogramDeps, 
+         "map histogram");
    }
    else {
-      printf("Failed.\n");
+      graphReadBuffer(&graph, cpuQueue, outputHistogram, 0, histogramSize,
+         hOutputHistogram, 2, histogramDeps, "read histogram");
    }
+   graphWait(&graph);
+   printTransferTime(zeroCopy, graph.transferMs);
+   graphRelease(&graph);
+
+   /* Verify the result */
+   profileStageBegin(&prof, "gold");
+   float *inputPixels = storageToFloat(hInputImage, imageElements, 
+      inputStorage);
+   float *refConvolution = convolutionGoldParallel(inputPixels, 
+      imageRows, imageCols, gaussianBlurFilter, filterWidth);
+   int *refHistogram = histogramGoldFloatParallel(refConvolution, 
+      imageElements, HIST_BINS);
+   CompareSummary summary;
+   compareInts(result, refHistogram, HIST_BINS, &summary);
+   printCompareSummary(&summary);
+   free(inputPixels);
    free(refConvolution);
    free(refHistogram);
+   profileStageEnd(&prof);
+   if (zeroCopy) {
+      unmapObject(cpuQueue, outputHistogram, result, &prof, 
+         "unmap histogram");
+   }
+
+   /* Write the timing report */
+   profilerReport(&prof, gpuDevice);
 
    /* Free OpenCL resources */
    clReleaseKernel(producerKernel);
@@ -244,16 +539,27 @@ int main(int argc, char **argv)
    clReleaseProgram(program);
    clReleaseCommandQueue(gpuQueue);
    clReleaseCommandQueue(cpuQueue);
-   clReleaseMemObject(inputImage);
-   clReleaseMemObject(outputHistogram);
-   clReleaseMemObject(filter);
-   clReleaseMemObject(pipe);
+   if (zeroCopy) {
+      clReleaseMemObject(inputImage);
+   }
+   else {
+      poolReturn(&pool, inputImage);
+   }
+   poolReturn(&pool, outputHistogram);
+   poolReturn(&pool, filter);
+   if (pipe) {
+      poolReturn(&pool, pipe);
+   }
+   for (b = 0; b < (usePipes ? 0 : ringBands); b++) {
+      poolReturn(&pool, bands[b]);
+   }
+   poolPrintStats(&pool);
+   poolRelease(&pool);
    clReleaseContext(context);
 
    /* Free host resources */
    free(hInputImage);
    free(hOutputHistogram);
-   free(programSource);
 
    return 0;
 }
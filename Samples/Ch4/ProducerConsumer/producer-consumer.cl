@@ -3,6 +3,15 @@ __constant sampler_t sampler =
    CLK_FILTER_NEAREST          |
    CLK_ADDRESS_CLAMP_TO_EDGE;
 
+/* Scale factor for 8-bit input images (see image-storage.h) */
+#ifndef INPUT_SCALE
+#define INPUT_SCALE 1.0f
+#endif
+
+/* Number of histogram bins. Convolved values outside [0, HIST_BINS) are
+ * not counted, like in the host reference. */
+#define HIST_BINS 256
+
 __kernel
 void producerKernel(
    image2d_t __read_only inputImage,
@@ -48,45 +57,133 @@ void producerKernel(
           * vector. */
          float4 pixel;         
          pixel = read_imagef(inputImage, sampler, coords);
-         sum += pixel.x * filter[filterIdx++];
+         sum += pixel.x * INPUT_SCALE * filter[filterIdx++];
       }
    }
    
-   /* Write the output pixel to the pipe */
+   /* Write the output pixel to the pipe. The NDRange is padded to whole
+    * work-groups, so only the work-items inside the image write. The
+    * work-group reserves room for all of its pixels at once, retrying
+    * while the pipe is full, and each of those work-items fills its own
+    * slot of the reservation. */
 #ifdef OCL_PIPES
-   write_pipe(outputPipe, &sum);
+   uint valid = (column < get_image_width(inputImage) &&
+                 row < get_image_height(inputImage)) ? 1 : 0;
+   uint groupPixels = work_group_reduce_add(valid);
+   uint localIdx = work_group_scan_exclusive_add(valid);
+   if (groupPixels > 0)
+   {
+      reserve_id_t reserveId;
+      do
+      {
+         reserveId = work_group_reserve_write_pipe(outputPipe, groupPixels);
+      } while (!is_valid_reserve_id(reserveId));
+      if (valid)
+      {
+         write_pipe(outputPipe, reserveId, localIdx, &sum);
+      }
+      work_group_commit_write_pipe(outputPipe, reserveId);
+   }
 #else
-   int gid = row*cols+column;
-   outputPipe[gid] = sum;
+   /* Without pipes the kernel produces one band of rows, starting at the
+    * global offset, into a band buffer. 'rows' is the end of the band,
+    * which the padded NDRange may extend past. */
+   if (row < rows && column < cols)
+   {
+      int gid = (row - get_global_offset(1))*cols+column;
+      outputPipe[gid] = sum;
+   }
 #endif
 }
 
+#ifdef OCL_PIPES
+/* A single work-group consumes the pipe. It reserves up to one packet
+ * per work-item at a time, instead of spinning on every pixel, and
+ * accumulates into a local histogram that is written out at the end. */
 __kernel
 void consumerKernel(
-#ifdef OCL_PIPES
    pipe __read_only float *inputPipe,
-#else
-   __global float *inputPipe,
-#endif
    int totalPixels,
    __global int *histogram)
 {
-   int pixelCnt;
-   float pixel;
-   
-   /* Loop to process all pixels from the producer kernel */
-   for (pixelCnt = 0; pixelCnt < totalPixels; pixelCnt++)
+   __local int localHistogram[HIST_BINS];
+
+   int localIdx = get_local_id(0);
+   int groupSize = get_local_size(0);
+
+   for (int bin = localIdx; bin < HIST_BINS; bin += groupSize)
    {
-      
-#ifdef OCL_PIPES
-      /* Keep trying to read a pixel from the pipe 
-       * until one becomes available */
-      while(read_pipe(inputPipe, &pixel));
+      localHistogram[bin] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int base = 0; base < totalPixels; base += groupSize)
+   {
+      uint packets = min(groupSize, totalPixels - base);
+
+      /* Wait until the producer has written enough pixels */
+      reserve_id_t reserveId;
+      do
+      {
+         reserveId = work_group_reserve_read_pipe(inputPipe, packets);
+      } while (!is_valid_reserve_id(reserveId));
+
+      if (localIdx < packets)
+      {
+         float pixel;
+         read_pipe(inputPipe, reserveId, localIdx, &pixel);
+         int bin = (int)pixel;
+         if (bin >= 0 && bin < HIST_BINS)
+         {
+            atomic_inc(&localHistogram[bin]);
+         }
+      }
+      work_group_commit_read_pipe(inputPipe, reserveId);
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int bin = localIdx; bin < HIST_BINS; bin += groupSize)
+   {
+      histogram[bin] += localHistogram[bin];
+   }
+}
 #else
-      pixel = inputPipe[pixelCnt];
-#endif
-      
-      /* Add the pixel value to the histogram */
-      histogram[(int)pixel]++;
+/* Histogram of one band of convolved pixels. Each work-group builds a
+ * local histogram over its share of the band and then adds it to the
+ * output histogram with atomics. */
+__kernel
+void consumerKernel(
+   __global const float *inputPipe,
+   int totalPixels,
+   __global int *histogram)
+{
+   __local int localHistogram[HIST_BINS];
+
+   int localIdx = get_local_id(0);
+   int groupSize = get_local_size(0);
+
+   for (int bin = localIdx; bin < HIST_BINS; bin += groupSize)
+   {
+      localHistogram[bin] = 0;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int i = get_global_id(0); i < totalPixels; i += get_global_size(0))
+   {
+      int bin = (int)inputPipe[i];
+      if (bin >= 0 && bin < HIST_BINS)
+      {
+         atomic_inc(&localHistogram[bin]);
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int bin = localIdx; bin < HIST_BINS; bin += groupSize)
+   {
+      if (localHistogram[bin] > 0)
+      {
+         atomic_add(&histogram[bin], localHistogram[bin]);
+      }
    }
 }
+#endif
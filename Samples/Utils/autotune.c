@@ -0,0 +1,311 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "options.h"
+#include "program-cache.h"
+#include "autotune.h"
+
+#define MAX_TUNED_KERNELS 64
+#define MAX_TUNED_DEVICES 8
+#define TUNE_REPEATS 3
+
+/* One line of the tuning file */
+typedef struct {
+   char kernel[64];
+   LaunchConfig config;
+   double ms;
+   int ignored;         /* Reported as unusable once already */
+} TunedKernel;
+
+/* The tuning file of a device, loaded once by deviceTuning */
+typedef struct {
+   cl_device_id device;
+   int count;
+   TunedKernel entries[MAX_TUNED_KERNELS];
+} DeviceTuning;
+
+static DeviceTuning tunings[MAX_TUNED_DEVICES];
+static int numTunings = 0;
+
+int autotuneRequested(int argc, char **argv)
+{
+   return hasOption(argc, argv, "autotune", "OCL_AUTOTUNE");
+}
+
+size_t roundUp(size_t value, size_t multiple)
+{
+   return (value + multiple - 1)/multiple*multiple;
+}
+
+/* Read the tuning file of 'device'. The file is written by
+ * writeTuning with one kernel per line, which is all this parses. */
+static int readTuning(const char *path, TunedKernel *entries)
+{
+   char line[512];
+   int count = 0;
+   FILE *fp = fopen(path, "r");
+
+   if (!fp) {
+      return 0;
+   }
+   while (fgets(line, sizeof(line), fp) && count < MAX_TUNED_KERNELS) {
+      TunedKernel *e = &entries[count];
+      unsigned long local0, local1, groups;
+      if (sscanf(line, " \"%63[^\"]\": {\"local\": [%lu, %lu], \"items\": %d, "
+             "\"groups\": %lu, \"ms\": %lf}", e->kernel, &local0, &local1,
+             &e->config.items, &groups, &e->ms) == 6 &&
+          local0 > 0 && local1 > 0 && e->config.items > 0) {
+         e->config.local[0] = local0;
+         e->config.local[1] = local1;
+         e->config.groups = groups;
+         e->ignored = 0;
+         count++;
+      }
+   }
+   fclose(fp);
+   return count;
+}
+
+/* Write the tuning file through a temporary file, so that concurrent runs
+ * never read a partial one */
+static void writeTuning(const char *path, cl_device_id device,
+   const TunedKernel *entries, int count)
+{
+   char tmpPath[1100];
+   char name[256];
+   char driver[256];
+   FILE *fp;
+   int i;
+
+   name[0] = '\0';
+   driver[0] = '\0';
+   clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+   clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+   for (i = 0; name[i]; i++) {
+      if (name[i] == '"' || name[i] == '\\') { name[i] = ' '; }
+   }
+   for (i = 0; driver[i]; i++) {
+      if (driver[i] == '"' || driver[i] == '\\') { driver[i] = ' '; }
+   }
+
+   snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+   fp = fopen(tmpPath, "w");
+   if (!fp) {
+      printf("Cannot write %s\n", tmpPath);
+      return;
+   }
+   fprintf(fp, "{\n  \"device\": \"%s\",\n  \"driver\": \"%s\",\n"
+      "  \"kernels\": {\n", name, driver);
+   for (i = 0; i < count; i++) {
+      const TunedKernel *e = &entries[i];
+      fprintf(fp, "    \"%s\": {\"local\": [%lu, %lu], \"items\": %d, "
+         "\"groups\": %lu, \"ms\": %.6f}%s\n", e->kernel, 
+         (unsigned long)e->config.local[0], 
+         (unsigned long)e->config.local[1], e->config.items, 
+         (unsigned long)e->config.groups, e->ms, 
+         i + 1 < count ? "," : "");
+   }
+   fprintf(fp, "  }\n}\n");
+   if (fclose(fp) != 0 || rename(tmpPath, path) != 0) {
+      remove(tmpPath);
+   }
+}
+
+/* The tuning of 'device', read from its file on first use. When more
+ * devices than MAX_TUNED_DEVICES are used, the last slot is reloaded. */
+static DeviceTuning* deviceTuning(cl_device_id device)
+{
+   DeviceTuning *t;
+   char path[1100];
+   int i;
+
+   for (i = 0; i < numTunings; i++) {
+      if (tunings[i].device == device) {
+         return &tunings[i];
+      }
+   }
+   t = &tunings[numTunings < MAX_TUNED_DEVICES ? numTunings++ : 
+      MAX_TUNED_DEVICES - 1];
+   cacheFilePath(device, "tuning", ".json", path, sizeof(path));
+   t->device = device;
+   t->count = readTuning(path, t->entries);
+   return t;
+}
+
+int checkLaunchConfig(cl_kernel kernel, cl_device_id device,
+   const LaunchConfig *config)
+{
+   size_t maxGroup;
+   size_t maxItems[3];
+
+   if (kernel) {
+      check(clGetKernelWorkGroupInfo(kernel, device, 
+         CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL));
+   }
+   else {
+      check(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, 
+         sizeof(size_t), &maxGroup, NULL));
+   }
+   check(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, 
+      sizeof(maxItems), maxItems, NULL));
+   return config->items >= 1 && 
+      config->local[0] >= 1 && config->local[0] <= maxItems[0] &&
+      config->local[1] >= 1 && config->local[1] <= maxItems[1] &&
+      config->local[0]*config->local[1] <= maxGroup;
+}
+
+int loadLaunchConfig(cl_kernel kernel, cl_device_id device, 
+   const char *kernelName, LaunchConfig *config)
+{
+   DeviceTuning *t = deviceTuning(device);
+   int i;
+
+   for (i = 0; i < t->count; i++) {
+      if (strcmp(t->entries[i].kernel, kernelName) != 0) {
+         continue;
+      }
+      if (!checkLaunchConfig(kernel, device, &t->entries[i].config)) {
+         if (!t->entries[i].ignored) {
+            printf("Ignoring the stored launch configuration of %s, which "
+               "the device cannot run\n", kernelName);
+            t->entries[i].ignored = 1;
+         }
+         return 0;
+      }
+      *config = t->entries[i].config;
+      return 1;
+   }
+   return 0;
+}
+
+void saveLaunchConfig(cl_device_id device, const char *kernelName,
+   const LaunchConfig *config, double ms)
+{
+   DeviceTuning *t = deviceTuning(device);
+   char path[1100];
+   int i;
+
+   /* Merge with the file as it is now, which another run may have
+    * changed since it was loaded */
+   cacheFilePath(device, "tuning", ".json", path, sizeof(path));
+   t->count = readTuning(path, t->entries);
+   for (i = 0; i < t->count; i++) {
+      if (strcmp(t->entries[i].kernel, kernelName) == 0) {
+         break;
+      }
+   }
+   if (i == MAX_TUNED_KERNELS) {
+      return;
+   }
+   snprintf(t->entries[i].kernel, sizeof(t->entries[i].kernel), "%s", 
+      kernelName);
+   t->entries[i].config = *config;
+   t->entries[i].ms = ms;
+   t->entries[i].ignored = 0;
+   if (i == t->count) {
+      t->count++;
+   }
+   writeTuning(path, device, t->entries, t->count);
+}
+
+int localSizeCandidates(cl_kernel kernel, cl_device_id device, int dims,
+   size_t sizes[][2], int maxSizes)
+{
+   size_t maxGroup;
+   size_t multiple;
+   size_t maxItems[3];
+   size_t x, y;
+   int count = 0;
+
+   check(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+      sizeof(size_t), &maxGroup, NULL));
+   check(clGetKernelWorkGroupInfo(kernel, device, 
+      CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), 
+      &multiple, NULL));
+   check(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, 
+      sizeof(maxItems), maxItems, NULL));
+   if (multiple < 1 || multiple > maxGroup) {
+      multiple = 1;
+   }
+
+   for (y = 1; y <= (dims == 2 ? maxItems[1] : 1) && count < maxSizes; 
+        y *= 2) {
+      for (x = 1; x <= maxItems[0] && x*y <= maxGroup && count < maxSizes; 
+           x *= 2) {
+         /* Groups below the preferred multiple leave lanes idle, except
+          * when the kernel cannot even fill one multiple */
+         if ((x*y) % multiple != 0 && x*y*2 <= maxGroup) {
+            continue;
+         }
+         /* Very narrow 2D shapes read images poorly */
+         if (dims == 2 && x < 4 && x*y > 4) {
+            continue;
+         }
+         sizes[count][0] = x;
+         sizes[count][1] = y;
+         count++;
+      }
+   }
+   return count;
+}
+
+/* Duration of a finished command in milliseconds */
+static double eventMs(cl_event event)
+{
+   cl_ulong start, end;
+   check(clWaitForEvents(1, &event));
+   check(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, 
+      sizeof(cl_ulong), &start, NULL));
+   check(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, 
+      sizeof(cl_ulong), &end, NULL));
+   return (end - start)*1e-6;
+}
+
+LaunchConfig autotuneKernel(cl_device_id device, const char *kernelName,
+   const LaunchConfig *candidates, int numCandidates, LaunchFunc launch,
+   void *arg)
+{
+   LaunchConfig best = candidates[0];
+   double bestMs = -1.0;
+   int c, r;
+
+   for (c = 0; c < numCandidates; c++) {
+      double ms = -1.0;
+      for (r = 0; r <= TUNE_REPEATS; r++) {
+         cl_event event = launch(arg, &candidates[c]);
+         if (!event) {
+            break;
+         }
+         /* The first launch only warms up */
+         double t = eventMs(event);
+         clReleaseEvent(event);
+         if (r > 0 && (ms < 0.0 || t < ms)) {
+            ms = t;
+         }
+      }
+      if (ms >= 0.0 && (bestMs < 0.0 || ms < bestMs)) {
+         best = candidates[c];
+         bestMs = ms;
+      }
+   }
+
+   if (bestMs < 0.0) {
+      printf("Autotune %s: no configuration could be launched\n", 
+         kernelName);
+      return best;
+   }
+   printf("Autotune %s: %lux%lu work-groups, %d item(s) per work-item, "
+      "%lu groups, %.3f ms (%d configurations)\n", kernelName,
+      (unsigned long)best.local[0], (unsigned long)best.local[1], 
+      best.items, (unsigned long)best.groups, bestMs, numCandidates);
+   saveLaunchConfig(device, kernelName, &best, bestMs);
+   return best;
+}
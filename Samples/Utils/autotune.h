@@ -0,0 +1,68 @@
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+#include <CL/cl.h>
+
+/* How a kernel is launched: its work-group size, the number of elements
+ * each work-item handles along dimension 0, and, for kernels that loop
+ * over their data, the number of work-groups (0 when the NDRange is sized
+ * from the data instead) */
+typedef struct {
+   size_t local[2];
+   int items;
+   size_t groups;
+} LaunchConfig;
+
+#define MAX_TUNE_CANDIDATES 256
+
+/* Return 1 if "--autotune" (or OCL_AUTOTUNE=1) is given. The samples then
+ * time the candidate configurations of their kernels on the actual data
+ * and store the fastest ones; queueProperties() enables profiling for
+ * this. The results are kept in a JSON file per device and driver in
+ * the "tuning" directory of the program cache (see program-cache.h),
+ * which every later run loads. */
+int autotuneRequested(int argc, char **argv);
+
+/* Replace 'config' with the stored configuration of 'kernelName' on
+ * 'device', if there is one that passes checkLaunchConfig for 'kernel'.
+ * Returns 1 when it was used. A stale or edited entry is ignored with a
+ * message. The tuning file of a device is read once and then kept in
+ * memory. */
+int loadLaunchConfig(cl_kernel kernel, cl_device_id device, 
+   const char *kernelName, LaunchConfig *config);
+
+/* Return 1 if 'kernel' can be launched on 'device' with 'config': the
+ * work-group fits CL_KERNEL_WORK_GROUP_SIZE (CL_DEVICE_MAX_WORK_GROUP_SIZE
+ * when 'kernel' is NULL, as for a program still to be built) and
+ * CL_DEVICE_MAX_WORK_ITEM_SIZES, and each work-item handles at least one
+ * element */
+int checkLaunchConfig(cl_kernel kernel, cl_device_id device,
+   const LaunchConfig *config);
+
+/* Store the configuration of 'kernelName', replacing an earlier one */
+void saveLaunchConfig(cl_device_id device, const char *kernelName,
+   const LaunchConfig *config, double ms);
+
+/* Fill 'sizes' with the work-group sizes worth trying for 'kernel': 1D
+ * sizes (dims 1, sizes[i][1] = 1) or 2D shapes whose product is a
+ * multiple of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE (or smaller
+ * than it) and at most CL_KERNEL_WORK_GROUP_SIZE. Returns the count. */
+int localSizeCandidates(cl_kernel kernel, cl_device_id device, int dims,
+   size_t sizes[][2], int maxSizes);
+
+/* Enqueue the kernel with 'config' and return the event of the launch,
+ * or NULL if the configuration cannot be used */
+typedef cl_event (*LaunchFunc)(void *arg, const LaunchConfig *config);
+
+/* Time each candidate (the best of a few launches, after a warm-up) and
+ * return the fastest, which is also stored for 'kernelName'. Falls back
+ * to 'candidates[0]' if none of them can be launched. */
+LaunchConfig autotuneKernel(cl_device_id device, const char *kernelName,
+   const LaunchConfig *candidates, int numCandidates, LaunchFunc launch,
+   void *arg);
+
+/* Round 'value' up to a multiple of 'multiple' (the padded NDRange of
+ * kernels that check their bounds) */
+size_t roundUp(size_t value, size_t multiple);
+
+#endif
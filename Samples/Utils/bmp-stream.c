@@ -0,0 +1,280 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "image-storage.h"
+#include "bmp-stream.h"
+
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_PALETTE_SIZE 1024
+
+static unsigned int readLE16(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8);
+}
+
+static unsigned int readLE32(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void writeLE16(unsigned char *p, unsigned int value)
+{
+   p[0] = value & 0xff;
+   p[1] = (value >> 8) & 0xff;
+}
+
+static void writeLE32(unsigned char *p, unsigned int value)
+{
+   p[0] = value & 0xff;
+   p[1] = (value >> 8) & 0xff;
+   p[2] = (value >> 16) & 0xff;
+   p[3] = (value >> 24) & 0xff;
+}
+
+/* Integer luma of a BGR pixel; exact for gray pixels */
+static unsigned char grayBGR(const unsigned char *bgr)
+{
+   return (unsigned char)((bgr[0]*29 + bgr[1]*150 + bgr[2]*77) >> 8);
+}
+
+static void bmpFail(const char *filename, const char *reason)
+{
+   printf("Cannot read %s: %s\n", filename, reason);
+   exit(-1);
+}
+
+void bmpOpen(BmpStream *bmp, const char *filename)
+{
+   struct stat st;
+   const unsigned char *header;
+   unsigned int dataOffset;
+   unsigned int infoSize;
+   unsigned int compression;
+   unsigned int numColors;
+   int height;
+   int fd;
+   int i;
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) != 0) {
+      bmpFail(filename, "cannot open the file");
+   }
+   bmp->mapSize = (size_t)st.st_size;
+   if (bmp->mapSize < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE) {
+      bmpFail(filename, "file too short");
+   }
+   bmp->map = mmap(NULL, bmp->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (bmp->map == MAP_FAILED) {
+      bmpFail(filename, "cannot map the file");
+   }
+   madvise(bmp->map, bmp->mapSize, MADV_SEQUENTIAL);
+
+   header = (const unsigned char*)bmp->map;
+   if (header[0] != 'B' || header[1] != 'M') {
+      bmpFail(filename, "not a BMP file");
+   }
+   dataOffset = readLE32(header + 10);
+   infoSize = readLE32(header + 14);
+   bmp->cols = (int)readLE32(header + 18);
+   height = (int)readLE32(header + 22);
+   bmp->bitsPerPixel = (int)readLE16(header + 28);
+   compression = readLE32(header + 30);
+   numColors = readLE32(header + 46);
+
+   if (infoSize < BMP_INFO_HEADER_SIZE) {
+      bmpFail(filename, "unsupported header version");
+   }
+   if (compression != 0 || (bmp->bitsPerPixel != 8 && 
+       bmp->bitsPerPixel != 24 && bmp->bitsPerPixel != 32)) {
+      bmpFail(filename, "only uncompressed 8, 24 and 32-bit images "
+         "are supported");
+   }
+   bmp->bottomUp = height > 0;
+   bmp->rows = height > 0 ? height : -height;
+   bmp->rowStride = ((size_t)bmp->cols*bmp->bitsPerPixel + 31)/32*4;
+   if (bmp->cols <= 0 || bmp->rows == 0 || dataOffset > bmp->mapSize || 
+       (bmp->mapSize - dataOffset)/bmp->rowStride < (size_t)bmp->rows) {
+      bmpFail(filename, "truncated or invalid header");
+   }
+   bmp->pixels = header + dataOffset;
+
+   /* Palette images store an index per pixel */
+   for (i = 0; i < 256; i++) {
+      bmp->gray[i] = (unsigned char)i;
+   }
+   if (bmp->bitsPerPixel == 8) {
+      const unsigned char *palette = header + BMP_FILE_HEADER_SIZE + 
+         infoSize;
+      if (numColors == 0 || numColors > 256) {
+         numColors = 256;
+      }
+      if (palette + 4*numColors > bmp->pixels) {
+         bmpFail(filename, "truncated palette");
+      }
+      for (i = 0; i < (int)numColors; i++) {
+         bmp->gray[i] = grayBGR(palette + 4*i);
+      }
+   }
+}
+
+void bmpReadRows(const BmpStream *bmp, int firstRow, int numRows, void *dst,
+   ImageStorage storage)
+{
+   size_t pixelSize = storagePixelSize(storage);
+   long pageSize = sysconf(_SC_PAGESIZE);
+   int bytesPerPixel = bmp->bitsPerPixel/8;
+   int r, c;
+
+   for (r = 0; r < numRows; r++) {
+      int row = firstRow + r;
+      const unsigned char *src = bmp->pixels + bmp->rowStride*
+         (size_t)(bmp->bottomUp ? bmp->rows - 1 - row : row);
+      unsigned char *out = (unsigned char*)dst + 
+         (size_t)r*bmp->cols*pixelSize;
+
+      for (c = 0; c < bmp->cols; c++) {
+         unsigned char value = (bytesPerPixel == 1) ? 
+            bmp->gray[src[c]] : grayBGR(src + (size_t)c*bytesPerPixel);
+         switch (storage) {
+         case STORAGE_UNORM8:
+            out[c] = value;
+            break;
+         case STORAGE_HALF:
+            ((cl_half*)out)[c] = floatToHalf((float)value);
+            break;
+         default:
+            ((float*)out)[c] = (float)value;
+            break;
+         }
+      }
+   }
+
+   /* Let the kernel drop the pages just decoded. They are file-backed and
+    * are simply read again should the rows be needed once more. */
+   if (numRows > 0 && pageSize > 0) {
+      const unsigned char *first = bmp->pixels + bmp->rowStride*
+         (size_t)(bmp->bottomUp ? bmp->rows - firstRow - numRows : firstRow);
+      size_t start = (size_t)(first - (const unsigned char*)bmp->map);
+      size_t end = start + bmp->rowStride*(size_t)numRows;
+      start = start/pageSize*pageSize;
+      madvise((char*)bmp->map + start, end - start, MADV_DONTNEED);
+   }
+}
+
+void bmpClose(BmpStream *bmp)
+{
+   munmap(bmp->map, bmp->mapSize);
+   bmp->map = NULL;
+}
+
+void bmpCreate(BmpWriter *bmp, const char *filename, int rows, int cols)
+{
+   unsigned char header[BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE +
+      BMP_PALETTE_SIZE];
+   const unsigned int dataOffset = sizeof(header);
+   int i;
+
+   bmp->rows = rows;
+   bmp->cols = cols;
+   bmp->rowStride = ((size_t)cols + 3)/4*4;
+   bmp->band = NULL;
+   bmp->bandSize = 0;
+   bmp->fp = fopen(filename, "wb");
+   if (!bmp->fp) {
+      printf("Cannot create %s\n", filename);
+      exit(-1);
+   }
+
+   /* File header, info header and a gray palette */
+   memset(header, 0, sizeof(header));
+   header[0] = 'B';
+   header[1] = 'M';
+   writeLE32(header + 2, 
+      (unsigned int)(dataOffset + bmp->rowStride*(size_t)rows));
+   writeLE32(header + 10, dataOffset);
+   writeLE32(header + 14, BMP_INFO_HEADER_SIZE);
+   writeLE32(header + 18, (unsigned int)cols);
+   writeLE32(header + 22, (unsigned int)rows);
+   writeLE16(header + 26, 1);
+   writeLE16(header + 28, 8);
+   writeLE32(header + 34, (unsigned int)(bmp->rowStride*(size_t)rows));
+   writeLE32(header + 46, 256);
+   for (i = 0; i < 256; i++) {
+      unsigned char *entry = header + BMP_FILE_HEADER_SIZE + 
+         BMP_INFO_HEADER_SIZE + 4*i;
+      entry[0] = entry[1] = entry[2] = (unsigned char)i;
+   }
+   if (fwrite(header, sizeof(header), 1, bmp->fp) != 1) {
+      printf("Cannot write %s\n", filename);
+      exit(-1);
+   }
+}
+
+void bmpWriteRows(BmpWriter *bmp, int firstRow, int numRows, 
+   const void *src, ImageStorage storage)
+{
+   const long dataOffset = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE +
+      BMP_PALETTE_SIZE;
+   size_t size = bmp->rowStride*(size_t)numRows;
+   int r, c;
+
+   if (numRows <= 0) {
+      return;
+   }
+   if (size > bmp->bandSize) {
+      free(bmp->band);
+      bmp->band = (unsigned char*)calloc(size, 1);
+      if (!bmp->band) { exit(-1); }
+      bmp->bandSize = size;
+   }
+
+   /* The file stores the rows bottom-up, so the band is one contiguous
+    * range of the file with its rows reversed */
+   for (r = 0; r < numRows; r++) {
+      unsigned char *out = bmp->band + bmp->rowStride*(numRows - 1 - r);
+      for (c = 0; c < bmp->cols; c++) {
+         size_t idx = (size_t)r*bmp->cols + c;
+         float value;
+         switch (storage) {
+         case STORAGE_UNORM8:
+            value = (float)((const cl_uchar*)src)[idx];
+            break;
+         case STORAGE_HALF:
+            value = halfToFloat(((const cl_half*)src)[idx]);
+            break;
+         default:
+            value = ((const float*)src)[idx];
+            break;
+         }
+         out[c] = (unsigned char)storageQuantize(value, STORAGE_UNORM8);
+      }
+   }
+
+   if (fseeko(bmp->fp, (off_t)dataOffset + (off_t)bmp->rowStride*
+          (bmp->rows - firstRow - numRows), SEEK_SET) != 0 ||
+       fwrite(bmp->band, size, 1, bmp->fp) != 1) {
+      printf("Cannot write the BMP rows\n");
+      exit(-1);
+   }
+}
+
+void bmpFinish(BmpWriter *bmp)
+{
+   fclose(bmp->fp);
+   free(bmp->band);
+   bmp->fp = NULL;
+   bmp->band = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef __BMP_STREAM_H__
+#define __BMP_STREAM_H__
+
+#include <stdio.h>
+
+#include "image-storage.h"
+
+/* A BMP file mapped into memory. Rows are decoded on demand, so an image
+ * never has to be resident on the host as a whole. 8-bit palette images
+ * and 24- and 32-bit uncompressed images are supported; color pixels are
+ * converted to gray. */
+typedef struct {
+   void *map;
+   size_t mapSize;
+   const unsigned char *pixels;   /* First stored row */
+   int rows;
+   int cols;
+   int bitsPerPixel;
+   size_t rowStride;              /* Bytes per stored row, 4-byte padded */
+   int bottomUp;                  /* Rows are stored last row first */
+   unsigned char gray[256];       /* Gray value of each palette entry */
+} BmpStream;
+
+/* Map 'filename' and parse its header. Exits if the file cannot be read
+ * or uses an unsupported format. */
+void bmpOpen(BmpStream *bmp, const char *filename);
+
+/* Decode rows [firstRow, firstRow+numRows) top to bottom into 'dst' as
+ * packed numRows*cols pixels of 'storage' (the 0-255 gray values, as
+ * readBmpStorage returns them). 'dst' may be a mapped OpenCL buffer. The
+ * decoded part of the file is dropped from memory again. */
+void bmpReadRows(const BmpStream *bmp, int firstRow, int numRows, void *dst,
+   ImageStorage storage);
+
+void bmpClose(BmpStream *bmp);
+
+/* An 8-bit grayscale BMP file written a band of rows at a time */
+typedef struct {
+   FILE *fp;
+   int rows;
+   int cols;
+   size_t rowStride;
+   unsigned char *band;
+   size_t bandSize;
+} BmpWriter;
+
+/* Create 'filename' for a rows x cols image. Exits on failure. */
+void bmpCreate(BmpWriter *bmp, const char *filename, int rows, int cols);
+
+/* Write rows [firstRow, firstRow+numRows) from packed pixels of 'storage'.
+ * Values are rounded and saturated to 0-255. Bands may come in any
+ * order. */
+void bmpWriteRows(BmpWriter *bmp, int firstRow, int numRows, 
+   const void *src, ImageStorage storage);
+
+void bmpFinish(BmpWriter *bmp);
+
+#endif
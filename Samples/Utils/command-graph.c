@@ -0,0 +1,269 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "profiler.h"
+#include "command-graph.h"
+
+/* Most dependencies a single node may have */
+#define GRAPH_MAX_DEPS 16
+
+void graphInit(CommandGraph *graph, Profiler *prof)
+{
+   graph->events = NULL;
+   graph->transfers = NULL;
+   graph->numNodes = 0;
+   graph->capacity = 0;
+   graph->prof = prof;
+   graph->transferMs = 0.0;
+}
+
+void graphRelease(CommandGraph *graph)
+{
+   int i;
+   for (i = 0; i < graph->numNodes; i++) {
+      if (graph->events[i]) {
+         clReleaseEvent(graph->events[i]);
+      }
+   }
+   free(graph->events);
+   free(graph->transfers);
+   graphInit(graph, graph->prof);
+}
+
+/* Collect the events of 'deps' that are still pending into 'list' */
+static cl_uint waitList(const CommandGraph *graph, int numDeps, 
+   const int *deps, cl_event *list)
+{
+   cl_uint count = 0;
+   int i;
+
+   if (numDeps > GRAPH_MAX_DEPS) {
+      printf("A graph node has more than %d dependencies\n", 
+         GRAPH_MAX_DEPS);
+      exit(-1);
+   }
+   for (i = 0; i < numDeps; i++) {
+      if (deps[i] == GRAPH_NONE) {
+         continue;
+      }
+      if (deps[i] < 0 || deps[i] >= graph->numNodes) {
+         printf("Invalid graph node %d\n", deps[i]);
+         exit(-1);
+      }
+      if (graph->events[deps[i]]) {
+         list[count++] = graph->events[deps[i]];
+      }
+   }
+   return count;
+}
+
+/* Record 'event' as a new node and start it. 'bytes' is the volume of
+ * a transfer, 'pixels' the work of a kernel. */
+static int addNode(CommandGraph *graph, cl_command_queue queue, 
+   cl_event event, const char *name, int transfer, double bytes, 
+   double pixels)
+{
+   if (graph->numNodes == graph->capacity) {
+      graph->capacity = graph->capacity ? graph->capacity*2 : 32;
+      graph->events = (cl_event*)realloc(graph->events, 
+         graph->capacity*sizeof(cl_event));
+      graph->transfers = (char*)realloc(graph->transfers, 
+         graph->capacity);
+      if (!graph->events || !graph->transfers) { exit(-1); }
+   }
+   graph->events[graph->numNodes] = event;
+   graph->transfers[graph->numNodes] = (char)transfer;
+   profileAddEvent(graph->prof, name, event, bytes, pixels);
+   if (queue) {
+      clFlush(queue);
+   }
+   return graph->numNodes++;
+}
+
+int graphWriteBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, size_t offset, size_t size, const void *ptr,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueWriteBuffer(queue, buffer, CL_FALSE, offset, size, ptr,
+      count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 1, (double)size, 0);
+}
+
+/* Bytes of a region of 'image' */
+static double regionBytes(cl_mem image, const size_t region[3])
+{
+   size_t elementSize;
+   check(clGetImageInfo(image, CL_IMAGE_ELEMENT_SIZE, sizeof(size_t),
+      &elementSize, NULL));
+   return (double)region[0]*region[1]*region[2]*elementSize;
+}
+
+int graphWriteImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, const size_t origin[3], const size_t region[3],
+   const void *ptr, int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueWriteImage(queue, image, CL_FALSE, origin, region, 0, 0,
+      ptr, count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 1, 
+      regionBytes(image, region), 0);
+}
+
+int graphReadBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, size_t offset, size_t size, void *ptr,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueReadBuffer(queue, buffer, CL_FALSE, offset, size, ptr,
+      count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 1, (double)size, 0);
+}
+
+int graphReadImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, const size_t origin[3], const size_t region[3], void *ptr,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueReadImage(queue, image, CL_FALSE, origin, region, 0, 0,
+      ptr, count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 1, 
+      regionBytes(image, region), 0);
+}
+
+int graphFillBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, const void *pattern, size_t patternSize, size_t offset,
+   size_t size, int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueFillBuffer(queue, buffer, pattern, patternSize, offset,
+      size, count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 0, (double)size, 0);
+}
+
+int graphMapBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, cl_map_flags flags, size_t size, void **mapped,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+   cl_int status;
+
+   *mapped = clEnqueueMapBuffer(queue, buffer, CL_FALSE, flags, 0, size,
+      count, count ? list : NULL, &event, &status);
+   check(status);
+   return addNode(graph, queue, event, name, 1, (double)size, 0);
+}
+
+int graphMapImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, cl_map_flags flags, const size_t origin[3],
+   const size_t region[3], size_t *rowPitch, size_t *slicePitch, 
+   void **mapped,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+   cl_int status;
+
+   *mapped = clEnqueueMapImage(queue, image, CL_FALSE, flags, origin, 
+      region, rowPitch, slicePitch, count, count ? list : NULL, &event, &status);
+   check(status);
+   return addNode(graph, queue, event, name, 1, 
+      regionBytes(image, region), 0);
+}
+
+int graphKernel(CommandGraph *graph, cl_command_queue queue,
+   cl_kernel kernel, cl_uint dims, const size_t *offset,
+   const size_t *global, const size_t *local, double pixels,
+   int numDeps, const int *deps, const char *name)
+{
+   cl_event list[GRAPH_MAX_DEPS];
+   cl_uint count = waitList(graph, numDeps, deps, list);
+   cl_event event;
+
+   check(clEnqueueNDRangeKernel(queue, kernel, dims, offset, global, local,
+      count, count ? list : NULL, &event));
+   return addNode(graph, queue, event, name, 0, 0, pixels);
+}
+
+int graphAddEvent(CommandGraph *graph, cl_event event, const char *name)
+{
+   return addNode(graph, NULL, event, name, 0, 0, 0);
+}
+
+cl_event graphEvent(const CommandGraph *graph, int node)
+{
+   return node == GRAPH_NONE ? NULL : graph->events[node];
+}
+
+/* Add the device time of a completed transfer to graph->transferMs */
+static void transferTime(CommandGraph *graph, cl_event event)
+{
+   cl_ulong start, end;
+
+   if (graph->transferMs < 0.0) {
+      return;
+   }
+   if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, 
+          sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+       clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, 
+          sizeof(cl_ulong), &end, NULL) != CL_SUCCESS) {
+      graph->transferMs = -1.0;
+      return;
+   }
+   graph->transferMs += (end - start)*1e-6;
+}
+
+void graphWait(CommandGraph *graph)
+{
+   cl_event *pending;
+   cl_uint count = 0;
+   int i;
+
+   if (graph->numNodes == 0) {
+      return;
+   }
+   pending = (cl_event*)malloc(graph->numNodes*sizeof(cl_event));
+   if (!pending) { exit(-1); }
+   for (i = 0; i < graph->numNodes; i++) {
+      if (graph->events[i]) {
+         pending[count++] = graph->events[i];
+      }
+   }
+   if (count > 0) {
+      check(clWaitForEvents(count, pending));
+   }
+   for (i = 0; i < graph->numNodes; i++) {
+      if (graph->events[i]) {
+         if (graph->transfers[i]) {
+            transferTime(graph, graph->events[i]);
+         }
+         clReleaseEvent(graph->events[i]);
+         graph->events[i] = NULL;
+      }
+   }
+   free(pending);
+}
@@ -0,0 +1,88 @@
+#ifndef __COMMAND_GRAPH_H__
+#define __COMMAND_GRAPH_H__
+
+#include <CL/cl.h>
+
+#include "profiler.h"
+
+/* A graph of OpenCL commands whose dependencies are explicit events, so
+ * that the samples can use out-of-order queues (see graphQueueProperties
+ * in runtime.h) and wait on the host only once, at the end.
+ *
+ * Every node is enqueued (without blocking) and flushed as soon as it is
+ * added, waiting on the events of the nodes listed in 'deps'. A node id
+ * is returned; GRAPH_NONE in a dependency list is skipped, which makes
+ * optional steps easy to express. Nodes may be on any queue of the
+ * context. Each node is recorded in the profiler under 'name'. Host work
+ * done between adding nodes, such as building a program, overlaps with
+ * the commands already in flight. */
+
+#define GRAPH_NONE (-1)
+
+typedef struct {
+   cl_event *events;
+   char *transfers;
+   int numNodes;
+   int capacity;
+   Profiler *prof;
+   /* Device time of the reads, writes and maps waited on so far, or -1
+    * when the queues do not record it (see graphWait) */
+   double transferMs;
+} CommandGraph;
+
+void graphInit(CommandGraph *graph, Profiler *prof);
+
+/* Free the graph, releasing the events of nodes not yet waited on */
+void graphRelease(CommandGraph *graph);
+
+/* Transfers. 'ptr' must stay valid until the graph has been waited on. */
+int graphWriteBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, size_t offset, size_t size, const void *ptr,
+   int numDeps, const int *deps, const char *name);
+int graphWriteImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, const size_t origin[3], const size_t region[3],
+   const void *ptr, int numDeps, const int *deps, const char *name);
+int graphReadBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, size_t offset, size_t size, void *ptr,
+   int numDeps, const int *deps, const char *name);
+int graphReadImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, const size_t origin[3], const size_t region[3], void *ptr,
+   int numDeps, const int *deps, const char *name);
+int graphFillBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, const void *pattern, size_t patternSize, size_t offset,
+   size_t size, int numDeps, const int *deps, const char *name);
+
+/* Non-blocking maps; '*mapped' may be used once the graph has been
+ * waited on (see host-memory.h for the blocking versions). 'slicePitch'
+ * may be NULL for 2D images. */
+int graphMapBuffer(CommandGraph *graph, cl_command_queue queue,
+   cl_mem buffer, cl_map_flags flags, size_t size, void **mapped,
+   int numDeps, const int *deps, const char *name);
+int graphMapImage(CommandGraph *graph, cl_command_queue queue,
+   cl_mem image, cl_map_flags flags, const size_t origin[3],
+   const size_t region[3], size_t *rowPitch, size_t *slicePitch, 
+   void **mapped,
+   int numDeps, const int *deps, const char *name);
+
+/* A kernel launch over 'pixels' pixels. The kernel arguments are
+ * captured when the node is added, so the kernel can be reused right
+ * away with other arguments. */
+int graphKernel(CommandGraph *graph, cl_command_queue queue,
+   cl_kernel kernel, cl_uint dims, const size_t *offset,
+   const size_t *global, const size_t *local, double pixels,
+   int numDeps, const int *deps, const char *name);
+
+/* Add a command enqueued by other means. The graph takes over 'event'. */
+int graphAddEvent(CommandGraph *graph, cl_event event, const char *name);
+
+/* The event of a node, or NULL once the graph has been waited on */
+cl_event graphEvent(const CommandGraph *graph, int node);
+
+/* Wait on the host until every node has completed. The node ids stay
+ * valid as dependencies that are already satisfied. The transfers are
+ * timed from their events, which needs profiling queues (as created
+ * with graphQueueProperties in runtime.h); the time of overlapping
+ * transfers is summed. */
+void graphWait(CommandGraph *graph);
+
+#endif
@@ -0,0 +1,377 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "image-storage.h"
+#include "thread-pool.h"
+#include "gold-parallel.h"
+
+/* Pixels per part below which more threads do not pay off */
+#define GOLD_GRAIN 65536
+
+/* Histograms: each part counts its range into a private histogram, and
+ * the parts are added up afterwards */
+typedef enum {
+   ELEMENT_INT,
+   ELEMENT_UCHAR,
+   ELEMENT_USHORT,
+   ELEMENT_FLOAT
+} HistogramElement;
+
+typedef struct {
+   const void *data;
+   HistogramElement element;
+   int ranged;          /* Bin by rangeBin instead of by value */
+   int bins;
+   float minValue;      /* Ranged jobs only */
+   float scale;
+   int *partial;        /* threadPoolSize() histograms */
+} HistogramJob;
+
+/* The bin of 'value' in a ranged job, as computed by rangeBin in
+ * histogram.cl, or -1 */
+static int rangeBin(float value, float minValue, float scale, int bins)
+{
+   float x = (value - minValue)*scale;
+   return (x >= 0.0f && x < (float)bins) ? (int)x : -1;
+}
+
+static void histogramPart(void *arg, int part, size_t begin, size_t end)
+{
+   HistogramJob *job = (HistogramJob*)arg;
+   int *hist = job->partial + (size_t)part*job->bins;
+   size_t i;
+
+   memset(hist, 0, job->bins*sizeof(int));
+   for (i = begin; i < end; i++) {
+      int value;
+      if (job->ranged) {
+         float x;
+         switch (job->element) {
+         case ELEMENT_UCHAR: x = ((const unsigned char*)job->data)[i]; break;
+         case ELEMENT_USHORT: 
+            x = ((const unsigned short*)job->data)[i]; 
+            break;
+         default: x = ((const float*)job->data)[i]; break;
+         }
+         value = rangeBin(x, job->minValue, job->scale, job->bins);
+      }
+      else {
+         switch (job->element) {
+         case ELEMENT_INT: value = ((const int*)job->data)[i]; break;
+         case ELEMENT_UCHAR: 
+            value = ((const unsigned char*)job->data)[i]; 
+            break;
+         default: value = (int)((const float*)job->data)[i]; break;
+         }
+      }
+      if (value >= 0 && value < job->bins) {
+         hist[value]++;
+      }
+   }
+}
+
+static int* histogramJob(const void *data, HistogramElement element, 
+   int ranged, size_t numData, int bins, float minValue, float scale)
+{
+   HistogramJob job;
+   int parts = threadPoolSize();
+   int *histogram = (int*)calloc(bins, sizeof(int));
+   int p, b;
+
+   job.data = data;
+   job.element = element;
+   job.ranged = ranged;
+   job.bins = bins;
+   job.minValue = minValue;
+   job.scale = scale;
+   job.partial = (int*)malloc((size_t)parts*bins*sizeof(int));
+   if (!histogram || !job.partial) { exit(-1); }
+
+   parallelFor(numData, GOLD_GRAIN, histogramPart, &job);
+   for (p = 0; p < parts; p++) {
+      for (b = 0; b < bins; b++) {
+         histogram[b] += job.partial[(size_t)p*bins + b];
+      }
+   }
+   free(job.partial);
+   return histogram;
+}
+
+int* histogramGoldParallel(const int *data, size_t numData, int bins)
+{
+   return histogramJob(data, ELEMENT_INT, 0, numData, bins, 0.0f, 1.0f);
+}
+
+int* histogramGoldBytes(const unsigned char *data, size_t numData, int bins)
+{
+   return histogramJob(data, ELEMENT_UCHAR, 0, numData, bins, 0.0f, 
+      1.0f);
+}
+
+int* histogramGoldFloatParallel(const float *data, size_t numData, int bins)
+{
+   return histogramJob(data, ELEMENT_FLOAT, 0, numData, bins, 0.0f, 
+      1.0f);
+}
+
+int* histogramGoldRange(const void *data, HistogramData type, 
+   size_t numData, int bins, float minValue, float scale)
+{
+   HistogramElement element = type == HIST_DATA_UCHAR ? ELEMENT_UCHAR :
+      type == HIST_DATA_USHORT ? ELEMENT_USHORT : ELEMENT_FLOAT;
+   return histogramJob(data, element, 1, numData, bins, minValue, scale);
+}
+
+/* Convolution: each part computes a range of rows */
+typedef struct {
+   const float *image;
+   float *output;
+   int rows;
+   int cols;
+   const float *filter;
+   int filterWidth;
+} ConvolutionJob;
+
+static int clampIndex(int value, int size)
+{
+   return value < 0 ? 0 : (value >= size ? size - 1 : value);
+}
+
+/* One output pixel, reading through clamped coordinates */
+static float convolvePixel(const ConvolutionJob *job, int row, int col)
+{
+   int half = job->filterWidth/2;
+   int filterIdx = 0;
+   float sum = 0.0f;
+   int i, j;
+
+   for (i = -half; i <= half; i++) {
+      const float *line = job->image + 
+         (size_t)clampIndex(row + i, job->rows)*job->cols;
+      for (j = -half; j <= half; j++) {
+         sum += line[clampIndex(col + j, job->cols)]*job->filter[filterIdx++];
+      }
+   }
+   return sum;
+}
+
+static void convolutionPart(void *arg, int part, size_t begin, size_t end)
+{
+   const ConvolutionJob *job = (const ConvolutionJob*)arg;
+   int half = job->filterWidth/2;
+   int cols = job->cols;
+   size_t r;
+   (void)part;
+
+   for (r = begin; r < end; r++) {
+      int row = (int)r;
+      float *out = job->output + r*cols;
+      int col = 0;
+
+      /* Columns whose window lies inside the image: several pixels at a
+       * time, each summed in the same order as convolvePixel */
+      int first = half;
+      int last = cols - half;
+      for (col = 0; col < first && col < cols; col++) {
+         out[col] = convolvePixel(job, row, col);
+      }
+#if defined(__AVX2__)
+      for (; col + 8 <= last; col += 8) {
+         __m256 sum = _mm256_setzero_ps();
+         int filterIdx = 0;
+         int i, j;
+         for (i = -half; i <= half; i++) {
+            const float *line = job->image + 
+               (size_t)clampIndex(row + i, job->rows)*cols + col;
+            for (j = -half; j <= half; j++) {
+               __m256 pixels = _mm256_loadu_ps(line + j);
+               __m256 tap = _mm256_set1_ps(job->filter[filterIdx++]);
+               sum = _mm256_add_ps(sum, _mm256_mul_ps(pixels, tap));
+            }
+         }
+         _mm256_storeu_ps(out + col, sum);
+      }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+      for (; col + 4 <= last; col += 4) {
+         __m128 sum = _mm_setzero_ps();
+         int filterIdx = 0;
+         int i, j;
+         for (i = -half; i <= half; i++) {
+            const float *line = job->image + 
+               (size_t)clampIndex(row + i, job->rows)*cols + col;
+            for (j = -half; j <= half; j++) {
+               __m128 pixels = _mm_loadu_ps(line + j);
+               __m128 tap = _mm_set1_ps(job->filter[filterIdx++]);
+               sum = _mm_add_ps(sum, _mm_mul_ps(pixels, tap));
+            }
+         }
+         _mm_storeu_ps(out + col, sum);
+      }
+#endif
+      for (; col < cols; col++) {
+         out[col] = convolvePixel(job, row, col);
+      }
+   }
+}
+
+float* convolutionGoldParallel(const float *image, int rows, int cols,
+   const float *filter, int filterWidth)
+{
+   ConvolutionJob job;
+   float *output = (float*)malloc((size_t)rows*cols*sizeof(float));
+   if (!output) { exit(-1); }
+
+   job.image = image;
+   job.output = output;
+   job.rows = rows;
+   job.cols = cols;
+   job.filter = filter;
+   job.filterWidth = filterWidth;
+
+   /* Rows are the unit of work; about GOLD_GRAIN taps per part */
+   size_t rowCost = (size_t)cols*filterWidth*filterWidth;
+   parallelFor(rows, rowCost ? GOLD_GRAIN/rowCost + 1 : 1, convolutionPart, 
+      &job);
+   return output;
+}
+
+/* Comparisons: each part scans its range in order and keeps its own
+ * summary. A part only gives up early once it has found its first
+ * mismatch, so the first of the part summaries is the first overall. */
+typedef struct {
+   const void *out;
+   const void *ref;
+   int isFloat;
+   float absTolerance;
+   float relTolerance;
+   ImageStorage storage;
+   CompareSummary *partial;
+   size_t totalMismatches;
+} CompareJob;
+
+static void comparePart(void *arg, int part, size_t begin, size_t end)
+{
+   CompareJob *job = (CompareJob*)arg;
+   CompareSummary *summary = &job->partial[part];
+   size_t i;
+
+   memset(summary, 0, sizeof(*summary));
+   for (i = begin; i < end; i++) {
+      double error;
+      int mismatch;
+
+      if (job->isFloat) {
+         float ref = ((const float*)job->ref)[i];
+         error = fabs(storageQuantize(ref, job->storage) - 
+            ((const float*)job->out)[i]);
+         mismatch = error > job->absTolerance + 
+            job->relTolerance*fabs(ref) + storageError(ref, job->storage);
+      }
+      else {
+         error = fabs((double)((const int*)job->out)[i] - 
+            ((const int*)job->ref)[i]);
+         mismatch = error != 0.0;
+      }
+
+      if (mismatch) {
+         if (summary->mismatches == 0) {
+            summary->firstIndex = i;
+         }
+         summary->mismatches++;
+         if (error > summary->maxError) {
+            summary->maxError = error;
+         }
+         if (__sync_add_and_fetch(&job->totalMismatches, 1) >= 
+             COMPARE_MAX_MISMATCHES) {
+            summary->truncated = i + 1 < end;
+            i++;
+            break;
+         }
+      }
+      else if ((i & 4095) == 0 && summary->mismatches > 0 && 
+               __sync_add_and_fetch(&job->totalMismatches, 0) >= 
+               COMPARE_MAX_MISMATCHES) {
+         summary->truncated = 1;
+         break;
+      }
+   }
+   summary->compared = i - begin;
+}
+
+static int compareJob(CompareJob *job, size_t count, CompareSummary *summary)
+{
+   int parts = threadPoolSize();
+   int p;
+
+   job->partial = (CompareSummary*)malloc(parts*sizeof(CompareSummary));
+   if (!job->partial) { exit(-1); }
+   job->totalMismatches = 0;
+   parallelFor(count, GOLD_GRAIN, comparePart, job);
+
+   memset(summary, 0, sizeof(*summary));
+   for (p = 0; p < parts; p++) {
+      const CompareSummary *part = &job->partial[p];
+      if (part->mismatches > 0 && summary->mismatches == 0) {
+         summary->firstIndex = part->firstIndex;
+      }
+      summary->compared += part->compared;
+      summary->mismatches += part->mismatches;
+      if (part->maxError > summary->maxError) {
+         summary->maxError = part->maxError;
+      }
+      summary->truncated |= part->truncated;
+   }
+   free(job->partial);
+   return summary->mismatches == 0;
+}
+
+int compareInts(const int *out, const int *ref, size_t count, 
+   CompareSummary *summary)
+{
+   CompareJob job;
+   memset(&job, 0, sizeof(job));
+   job.out = out;
+   job.ref = ref;
+   job.isFloat = 0;
+   return compareJob(&job, count, summary);
+}
+
+int compareFloats(const float *out, const float *ref, size_t count,
+   float absTolerance, float relTolerance, ImageStorage storage, 
+   CompareSummary *summary)
+{
+   CompareJob job;
+   memset(&job, 0, sizeof(job));
+   job.out = out;
+   job.ref = ref;
+   job.isFloat = 1;
+   job.absTolerance = absTolerance;
+   job.relTolerance = relTolerance;
+   job.storage = storage;
+   return compareJob(&job, count, summary);
+}
+
+void printCompareSummary(const CompareSummary *summary)
+{
+   if (summary->mismatches == 0) {
+      printf("Passed!\n");
+      return;
+   }
+   printf("Failed. %s%lu mismatches in %lu values compared, max abs error "
+      "%g, first at index %lu\n", summary->truncated ? "At least " : "",
+      (unsigned long)summary->mismatches, (unsigned long)summary->compared,
+      summary->maxError, (unsigned long)summary->firstIndex);
+}
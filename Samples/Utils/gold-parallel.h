@@ -0,0 +1,65 @@
+#ifndef __GOLD_PARALLEL_H__
+#define __GOLD_PARALLEL_H__
+
+#include <stddef.h>
+
+#include "image-storage.h"
+
+/* Multithreaded counterparts of the references in gold.h, run on the
+ * thread pool (see thread-pool.h). The histograms are identical to the
+ * scalar ones; values outside [0, bins) are not counted. The convolution
+ * sums every pixel in the same order as the scalar reference, so the
+ * SSE and AVX2 paths (chosen at compile time, with a scalar fallback)
+ * give the same results. The returned arrays are released with free(). */
+int* histogramGoldParallel(const int *data, size_t numData, int bins);
+int* histogramGoldBytes(const unsigned char *data, size_t numData, int bins);
+int* histogramGoldFloatParallel(const float *data, size_t numData, int bins);
+
+/* Element types of histogramGoldRange */
+typedef enum {
+   HIST_DATA_UCHAR,
+   HIST_DATA_USHORT,
+   HIST_DATA_FLOAT
+} HistogramData;
+
+/* Histogram of 'bins' bins over a value range: value v is counted in bin
+ * (int)((v - minValue)*scale) when that lies in [0, bins), computed in
+ * float like the histogramRange kernels. With minValue 0 and scale 1 it
+ * equals the histograms above. */
+int* histogramGoldRange(const void *data, HistogramData type, 
+   size_t numData, int bins, float minValue, float scale);
+
+/* Convolve with 'filter' (filterWidth x filterWidth taps), clamping reads
+ * to the edge of the image */
+float* convolutionGoldParallel(const float *image, int rows, int cols,
+   const float *filter, int filterWidth);
+
+/* Outcome of comparing a result against a reference. The scan stops once
+ * COMPARE_MAX_MISMATCHES mismatches are found, after which 'mismatches'
+ * and 'maxError' cover only the part compared; 'firstIndex' is always
+ * the first mismatch. */
+#define COMPARE_MAX_MISMATCHES 1000
+
+typedef struct {
+   size_t compared;
+   size_t mismatches;
+   double maxError;
+   size_t firstIndex;
+   int truncated;
+} CompareSummary;
+
+/* Compare exactly. Returns 1 if all values match. */
+int compareInts(const int *out, const int *ref, size_t count, 
+   CompareSummary *summary);
+
+/* Compare 'out' against 'ref' rounded like 'storage' (storageQuantize),
+ * allowing absTolerance + relTolerance*|ref| + storageError(ref). Returns
+ * 1 if all values match. */
+int compareFloats(const float *out, const float *ref, size_t count,
+   float absTolerance, float relTolerance, ImageStorage storage, 
+   CompareSummary *summary);
+
+/* Print "Passed!" or "Failed." followed by the mismatch summary */
+void printCompareSummary(const CompareSummary *summary);
+
+#endif
@@ -0,0 +1,102 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "options.h"
+#include "profiler.h"
+#include "host-memory.h"
+
+int zeroCopyRequested(int argc, char **argv)
+{
+   return hasOption(argc, argv, "zero-copy", "OCL_ZERO_COPY");
+}
+
+void* alignedAlloc(size_t size)
+{
+   void *ptr = NULL;
+   size_t rounded = (size + HOST_MEMORY_ALIGNMENT - 1)/
+      HOST_MEMORY_ALIGNMENT*HOST_MEMORY_ALIGNMENT;
+
+   if (rounded == 0) {
+      rounded = HOST_MEMORY_ALIGNMENT;
+   }
+   if (posix_memalign(&ptr, HOST_MEMORY_ALIGNMENT, rounded) != 0) {
+      printf("Cannot allocate %lu bytes\n", (unsigned long)size);
+      exit(-1);
+   }
+   return ptr;
+}
+
+cl_mem_flags zeroCopyFlags(const void *hostPtr)
+{
+   return hostPtr ? CL_MEM_USE_HOST_PTR : CL_MEM_ALLOC_HOST_PTR;
+}
+
+void* mapBuffer(cl_command_queue queue, cl_mem buffer, cl_map_flags flags,
+   size_t size, Profiler *prof, const char *name)
+{
+   cl_int status;
+   void *mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, flags, 0, size,
+      0, NULL, profileEvent(prof, name, size, 0), &status);
+   check(status);
+   return mapped;
+}
+
+void* mapImage(cl_command_queue queue, cl_mem image, cl_map_flags flags,
+   const size_t origin[3], const size_t region[3], size_t *rowPitch,
+   size_t *slicePitch, Profiler *prof, const char *name)
+{
+   cl_int status;
+   size_t elementSize;
+   void *mapped;
+
+   check(clGetImageInfo(image, CL_IMAGE_ELEMENT_SIZE, sizeof(size_t),
+      &elementSize, NULL));
+   mapped = clEnqueueMapImage(queue, image, CL_TRUE, flags, origin, region,
+      rowPitch, slicePitch, 0, NULL, 
+      profileEvent(prof, name, 
+         (double)region[0]*region[1]*region[2]*elementSize, 0), 
+      &status);
+   check(status);
+   return mapped;
+}
+
+void unmapObject(cl_command_queue queue, cl_mem mem, void *mapped,
+   Profiler *prof, const char *name)
+{
+   cl_event event;
+   check(clEnqueueUnmapMemObject(queue, mem, mapped, 0, NULL, &event));
+   check(clWaitForEvents(1, &event));
+   profileAddEvent(prof, name, event, 0, 0);
+   clReleaseEvent(event);
+}
+
+void copyRows(void *dst, const void *src, size_t rowBytes, size_t rows,
+   size_t srcPitch)
+{
+   size_t r;
+   if (srcPitch == rowBytes) {
+      memcpy(dst, src, rowBytes*rows);
+      return;
+   }
+   for (r = 0; r < rows; r++) {
+      memcpy((char*)dst + r*rowBytes, (const char*)src + r*srcPitch, 
+         rowBytes);
+   }
+}
+
+void printTransferTime(int zeroCopy, double ms)
+{
+   if (ms < 0.0) {
+      printf("Transfers (%s): not timed\n", 
+         zeroCopy ? "zero-copy" : "copy");
+      return;
+   }
+   printf("Transfers (%s): %.3f ms\n", zeroCopy ? "zero-copy" : "copy", ms);
+}
@@ -0,0 +1,49 @@
+#ifndef __HOST_MEMORY_H__
+#define __HOST_MEMORY_H__
+
+#include <CL/cl.h>
+
+#include "profiler.h"
+
+/* Alignment of host memory that OpenCL objects may use in place. A page
+ * satisfies the zero-copy requirements of the common CPU and integrated
+ * GPU implementations. */
+#define HOST_MEMORY_ALIGNMENT 4096
+
+/* Return 1 if "--zero-copy" (or OCL_ZERO_COPY=1) is given. Zero-copy
+ * samples create their inputs with CL_MEM_USE_HOST_PTR over the host
+ * data and their outputs with CL_MEM_ALLOC_HOST_PTR, and access them
+ * with clEnqueueMap* instead of copying with clEnqueueRead/Write*. */
+int zeroCopyRequested(int argc, char **argv);
+
+/* Allocate 'size' bytes aligned to HOST_MEMORY_ALIGNMENT, rounded up to
+ * a whole number of pages. Exits on failure; release with free(). */
+void* alignedAlloc(size_t size);
+
+/* The flags that make an OpenCL object use 'hostPtr' in place, or
+ * allocate host-accessible memory when 'hostPtr' is NULL */
+cl_mem_flags zeroCopyFlags(const void *hostPtr);
+
+/* Blocking maps of a whole buffer or of a region of an image, recorded
+ * as profiled commands named 'name' */
+void* mapBuffer(cl_command_queue queue, cl_mem buffer, cl_map_flags flags,
+   size_t size, Profiler *prof, const char *name);
+void* mapImage(cl_command_queue queue, cl_mem image, cl_map_flags flags,
+   const size_t origin[3], const size_t region[3], size_t *rowPitch,
+   size_t *slicePitch, Profiler *prof, const char *name);
+
+/* Unmap 'mapped' and wait until the device owns 'mem' again */
+void unmapObject(cl_command_queue queue, cl_mem mem, void *mapped,
+   Profiler *prof, const char *name);
+
+/* Copy 'rows' rows of 'rowBytes' bytes from memory whose rows are
+ * 'srcPitch' bytes apart (as returned by mapImage) into packed rows */
+void copyRows(void *dst, const void *src, size_t rowBytes, size_t rows,
+   size_t srcPitch);
+
+/* Print the time of a sample's host-device transfers, as measured by
+ * its command graph (see command-graph.h). A negative 'ms' means they
+ * were not timed. */
+void printTransferTime(int zeroCopy, double ms);
+
+#endif
@@ -0,0 +1,259 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "options.h"
+#include "host-memory.h"
+#include "image-storage.h"
+#include "bmp-stream.h"
+
+static const char *storageNames[] = {"float", "unorm8", "half"};
+
+ImageStorage getImageStorage(int argc, char **argv, const char *name,
+   ImageStorage defaultStorage)
+{
+   const char *value = getOption(argc, argv, name, NULL);
+   int s;
+
+   if (!value || !value[0]) {
+      value = getOption(argc, argv, "format", "OCL_IMAGE_FORMAT");
+   }
+   if (!value || !value[0]) {
+      return defaultStorage;
+   }
+   for (s = 0; s < 3; s++) {
+      if (strcmp(value, storageNames[s]) == 0) {
+         return (ImageStorage)s;
+      }
+   }
+   printf("Unknown image format '%s', using %s\n", value,
+      storageNames[defaultStorage]);
+   return defaultStorage;
+}
+
+const char* storageName(ImageStorage storage)
+{
+   return storageNames[storage];
+}
+
+cl_image_format storageFormat(ImageStorage storage)
+{
+   cl_image_format format;
+   format.image_channel_order = CL_R;
+   switch (storage) {
+   case STORAGE_UNORM8:
+      format.image_channel_data_type = CL_UNORM_INT8;
+      break;
+   case STORAGE_HALF:
+      format.image_channel_data_type = CL_HALF_FLOAT;
+      break;
+   default:
+      format.image_channel_data_type = CL_FLOAT;
+      break;
+   }
+   return format;
+}
+
+size_t storagePixelSize(ImageStorage storage)
+{
+   switch (storage) {
+   case STORAGE_UNORM8: return sizeof(cl_uchar);
+   case STORAGE_HALF: return sizeof(cl_half);
+   default: return sizeof(cl_float);
+   }
+}
+
+float storageScale(ImageStorage storage)
+{
+   return storage == STORAGE_UNORM8 ? 255.0f : 1.0f;
+}
+
+void storageBuildOptions(char *options, size_t size, ImageStorage input,
+   ImageStorage output)
+{
+   snprintf(options, size, "-D INPUT_SCALE=%.1ff -D OUTPUT_SCALE=(1.0f/%.1ff)",
+      storageScale(input), storageScale(output));
+}
+
+void checkStorageSupported(cl_context context, cl_mem_flags flags,
+   cl_mem_object_type imageType, ImageStorage storage)
+{
+   cl_image_format wanted = storageFormat(storage);
+   cl_image_format *formats;
+   cl_uint numFormats = 0;
+   cl_uint i;
+   int found = 0;
+
+   check(clGetSupportedImageFormats(context, flags, imageType, 0, NULL,
+      &numFormats));
+   formats = (cl_image_format*)malloc(numFormats*sizeof(cl_image_format));
+   if (!formats) { exit(-1); }
+   check(clGetSupportedImageFormats(context, flags, imageType, numFormats,
+      formats, NULL));
+   for (i = 0; i < numFormats; i++) {
+      if (formats[i].image_channel_order == wanted.image_channel_order &&
+          formats[i].image_channel_data_type ==
+          wanted.image_channel_data_type) {
+         found = 1;
+      }
+   }
+   free(formats);
+
+   if (!found) {
+      printf("The device does not support %s images\n",
+         storageNames[storage]);
+      exit(-1);
+   }
+}
+
+cl_half floatToHalf(float value)
+{
+   unsigned int bits;
+   unsigned int sign;
+   int exponent;
+   unsigned int mantissa;
+
+   memcpy(&bits, &value, sizeof(bits));
+   sign = (bits >> 16) & 0x8000;
+   exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+   mantissa = bits & 0x7fffff;
+
+   if (((bits >> 23) & 0xff) == 0xff) {
+      /* Infinity or NaN */
+      return (cl_half)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+   }
+   if (exponent >= 31) {
+      return (cl_half)(sign | 0x7c00);
+   }
+   if (exponent <= 0) {
+      /* Subnormal or zero */
+      unsigned int shift;
+      unsigned int half;
+      if (exponent < -10) {
+         return (cl_half)sign;
+      }
+      mantissa |= 0x800000;
+      shift = (unsigned int)(14 - exponent);
+      half = mantissa >> shift;
+      if ((mantissa >> (shift - 1)) & 1 &&
+          ((mantissa & ((1u << (shift - 1)) - 1)) || (half & 1))) {
+         half++;
+      }
+      return (cl_half)(sign | half);
+   }
+   {
+      unsigned int half = sign | ((unsigned int)exponent << 10) |
+         (mantissa >> 13);
+      /* Round to nearest even; a carry correctly bumps the exponent */
+      if ((mantissa & 0x1000) && ((mantissa & 0x2fff) != 0)) {
+         half++;
+      }
+      return (cl_half)half;
+   }
+}
+
+float halfToFloat(cl_half value)
+{
+   unsigned int sign = ((unsigned int)value & 0x8000) << 16;
+   unsigned int exponent = ((unsigned int)value >> 10) & 0x1f;
+   unsigned int mantissa = (unsigned int)value & 0x3ff;
+   unsigned int bits;
+   float result;
+
+   if (exponent == 0) {
+      /* Zero or subnormal: mantissa * 2^-24 */
+      result = (float)mantissa/16777216.0f;
+      return sign ? -result : result;
+   }
+   if (exponent == 31) {
+      bits = sign | 0x7f800000 | (mantissa << 13);
+   }
+   else {
+      bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+   }
+   memcpy(&result, &bits, sizeof(result));
+   return result;
+}
+
+void* readBmpStorage(const char *filename, int *rows, int *cols,
+   ImageStorage storage)
+{
+   BmpStream bmp;
+   void *data;
+
+   bmpOpen(&bmp, filename);
+   *rows = bmp.rows;
+   *cols = bmp.cols;
+   data = alignedAlloc((size_t)bmp.rows*bmp.cols*storagePixelSize(storage));
+   bmpReadRows(&bmp, 0, bmp.rows, data, storage);
+   bmpClose(&bmp);
+   return data;
+}
+
+void writeBmpStorage(const void *data, const char *filename, int rows,
+   int cols, ImageStorage storage)
+{
+   BmpWriter bmp;
+   bmpCreate(&bmp, filename, rows, cols);
+   bmpWriteRows(&bmp, 0, rows, data, storage);
+   bmpFinish(&bmp);
+}
+
+float* storageToFloat(const void *data, int count, ImageStorage storage)
+{
+   float *pixels = (float*)malloc(count*sizeof(float));
+   int i;
+
+   if (!pixels) { exit(-1); }
+   for (i = 0; i < count; i++) {
+      switch (storage) {
+      case STORAGE_UNORM8:
+         pixels[i] = (float)((const cl_uchar*)data)[i];
+         break;
+      case STORAGE_HALF:
+         pixels[i] = halfToFloat(((const cl_half*)data)[i]);
+         break;
+      default:
+         pixels[i] = ((const float*)data)[i];
+         break;
+      }
+   }
+   return pixels;
+}
+
+float storageQuantize(float value, ImageStorage storage)
+{
+   switch (storage) {
+   case STORAGE_UNORM8:
+      /* Saturated to 0-255 and rounded */
+      if (value < 0.0f) { return 0.0f; }
+      if (value > 255.0f) { return 255.0f; }
+      return floorf(value + 0.5f);
+   case STORAGE_HALF:
+      return halfToFloat(floatToHalf(value));
+   default:
+      return value;
+   }
+}
+
+float storageError(float value, ImageStorage storage)
+{
+   switch (storage) {
+   case STORAGE_UNORM8:
+      /* Devices may round the normalized value differently */
+      return 1.0f;
+   case STORAGE_HALF:
+      /* Half a unit in the last place of an 11-bit significand, and
+       * devices may round the other way */
+      return fabsf(value)/1024.0f + 1e-7f;
+   default:
+      return 0.0f;
+   }
+}
@@ -0,0 +1,71 @@
+#ifndef __IMAGE_STORAGE_H__
+#define __IMAGE_STORAGE_H__
+
+#include <CL/cl.h>
+
+/* How the pixels of a device image are stored. The BMP images are 8-bit
+ * grayscale, so 8-bit or half-precision storage moves a quarter or half
+ * of the data of CL_FLOAT. */
+typedef enum {
+   STORAGE_FLOAT,
+   STORAGE_UNORM8,
+   STORAGE_HALF
+} ImageStorage;
+
+/* Return the storage named by "--NAME float|unorm8|half", falling back to
+ * "--format" and the OCL_IMAGE_FORMAT environment variable, and then to
+ * 'defaultStorage' */
+ImageStorage getImageStorage(int argc, char **argv, const char *name,
+   ImageStorage defaultStorage);
+
+const char* storageName(ImageStorage storage);
+
+/* The single-channel image format for 'storage' */
+cl_image_format storageFormat(ImageStorage storage);
+
+/* Bytes per pixel */
+size_t storagePixelSize(ImageStorage storage);
+
+/* read_imagef() returns the pixels of UNORM_INT8 images divided by 255.
+ * Multiplying by this factor after reading (and dividing before writing)
+ * keeps values in the 0-255 range of the float images. */
+float storageScale(ImageStorage storage);
+
+/* Write "-D INPUT_SCALE=... -D OUTPUT_SCALE=..." for kernels that read
+ * 'input' and write 'output' images and apply these macros (defaulting
+ * to 1.0f) after read_imagef and before write_imagef */
+void storageBuildOptions(char *options, size_t size, ImageStorage input,
+   ImageStorage output);
+
+/* Exit with a message if the device cannot hold 'storage' images of
+ * 'imageType' with 'flags' */
+void checkStorageSupported(cl_context context, cl_mem_flags flags,
+   cl_mem_object_type imageType, ImageStorage storage);
+
+/* Read a whole BMP file into page-aligned memory (see alignedAlloc) that
+ * zero-copy images can use in place, and write one. The pixel data is
+ * rows*cols values of 'storage'; unorm8 pixels hold the 8-bit values of
+ * the file unchanged. Both go through bmp-stream.h, which also reads and
+ * writes bands of rows of images too large to hold at once. */
+void* readBmpStorage(const char *filename, int *rows, int *cols,
+   ImageStorage storage);
+void writeBmpStorage(const void *data, const char *filename, int rows,
+   int cols, ImageStorage storage);
+
+/* Convert 'count' pixels of 'storage' to a new float array (in the 0-255
+ * range), e.g., to compare against a gold result */
+float* storageToFloat(const void *data, int count, ImageStorage storage);
+
+/* The value a float result becomes when written to 'storage', and the
+ * largest rounding error of that conversion. A gold value 'ref' matches
+ * a result 'out' when |storageQuantize(ref) - out| is within the
+ * computation's tolerance plus storageError(ref). */
+float storageQuantize(float value, ImageStorage storage);
+float storageError(float value, ImageStorage storage);
+
+/* IEEE 754 half precision conversions, rounding to nearest even. Values
+ * beyond the half range become infinity. */
+cl_half floatToHalf(float value);
+float halfToFloat(cl_half value);
+
+#endif
@@ -0,0 +1,285 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "memory-pool.h"
+
+/* The smallest size class */
+#define POOL_MIN_BYTES 4096
+
+void poolInit(MemPool *pool)
+{
+   memset(pool, 0, sizeof(MemPool));
+}
+
+void poolRelease(MemPool *pool)
+{
+   int i;
+
+   for (i = 0; i < pool->numEntries; i++) {
+      if (pool->entries[i].lastUse) {
+         clReleaseEvent(pool->entries[i].lastUse);
+      }
+      clReleaseMemObject(pool->entries[i].mem);
+   }
+   free(pool->entries);
+   poolInit(pool);
+}
+
+size_t poolSizeClass(size_t size)
+{
+   size_t size2 = POOL_MIN_BYTES;
+   size_t step;
+
+   while (size2 < size) {
+      size2 *= 2;
+   }
+   step = size2 >= 8*POOL_MIN_BYTES ? size2/8 : size2;
+   return (size + step - 1)/step*step;
+}
+
+/* Return 1 if a returned object may be handed out again */
+static int entryReady(PoolEntry *e)
+{
+   cl_int status;
+
+   if (!e->lastUse) {
+      return 1;
+   }
+   check(clGetEventInfo(e->lastUse, CL_EVENT_COMMAND_EXECUTION_STATUS,
+      sizeof(cl_int), &status, NULL));
+   if (status != CL_COMPLETE && status >= 0) {
+      return 0;
+   }
+   clReleaseEvent(e->lastUse);
+   e->lastUse = NULL;
+   return 1;
+}
+
+/* Hand out a free object matching 'key', or return NULL */
+static cl_mem takeEntry(MemPool *pool, const PoolEntry *key)
+{
+   int i;
+
+   pool->requests++;
+   for (i = 0; i < pool->numEntries; i++) {
+      PoolEntry *e = &pool->entries[i];
+      if (e->inUse || e->context != key->context ||
+          e->flags != key->flags || e->type != key->type ||
+          e->width != key->width || e->height != key->height ||
+          e->depth != key->depth ||
+          e->format.image_channel_order !=
+             key->format.image_channel_order ||
+          e->format.image_channel_data_type !=
+             key->format.image_channel_data_type ||
+          !entryReady(e)) {
+         continue;
+      }
+      e->inUse = 1;
+      pool->hits++;
+      pool->bytesInUse += e->bytes;
+      if (pool->bytesInUse > pool->peakInUse) {
+         pool->peakInUse = pool->bytesInUse;
+      }
+      return e->mem;
+   }
+   return NULL;
+}
+
+/* Add a newly created object, handed out */
+static cl_mem addEntry(MemPool *pool, const PoolEntry *key, cl_mem mem)
+{
+   PoolEntry *e;
+
+   if (pool->numEntries == pool->capacity) {
+      pool->capacity = pool->capacity ? pool->capacity*2 : 16;
+      pool->entries = (PoolEntry*)realloc(pool->entries,
+         pool->capacity*sizeof(PoolEntry));
+      if (!pool->entries) { exit(-1); }
+   }
+   e = &pool->entries[pool->numEntries++];
+   *e = *key;
+   e->mem = mem;
+   e->inUse = 1;
+   e->lastUse = NULL;
+
+   pool->bytesInUse += e->bytes;
+   pool->bytesAllocated += e->bytes;
+   if (pool->bytesInUse > pool->peakInUse) {
+      pool->peakInUse = pool->bytesInUse;
+   }
+   if (pool->bytesAllocated > pool->peakAllocated) {
+      pool->peakAllocated = pool->bytesAllocated;
+   }
+   return mem;
+}
+
+/* Exit if 'flags' would tie the object to host data */
+static void checkPoolFlags(cl_mem_flags flags)
+{
+   if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) {
+      printf("Objects using host pointers cannot be pooled\n");
+      exit(-1);
+   }
+}
+
+cl_mem poolBuffer(MemPool *pool, cl_context context, cl_mem_flags flags,
+   size_t size)
+{
+   PoolEntry key;
+   cl_mem mem;
+   cl_int status;
+
+   checkPoolFlags(flags);
+   memset(&key, 0, sizeof(key));
+   key.context = context;
+   key.flags = flags;
+   key.type = CL_MEM_OBJECT_BUFFER;
+   key.width = poolSizeClass(size);
+   key.bytes = key.width;
+
+   mem = takeEntry(pool, &key);
+   if (mem) {
+      return mem;
+   }
+   mem = clCreateBuffer(context, flags, key.bytes, NULL, &status);
+   check(status);
+   return addEntry(pool, &key, mem);
+}
+
+cl_mem poolImage(MemPool *pool, cl_context context, cl_mem_flags flags,
+   const cl_image_format *format, const cl_image_desc *desc)
+{
+   PoolEntry key;
+   cl_mem mem;
+   cl_int status;
+   size_t pixelSize;
+
+   checkPoolFlags(flags);
+   memset(&key, 0, sizeof(key));
+   key.context = context;
+   key.flags = flags;
+   key.type = desc->image_type;
+   key.format = *format;
+   key.width = desc->image_width;
+   key.height = desc->image_height > 0 ? desc->image_height : 1;
+   key.depth = desc->image_type == CL_MEM_OBJECT_IMAGE3D ? 
+      desc->image_depth : desc->image_array_size;
+   if (key.depth < 1) {
+      key.depth = 1;
+   }
+
+   mem = takeEntry(pool, &key);
+   if (mem) {
+      return mem;
+   }
+   mem = clCreateImage(context, flags, format, desc, NULL, &status);
+   check(status);
+   check(clGetImageInfo(mem, CL_IMAGE_ELEMENT_SIZE, sizeof(size_t),
+      &pixelSize, NULL));
+   key.bytes = key.width*key.height*key.depth*pixelSize;
+   return addEntry(pool, &key, mem);
+}
+
+cl_mem poolImage2D(MemPool *pool, cl_context context, cl_mem_flags flags,
+   const cl_image_format *format, size_t width, size_t height)
+{
+   cl_image_desc desc;
+
+   memset(&desc, 0, sizeof(desc));
+   desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+   desc.image_width = width;
+   desc.image_height = height;
+   return poolImage(pool, context, flags, format, &desc);
+}
+
+#ifdef CL_VERSION_2_0
+cl_mem poolPipe(MemPool *pool, cl_context context, cl_mem_flags flags,
+   cl_uint packetSize, cl_uint numPackets)
+{
+   PoolEntry key;
+   cl_mem mem;
+   cl_int status;
+
+   checkPoolFlags(flags);
+   memset(&key, 0, sizeof(key));
+   key.context = context;
+   key.flags = flags;
+   key.type = CL_MEM_OBJECT_PIPE;
+   key.width = packetSize;
+   key.height = numPackets;
+   key.bytes = (size_t)packetSize*numPackets;
+
+   mem = takeEntry(pool, &key);
+   if (mem) {
+      return mem;
+   }
+   mem = clCreatePipe(context, flags, packetSize, numPackets, NULL,
+      &status);
+   check(status);
+   return addEntry(pool, &key, mem);
+}
+#endif
+
+void poolReturnAfter(MemPool *pool, cl_mem mem, cl_event lastUse)
+{
+   int i;
+
+   for (i = 0; i < pool->numEntries; i++) {
+      PoolEntry *e = &pool->entries[i];
+      if (e->mem != mem || !e->inUse) {
+         continue;
+      }
+      e->inUse = 0;
+      if (lastUse) {
+         check(clRetainEvent(lastUse));
+         e->lastUse = lastUse;
+      }
+      pool->bytesInUse -= e->bytes;
+      return;
+   }
+   printf("Returned an object that is not from the pool\n");
+   exit(-1);
+}
+
+void poolReturn(MemPool *pool, cl_mem mem)
+{
+   poolReturnAfter(pool, mem, NULL);
+}
+
+void poolTrim(MemPool *pool)
+{
+   int i;
+   int kept = 0;
+
+   for (i = 0; i < pool->numEntries; i++) {
+      PoolEntry *e = &pool->entries[i];
+      if (e->inUse) {
+         pool->entries[kept++] = *e;
+         continue;
+      }
+      if (e->lastUse) {
+         clReleaseEvent(e->lastUse);
+      }
+      clReleaseMemObject(e->mem);
+      pool->bytesAllocated -= e->bytes;
+   }
+   pool->numEntries = kept;
+}
+
+void poolPrintStats(const MemPool *pool)
+{
+   if (pool->requests == 0) {
+      return;
+   }
+   printf("Memory pool: %lu requests, %lu reused (%.0f%%), high-water "
+      "%.2f MB in use, %.2f MB allocated\n", pool->requests, pool->hits,
+      100.0*pool->hits/pool->requests, pool->peakInUse/1048576.0,
+      pool->peakAllocated/1048576.0);
+}
@@ -0,0 +1,97 @@
+#ifndef __MEMORY_POOL_H__
+#define __MEMORY_POOL_H__
+
+#include <CL/cl.h>
+
+/* A pool of device buffers and images for samples that process many
+ * images, so that a buffer or image released by one image is handed to
+ * the next instead of being freed and allocated (and cleared by the
+ * driver) again.
+ *
+ * Buffers are rounded up to a size class (see poolSizeClass) and reused
+ * for any request of the same class, context and flags. Images are
+ * reused only for the same context, flags, format and size, as kernels
+ * and samplers see the whole image. A pooled object starts with
+ * whatever data its last user left in it, so host pointer flags
+ * (CL_MEM_USE_HOST_PTR, CL_MEM_COPY_HOST_PTR) cannot be pooled; such
+ * objects are created directly.
+ *
+ * Objects are handed out without an extra reference: return them with
+ * poolReturn instead of releasing them. */
+
+typedef struct {
+   cl_mem mem;
+   cl_context context;
+   cl_mem_flags flags;
+   cl_mem_object_type type;
+   cl_image_format format;
+   /* The size class of a buffer, the size of an image (the depth is
+    * the number of layers of an array), or the packet size and number
+    * of packets of a pipe */
+   size_t width;
+   size_t height;
+   size_t depth;
+   size_t bytes;
+   int inUse;
+   /* The last command using a returned object, which must finish before
+    * the object is handed out again */
+   cl_event lastUse;
+} PoolEntry;
+
+typedef struct {
+   PoolEntry *entries;
+   int numEntries;
+   int capacity;
+   /* Requests and requests served by a pooled object */
+   unsigned long requests;
+   unsigned long hits;
+   /* Bytes handed out and allocated now, and the high-water marks */
+   size_t bytesInUse;
+   size_t bytesAllocated;
+   size_t peakInUse;
+   size_t peakAllocated;
+} MemPool;
+
+void poolInit(MemPool *pool);
+
+/* Release every object of the pool, including those still handed out */
+void poolRelease(MemPool *pool);
+
+/* The size a request for 'size' bytes is rounded up to: a power of two
+ * for small buffers, and above that a multiple of an eighth of the next
+ * power of two, so a large buffer wastes less than a quarter */
+size_t poolSizeClass(size_t size);
+
+/* A buffer of at least 'size' bytes */
+cl_mem poolBuffer(MemPool *pool, cl_context context, cl_mem_flags flags,
+   size_t size);
+
+/* An image of 'format' described by 'desc', which must not have pitches,
+ * mip-levels or a buffer */
+cl_mem poolImage(MemPool *pool, cl_context context, cl_mem_flags flags,
+   const cl_image_format *format, const cl_image_desc *desc);
+
+/* A 2D image of 'width' x 'height' pixels of 'format' */
+cl_mem poolImage2D(MemPool *pool, cl_context context, cl_mem_flags flags,
+   const cl_image_format *format, size_t width, size_t height);
+
+#ifdef CL_VERSION_2_0
+/* A pipe of 'numPackets' packets of 'packetSize' bytes. A reused pipe
+ * must have been drained by its last user. */
+cl_mem poolPipe(MemPool *pool, cl_context context, cl_mem_flags flags,
+   cl_uint packetSize, cl_uint numPackets);
+#endif
+
+/* Hand 'mem' back to the pool. With poolReturnAfter it is reused only
+ * once 'lastUse' (which may be NULL) has completed, so it may be
+ * returned while commands using it are still queued. */
+void poolReturn(MemPool *pool, cl_mem mem);
+void poolReturnAfter(MemPool *pool, cl_mem mem, cl_event lastUse);
+
+/* Release the pooled objects that are not handed out */
+void poolTrim(MemPool *pool);
+
+/* Print the requests, the hit rate and the high-water marks */
+void poolPrintStats(const MemPool *pool);
+
+#endif
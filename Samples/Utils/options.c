@@ -0,0 +1,74 @@
+/* System includes */
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+const char* getOption(int argc, char **argv, const char *name,
+   const char *envName)
+{
+   size_t len = strlen(name);
+   int i;
+
+   for (i = 1; i < argc; i++) {
+      const char *arg = argv[i];
+      if (arg[0] != '-' || arg[1] != '-' || strncmp(arg+2, name, len) != 0) {
+         continue;
+      }
+      if (arg[2+len] == '=') {
+         return arg+3+len;
+      }
+      if (arg[2+len] == '\0') {
+         /* A flag without a value yields an empty string */
+         if (i+1 < argc && strncmp(argv[i+1], "--", 2) != 0) {
+            return argv[i+1];
+         }
+         return "";
+      }
+   }
+
+   if (envName) {
+      return getenv(envName);
+   }
+   return NULL;
+}
+
+int hasOption(int argc, char **argv, const char *name, const char *envName)
+{
+   size_t len = strlen(name);
+   const char *env;
+   int i;
+
+   for (i = 1; i < argc; i++) {
+      const char *arg = argv[i];
+      if (arg[0] == '-' && arg[1] == '-' &&
+          strncmp(arg+2, name, len) == 0 &&
+          (arg[2+len] == '\0' || arg[2+len] == '='))
+      {
+         return 1;
+      }
+   }
+
+   env = envName ? getenv(envName) : NULL;
+   return env && env[0] && strcmp(env, "0") != 0;
+}
+
+int getIntOption(int argc, char **argv, const char *name,
+   const char *envName, int defaultValue)
+{
+   const char *value = getOption(argc, argv, name, envName);
+   if (!value || !value[0]) {
+      return defaultValue;
+   }
+   return atoi(value);
+}
+
+double getDoubleOption(int argc, char **argv, const char *name,
+   const char *envName, double defaultValue)
+{
+   const char *value = getOption(argc, argv, name, envName);
+   if (!value || !value[0]) {
+      return defaultValue;
+   }
+   return atof(value);
+}
@@ -0,0 +1,24 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+/* Minimal command-line handling shared by the samples. Options are
+ * written as "--name value" or "--name=value"; anything the samples do
+ * not recognize is ignored. */
+
+/* Return the value given for option 'name' (without the leading dashes),
+ * or NULL if it is absent. If 'envName' is not NULL, that environment
+ * variable is used when the option is not on the command line. */
+const char* getOption(int argc, char **argv, const char *name,
+   const char *envName);
+
+/* Return 1 if the flag "--name" is present (or 'envName' is set to
+ * anything other than "0"), 0 otherwise */
+int hasOption(int argc, char **argv, const char *name, const char *envName);
+
+/* Integer and floating-point variants of getOption */
+int getIntOption(int argc, char **argv, const char *name,
+   const char *envName, int defaultValue);
+double getDoubleOption(int argc, char **argv, const char *name,
+   const char *envName, double defaultValue);
+
+#endif
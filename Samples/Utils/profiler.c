@@ -0,0 +1,238 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "options.h"
+#include "profiler.h"
+
+double wallTime(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+void profilerInit(Profiler *prof, const char *sample, int argc, char **argv)
+{
+   const char *path = getOption(argc, argv, "profile", "OCL_PROFILE");
+
+   prof->enabled = hasOption(argc, argv, "profile", "OCL_PROFILE");
+   prof->path = NULL;
+   if (path && path[0] && strcmp(path, "1") != 0 && strcmp(path, "-") != 0) {
+      prof->path = path;
+   }
+   prof->sample = sample;
+   prof->numCommands = 0;
+   prof->numStages = 0;
+   prof->stageStart = 0.0;
+}
+
+cl_event* profileEvent(Profiler *prof, const char *name, double bytes,
+   double pixels)
+{
+   ProfileCommand *cmd;
+
+   if (!prof->enabled || prof->numCommands == PROFILER_MAX_COMMANDS) {
+      return NULL;
+   }
+   cmd = &prof->commands[prof->numCommands++];
+   snprintf(cmd->name, sizeof(cmd->name), "%s", name);
+   cmd->event = NULL;
+   cmd->device = NULL;
+   cmd->bytes = bytes;
+   cmd->pixels = pixels;
+   return &cmd->event;
+}
+
+/* Return the device that executes 'event' */
+static cl_device_id eventDevice(cl_event event)
+{
+   cl_command_queue queue;
+   cl_device_id device = NULL;
+   if (clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue,
+          NULL) == CL_SUCCESS) {
+      clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device,
+         NULL);
+   }
+   return device;
+}
+
+void profileAddEvent(Profiler *prof, const char *name, cl_event event,
+   double bytes, double pixels)
+{
+   cl_event *slot = profileEvent(prof, name, bytes, pixels);
+   if (slot && event) {
+      clRetainEvent(event);
+      *slot = event;
+      /* Look the device up now, the queue may be gone by report time */
+      prof->commands[prof->numCommands-1].device = eventDevice(event);
+   }
+}
+
+void profileStageBegin(Profiler *prof, const char *name)
+{
+   ProfileStage *stage;
+
+   if (!prof->enabled || prof->numStages == PROFILER_MAX_STAGES) {
+      return;
+   }
+   stage = &prof->stages[prof->numStages++];
+   snprintf(stage->name, sizeof(stage->name), "%s", name);
+   stage->ms = -1.0;
+   prof->stageStart = wallTime();
+}
+
+void profileStageEnd(Profiler *prof)
+{
+   if (!prof->enabled || prof->numStages == 0) {
+      return;
+   }
+   prof->stages[prof->numStages-1].ms = wallTime() - prof->stageStart;
+}
+
+/* Write 'str' as a JSON string literal */
+static void writeJsonString(FILE *fp, const char *str)
+{
+   fputc('"', fp);
+   for (; *str; str++) {
+      if (*str == '"' || *str == '\\') {
+         fputc('\\', fp);
+      }
+      if ((unsigned char)*str >= 0x20) {
+         fputc(*str, fp);
+      }
+   }
+   fputc('"', fp);
+}
+
+static void writeDeviceInfo(FILE *fp, const char *field, cl_device_id device,
+   cl_device_info param)
+{
+   char str[256];
+   str[0] = '\0';
+   clGetDeviceInfo(device, param, sizeof(str), str, NULL);
+   fprintf(fp, "  \"%s\": ", field);
+   writeJsonString(fp, str);
+   fprintf(fp, ",\n");
+}
+
+void profilerReport(Profiler *prof, cl_device_id device)
+{
+   FILE *fp;
+   cl_ulong base = 0;
+   int i;
+
+   if (!prof->enabled) {
+      return;
+   }
+
+   /* All commands must have finished before the timestamps are valid */
+   for (i = 0; i < prof->numCommands; i++) {
+      if (prof->commands[i].event) {
+         check(clWaitForEvents(1, &prof->commands[i].event));
+      }
+   }
+
+   fp = prof->path ? fopen(prof->path, "w") : stdout;
+   if (!fp) {
+      printf("Cannot write profile to %s\n", prof->path);
+      fp = stdout;
+   }
+
+   /* Device timestamps are reported relative to the first queued command */
+   for (i = 0; i < prof->numCommands; i++) {
+      cl_ulong queued;
+      if (prof->commands[i].event &&
+          clGetEventProfilingInfo(prof->commands[i].event,
+             CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL)
+             == CL_SUCCESS &&
+          (base == 0 || queued < base)) {
+         base = queued;
+      }
+   }
+
+   fprintf(fp, "{\n  \"sample\": ");
+   writeJsonString(fp, prof->sample);
+   fprintf(fp, ",\n");
+   writeDeviceInfo(fp, "device", device, CL_DEVICE_NAME);
+   writeDeviceInfo(fp, "vendor", device, CL_DEVICE_VENDOR);
+   writeDeviceInfo(fp, "driver", device, CL_DRIVER_VERSION);
+   writeDeviceInfo(fp, "version", device, CL_DEVICE_VERSION);
+
+   fprintf(fp, "  \"host\": {");
+   for (i = 0; i < prof->numStages; i++) {
+      fprintf(fp, "%s\n    ", i ? "," : "");
+      writeJsonString(fp, prof->stages[i].name);
+      fprintf(fp, ": {\"wall_ms\": %.3f}", prof->stages[i].ms);
+   }
+   fprintf(fp, "\n  },\n");
+
+   fprintf(fp, "  \"commands\": [");
+   for (i = 0; i < prof->numCommands; i++) {
+      ProfileCommand *cmd = &prof->commands[i];
+      cl_ulong t[4] = {0, 0, 0, 0};
+      cl_device_id cmdDevice = cmd->device;
+      char deviceName[256];
+      double ms;
+
+      if (cmd->event) {
+         clGetEventProfilingInfo(cmd->event, CL_PROFILING_COMMAND_QUEUED,
+            sizeof(cl_ulong), &t[0], NULL);
+         clGetEventProfilingInfo(cmd->event, CL_PROFILING_COMMAND_SUBMIT,
+            sizeof(cl_ulong), &t[1], NULL);
+         clGetEventProfilingInfo(cmd->event, CL_PROFILING_COMMAND_START,
+            sizeof(cl_ulong), &t[2], NULL);
+         clGetEventProfilingInfo(cmd->event, CL_PROFILING_COMMAND_END,
+            sizeof(cl_ulong), &t[3], NULL);
+         if (!cmdDevice) {
+            cmdDevice = eventDevice(cmd->event);
+         }
+      }
+      if (!cmdDevice) {
+         cmdDevice = device;
+      }
+      deviceName[0] = '\0';
+      clGetDeviceInfo(cmdDevice, CL_DEVICE_NAME, sizeof(deviceName),
+         deviceName, NULL);
+      ms = (t[3] - t[2])*1e-6;
+
+      fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+      writeJsonString(fp, cmd->name);
+      fprintf(fp, ", \"device\": ");
+      writeJsonString(fp, deviceName);
+      fprintf(fp, ",\n     \"queued_ns\": %llu, \"submit_ns\": %llu, "
+         "\"start_ns\": %llu, \"end_ns\": %llu, \"duration_ms\": %.4f",
+         (unsigned long long)(t[0] ? t[0]-base : 0),
+         (unsigned long long)(t[1] ? t[1]-base : 0),
+         (unsigned long long)(t[2] ? t[2]-base : 0),
+         (unsigned long long)(t[3] ? t[3]-base : 0), ms);
+      if (cmd->bytes > 0) {
+         fprintf(fp, ",\n     \"bytes\": %.0f, \"gb_per_s\": %.3f", cmd->bytes,
+            ms > 0 ? cmd->bytes/(ms*1e6) : 0.0);
+      }
+      if (cmd->pixels > 0) {
+         fprintf(fp, ",\n     \"pixels\": %.0f, \"mpixels_per_s\": %.3f",
+            cmd->pixels, ms > 0 ? cmd->pixels/(ms*1e3) : 0.0);
+      }
+      fprintf(fp, "}");
+
+      if (cmd->event) {
+         clReleaseEvent(cmd->event);
+         cmd->event = NULL;
+      }
+   }
+   fprintf(fp, "\n  ]\n}\n");
+
+   if (fp != stdout) {
+      fclose(fp);
+      printf("Profile written to %s\n", prof->path);
+   }
+   prof->numCommands = 0;
+}
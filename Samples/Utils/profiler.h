@@ -0,0 +1,64 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <CL/cl.h>
+
+#define PROFILER_MAX_COMMANDS 256
+#define PROFILER_MAX_STAGES 32
+
+/* One profiled OpenCL command. 'bytes' is the transfer volume of reads,
+ * writes and fills; 'pixels' the number of pixels a kernel processes. */
+typedef struct {
+   char name[64];
+   cl_event event;
+   cl_device_id device;
+   double bytes;
+   double pixels;
+} ProfileCommand;
+
+/* One host-side stage timed with the wall clock */
+typedef struct {
+   char name[32];
+   double ms;
+} ProfileStage;
+
+typedef struct {
+   int enabled;
+   const char *path;
+   const char *sample;
+   ProfileCommand commands[PROFILER_MAX_COMMANDS];
+   int numCommands;
+   ProfileStage stages[PROFILER_MAX_STAGES];
+   int numStages;
+   double stageStart;
+} Profiler;
+
+/* Enable profiling if "--profile [FILE]" is given (or OCL_PROFILE is set
+ * to a file name or to 1). The report is written as JSON to FILE, or to
+ * stdout when no file is named. The command queues must be created with
+ * CL_QUEUE_PROFILING_ENABLE, which queueProperties() does when profiling
+ * is requested. */
+void profilerInit(Profiler *prof, const char *sample, int argc, char **argv);
+
+/* Return an event slot to pass as the last argument of an enqueue call,
+ * or NULL when profiling is disabled */
+cl_event* profileEvent(Profiler *prof, const char *name, double bytes,
+   double pixels);
+
+/* Record an event that was returned by some other means (e.g., from the
+ * C++ bindings). The event is retained. */
+void profileAddEvent(Profiler *prof, const char *name, cl_event event,
+   double bytes, double pixels);
+
+/* Time a host-side stage such as setup, build or verification */
+void profileStageBegin(Profiler *prof, const char *name);
+void profileStageEnd(Profiler *prof);
+
+/* Wait for all recorded commands, write the report and release the
+ * recorded events */
+void profilerReport(Profiler *prof, cl_device_id device);
+
+/* Wall-clock time in milliseconds */
+double wallTime(void);
+
+#endif
@@ -0,0 +1,410 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "program-cache.h"
+
+/* Every cache entry starts with this tag so that foreign or truncated
+ * files are never handed to the driver */
+static const char cacheMagic[8] = {'O', 'C', 'L', 'B', 'I', 'N', '0', '1'};
+
+/* 64-bit FNV-1a hash, used both for naming entries and for checksums */
+static const unsigned long long fnvOffset = 14695981039346656037ULL;
+
+static unsigned long long fnv1a(const void *data, size_t len,
+   unsigned long long hash)
+{
+   const unsigned char *bytes = (const unsigned char*)data;
+   size_t i;
+   for (i = 0; i < len; i++) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+static double wallTimeMs()
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+/* Return a string device property in a freshly allocated buffer */
+static char* deviceString(cl_device_id device, cl_device_info param)
+{
+   size_t len = 0;
+   char *str;
+   check(clGetDeviceInfo(device, param, 0, NULL, &len));
+   str = (char*)malloc(len+1);
+   if (!str) { exit(-1); }
+   check(clGetDeviceInfo(device, param, len, str, NULL));
+   str[len] = '\0';
+   return str;
+}
+
+static char* platformString(cl_platform_id platform, cl_platform_info param)
+{
+   size_t len = 0;
+   char *str;
+   check(clGetPlatformInfo(platform, param, 0, NULL, &len));
+   str = (char*)malloc(len+1);
+   if (!str) { exit(-1); }
+   check(clGetPlatformInfo(platform, param, len, str, NULL));
+   str[len] = '\0';
+   return str;
+}
+
+/* The key holds everything that can change the generated binary. The
+ * source itself is represented by its hash. */
+static char* cacheKey(cl_device_id device, const char *options,
+   unsigned long long sourceHash)
+{
+   cl_platform_id platform;
+   char *platformName, *platformVersion;
+   char *name, *vendor, *version, *driver;
+   char *key;
+   size_t keyLen;
+
+   check(clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id),
+      &platform, NULL));
+   platformName = platformString(platform, CL_PLATFORM_NAME);
+   platformVersion = platformString(platform, CL_PLATFORM_VERSION);
+   name = deviceString(device, CL_DEVICE_NAME);
+   vendor = deviceString(device, CL_DEVICE_VENDOR);
+   version = deviceString(device, CL_DEVICE_VERSION);
+   driver = deviceString(device, CL_DRIVER_VERSION);
+
+   keyLen = strlen(platformName) + strlen(platformVersion) + strlen(name) +
+      strlen(vendor) + strlen(version) + strlen(driver) +
+      strlen(options) + 128;
+   key = (char*)malloc(keyLen);
+   if (!key) { exit(-1); }
+   snprintf(key, keyLen,
+      "platform=%s %s\ndevice=%s\nvendor=%s\nversion=%s\ndriver=%s\n"
+      "options=%s\nsource=%016llx\n", platformName, platformVersion,
+      name, vendor, version, driver, options, sourceHash);
+
+   free(platformName);
+   free(platformVersion);
+   free(name);
+   free(vendor);
+   free(version);
+   free(driver);
+   return key;
+}
+
+/* Directory holding the cache entries */
+static void cacheDirectory(char *dir, size_t len)
+{
+   const char *env = getenv("OCL_CACHE_DIR");
+   const char *home = getenv("HOME");
+   if (env && env[0]) {
+      snprintf(dir, len, "%s", env);
+   }
+   else if (home && home[0]) {
+      snprintf(dir, len, "%s/.cache/openclbook", home);
+   }
+   else {
+      snprintf(dir, len, ".clcache");
+   }
+}
+
+/* Create 'dir' and any missing parents */
+static void makeDirectories(const char *dir)
+{
+   char path[1024];
+   char *p;
+   snprintf(path, sizeof(path), "%s", dir);
+   for (p = path+1; *p; p++) {
+      if (*p == '/') {
+         *p = '\0';
+         mkdir(path, 0755);
+         *p = '/';
+      }
+   }
+   mkdir(path, 0755);
+}
+
+void cacheFilePath(cl_device_id device, const char *subdir,
+   const char *suffix, char *path, size_t len)
+{
+   char dir[1024];
+   char *key = cacheKey(device, "", 0);
+   size_t dirLen;
+
+   cacheDirectory(dir, sizeof(dir));
+   dirLen = strlen(dir);
+   snprintf(dir + dirLen, sizeof(dir) - dirLen, "/%s", subdir);
+   makeDirectories(dir);
+   snprintf(path, len, "%s/%016llx%s", dir, 
+      fnv1a(key, strlen(key), fnvOffset), suffix);
+   free(key);
+}
+
+/* Read a cache entry. Returns 1 and a malloc'd binary if the entry exists
+ * and matches 'key'. A damaged or mismatching entry is deleted so that it
+ * is replaced by the next build. */
+static int loadEntry(const char *path, const char *key,
+   unsigned char **binary, size_t *binarySize, int *stale)
+{
+   FILE *fp;
+   char magic[8];
+   unsigned int keyLen;
+   char *storedKey = NULL;
+   unsigned long long size, checksum;
+   unsigned char *data = NULL;
+   int valid = 0;
+
+   fp = fopen(path, "rb");
+   if (!fp) {
+      return 0;
+   }
+
+   if (fread(magic, 1, 8, fp) == 8 &&
+       memcmp(magic, cacheMagic, 8) == 0 &&
+       fread(&keyLen, sizeof(keyLen), 1, fp) == 1 &&
+       keyLen == strlen(key))
+   {
+      storedKey = (char*)malloc(keyLen);
+      if (storedKey &&
+          fread(storedKey, 1, keyLen, fp) == keyLen &&
+          memcmp(storedKey, key, keyLen) == 0 &&
+          fread(&size, sizeof(size), 1, fp) == 1 &&
+          fread(&checksum, sizeof(checksum), 1, fp) == 1 &&
+          size > 0)
+      {
+         data = (unsigned char*)malloc(size);
+         if (data && fread(data, 1, size, fp) == size &&
+             fnv1a(data, size, fnvOffset) == checksum)
+         {
+            valid = 1;
+         }
+      }
+   }
+   fclose(fp);
+   free(storedKey);
+
+   if (!valid) {
+      free(data);
+      remove(path);
+      *stale = 1;
+      return 0;
+   }
+
+   *binary = data;
+   *binarySize = (size_t)size;
+   return 1;
+}
+
+/* Write a cache entry. The data goes to a temporary file that is renamed
+ * over the entry, so concurrent runs never observe a partial file. */
+static void storeEntry(const char *dir, const char *path, const char *key,
+   const unsigned char *binary, size_t binarySize)
+{
+   char tmpPath[1100];
+   FILE *fp;
+   unsigned int keyLen = (unsigned int)strlen(key);
+   unsigned long long size = binarySize;
+   unsigned long long checksum = fnv1a(binary, binarySize, fnvOffset);
+   int ok;
+
+   makeDirectories(dir);
+   snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+   fp = fopen(tmpPath, "wb");
+   if (!fp) {
+      /* An unwritable cache only costs us the next compile */
+      return;
+   }
+   ok = fwrite(cacheMagic, 1, 8, fp) == 8 &&
+        fwrite(&keyLen, sizeof(keyLen), 1, fp) == 1 &&
+        fwrite(key, 1, keyLen, fp) == keyLen &&
+        fwrite(&size, sizeof(size), 1, fp) == 1 &&
+        fwrite(&checksum, sizeof(checksum), 1, fp) == 1 &&
+        fwrite(binary, 1, binarySize, fp) == binarySize;
+   ok = (fclose(fp) == 0) && ok;
+   if (!ok || rename(tmpPath, path) != 0) {
+      remove(tmpPath);
+   }
+}
+
+/* Save the binary of every device the program was built for */
+static void storeProgramBinaries(cl_program program, cl_uint numDevices,
+   const cl_device_id *devices, const char *dir, char **paths, char **keys)
+{
+   cl_uint numProgramDevices;
+   cl_device_id *programDevices;
+   size_t *sizes;
+   unsigned char **binaries;
+   cl_uint i, j;
+
+   check(clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint),
+      &numProgramDevices, NULL));
+   programDevices = (cl_device_id*)malloc(numProgramDevices*
+      sizeof(cl_device_id));
+   sizes = (size_t*)malloc(numProgramDevices*sizeof(size_t));
+   binaries = (unsigned char**)malloc(numProgramDevices*
+      sizeof(unsigned char*));
+   if (!programDevices || !sizes || !binaries) { exit(-1); }
+
+   check(clGetProgramInfo(program, CL_PROGRAM_DEVICES,
+      numProgramDevices*sizeof(cl_device_id), programDevices, NULL));
+   check(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+      numProgramDevices*sizeof(size_t), sizes, NULL));
+   for (i = 0; i < numProgramDevices; i++) {
+      binaries[i] = sizes[i] ? (unsigned char*)malloc(sizes[i]) : NULL;
+   }
+   check(clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+      numProgramDevices*sizeof(unsigned char*), binaries, NULL));
+
+   for (i = 0; i < numProgramDevices; i++) {
+      for (j = 0; j < numDevices; j++) {
+         if (programDevices[i] == devices[j] && binaries[i]) {
+            storeEntry(dir, paths[j], keys[j], binaries[i], sizes[i]);
+         }
+      }
+      free(binaries[i]);
+   }
+
+   free(binaries);
+   free(sizes);
+   free(programDevices);
+}
+
+cl_program buildProgramCached(cl_context context, cl_uint numDevices,
+   const cl_device_id *devices, const char *sourceFile, const char *options)
+{
+   cl_int status;
+   cl_program program = NULL;
+   const char *mode = getenv("OCL_CACHE");
+   int enabled = !(mode && strcmp(mode, "off") == 0);
+   int rebuild = mode && strcmp(mode, "rebuild") == 0;
+   const char *reason = "no entry";
+   char dir[1024];
+   char **keys, **paths;
+   unsigned char **binaries;
+   size_t *binarySizes;
+   cl_uint hits = 0;
+   int stale = 0;
+   char *deviceName;
+   double start = wallTimeMs();
+   cl_uint i;
+
+   if (!options) {
+      options = "";
+   }
+
+   /* Read the program source */
+   char *programSource = readFile(sourceFile);
+   size_t programSourceLen = strlen(programSource);
+   unsigned long long sourceHash = fnv1a(programSource, programSourceLen,
+      fnvOffset);
+
+   keys = (char**)malloc(numDevices*sizeof(char*));
+   paths = (char**)malloc(numDevices*sizeof(char*));
+   binaries = (unsigned char**)calloc(numDevices, sizeof(unsigned char*));
+   binarySizes = (size_t*)calloc(numDevices, sizeof(size_t));
+   if (!keys || !paths || !binaries || !binarySizes) { exit(-1); }
+
+   /* Look up an entry for each device */
+   cacheDirectory(dir, sizeof(dir));
+   for (i = 0; i < numDevices; i++) {
+      keys[i] = cacheKey(devices[i], options, sourceHash);
+      paths[i] = (char*)malloc(strlen(dir) + 32);
+      if (!paths[i]) { exit(-1); }
+      sprintf(paths[i], "%s/%016llx.bin", dir,
+         fnv1a(keys[i], strlen(keys[i]), fnvOffset));
+      if (enabled && !rebuild &&
+          loadEntry(paths[i], keys[i], &binaries[i], &binarySizes[i],
+             &stale))
+      {
+         hits++;
+      }
+   }
+   if (!enabled) {
+      reason = "cache disabled";
+   }
+   else if (rebuild) {
+      reason = "rebuild requested";
+   }
+   else if (stale) {
+      reason = "stale entry";
+   }
+
+   /* Only a complete set of binaries can be used */
+   if (hits == numDevices) {
+      program = clCreateProgramWithBinary(context, numDevices, devices,
+         binarySizes, (const unsigned char**)binaries, NULL, &status);
+      if (status == CL_SUCCESS) {
+         status = clBuildProgram(program, numDevices, devices, options,
+            NULL, NULL);
+      }
+      if (status != CL_SUCCESS) {
+         /* The driver rejected the binary, so drop the entries */
+         if (program) {
+            clReleaseProgram(program);
+            program = NULL;
+         }
+         for (i = 0; i < numDevices; i++) {
+            remove(paths[i]);
+         }
+         reason = "binary rejected";
+      }
+   }
+
+   /* Compile from source on a miss */
+   if (!program) {
+      program = clCreateProgramWithSource(context, 1,
+         (const char**)&programSource, &programSourceLen, &status);
+      check(status);
+
+      status = clBuildProgram(program, numDevices, devices, options,
+         NULL, NULL);
+      if (status != CL_SUCCESS) {
+         for (i = 0; i < numDevices; i++) {
+            printCompilerError(program, devices[i]);
+         }
+         exit(-1);
+      }
+
+      if (enabled) {
+         storeProgramBinaries(program, numDevices, devices, dir, paths, keys);
+      }
+   }
+
+   /* Report the outcome */
+   deviceName = deviceString(devices[0], CL_DEVICE_NAME);
+   if (hits == numDevices && strcmp(reason, "binary rejected") != 0) {
+      printf("Program cache hit: %s on %s%s (%.1f ms)\n", sourceFile,
+         deviceName, numDevices > 1 ? " and others" : "",
+         wallTimeMs()-start);
+   }
+   else {
+      printf("Program cache miss (%s): %s on %s%s (%.1f ms)\n", reason,
+         sourceFile, deviceName, numDevices > 1 ? " and others" : "",
+         wallTimeMs()-start);
+   }
+   free(deviceName);
+
+   for (i = 0; i < numDevices; i++) {
+      free(keys[i]);
+      free(paths[i]);
+      free(binaries[i]);
+   }
+   free(keys);
+   free(paths);
+   free(binaries);
+   free(binarySizes);
+   free(programSource);
+
+   return program;
+}
@@ -0,0 +1,32 @@
+#ifndef __PROGRAM_CACHE_H__
+#define __PROGRAM_CACHE_H__
+
+#include <CL/cl.h>
+
+/* Build the OpenCL C source in 'sourceFile' for the given devices and
+ * return the built program. Compiled binaries are kept in an on-disk
+ * cache keyed by the device name, vendor and version, the driver version,
+ * the build options and a hash of the source text, so later runs load
+ * the binary with clCreateProgramWithBinary instead of compiling again.
+ *
+ * The cache is controlled with environment variables:
+ *   OCL_CACHE_DIR   directory holding the cache entries
+ *                   (default: $HOME/.cache/openclbook, or ./.clcache)
+ *   OCL_CACHE=off   always compile from source and do not touch the cache
+ *   OCL_CACHE=rebuild  compile from source and overwrite existing entries
+ *
+ * Entries whose key, size or checksum do not match, and binaries that the
+ * driver refuses to build, are discarded and rebuilt from source. Files
+ * pulled in with #include are not part of the key. A line reporting the
+ * cache hit or miss is printed for every call. A build failure prints the
+ * compiler log and exits, like the samples do. */
+cl_program buildProgramCached(cl_context context, cl_uint numDevices,
+   const cl_device_id *devices, const char *sourceFile, const char *options);
+
+/* Write to 'path' the name of a file in directory 'subdir' of the cache
+ * that belongs to 'device' and its driver, e.g. for per-device settings,
+ * ending in 'suffix'. The directory is created if needed. */
+void cacheFilePath(cl_device_id device, const char *subdir,
+   const char *suffix, char *path, size_t len);
+
+#endif
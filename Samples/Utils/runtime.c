@@ -0,0 +1,302 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* OpenCL includes */
+#include <CL/cl.h>
+
+/* Utility functions */
+#include "utils.h"
+#include "options.h"
+#include "program-cache.h"
+#include "runtime.h"
+
+/* Parsed form of a device specification */
+typedef struct {
+   cl_device_type type;
+   char vendor[128];
+   int index;
+   int explicitSpec;
+} DeviceSpec;
+
+static int parseType(const char *str, cl_device_type *type)
+{
+   if (strcmp(str, "gpu") == 0) { *type = CL_DEVICE_TYPE_GPU; }
+   else if (strcmp(str, "cpu") == 0) { *type = CL_DEVICE_TYPE_CPU; }
+   else if (strcmp(str, "accelerator") == 0) {
+      *type = CL_DEVICE_TYPE_ACCELERATOR;
+   }
+   else if (strcmp(str, "all") == 0) { *type = CL_DEVICE_TYPE_ALL; }
+   else { return 0; }
+   return 1;
+}
+
+static void parseSpec(const char *spec, cl_device_type preferredType,
+   DeviceSpec *ds)
+{
+   char buf[256];
+   char *token;
+
+   ds->type = preferredType;
+   ds->vendor[0] = '\0';
+   ds->index = 0;
+   ds->explicitSpec = 0;
+   if (!spec || !spec[0]) {
+      return;
+   }
+   ds->explicitSpec = 1;
+
+   snprintf(buf, sizeof(buf), "%s", spec);
+   for (token = strtok(buf, ","); token; token = strtok(NULL, ",")) {
+      if (strncmp(token, "type=", 5) == 0) {
+         if (!parseType(token+5, &ds->type)) {
+            printf("Unknown device type '%s'\n", token+5);
+         }
+      }
+      else if (strncmp(token, "vendor=", 7) == 0) {
+         snprintf(ds->vendor, sizeof(ds->vendor), "%s", token+7);
+      }
+      else if (strncmp(token, "index=", 6) == 0) {
+         ds->index = atoi(token+6);
+      }
+      else if (isdigit((unsigned char)token[0])) {
+         ds->index = atoi(token);
+      }
+      else if (!parseType(token, &ds->type)) {
+         snprintf(ds->vendor, sizeof(ds->vendor), "%s", token);
+      }
+   }
+}
+
+/* Case-insensitive substring search */
+static int containsText(const char *haystack, const char *needle)
+{
+   size_t n = strlen(needle);
+   const char *p;
+   for (p = haystack; *p; p++) {
+      size_t i;
+      for (i = 0; i < n; i++) {
+         if (!p[i] || tolower((unsigned char)p[i]) !=
+                      tolower((unsigned char)needle[i])) {
+            break;
+         }
+      }
+      if (i == n) {
+         return 1;
+      }
+   }
+   return n == 0;
+}
+
+static int matchesVendor(cl_platform_id platform, cl_device_id device,
+   const char *vendor)
+{
+   char str[256];
+   if (!vendor[0]) {
+      return 1;
+   }
+   str[0] = '\0';
+   clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(str), str, NULL);
+   if (containsText(str, vendor)) { return 1; }
+   str[0] = '\0';
+   clGetDeviceInfo(device, CL_DEVICE_VENDOR, sizeof(str), str, NULL);
+   if (containsText(str, vendor)) { return 1; }
+   str[0] = '\0';
+   clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(str), str, NULL);
+   if (containsText(str, vendor)) { return 1; }
+   str[0] = '\0';
+   clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, sizeof(str), str, NULL);
+   return containsText(str, vendor);
+}
+
+/* Return the 'index'-th available device of 'type' whose names contain
+ * 'vendor', searching every platform (or only 'onlyPlatform') */
+static cl_device_id findDevice(cl_device_type type, const char *vendor,
+   int index, cl_platform_id onlyPlatform)
+{
+   cl_platform_id platforms[16];
+   cl_uint numPlatforms = 0;
+   cl_device_id found = NULL;
+   cl_uint p, d;
+   int matches = 0;
+
+   if (clGetPlatformIDs(16, platforms, &numPlatforms) != CL_SUCCESS) {
+      return NULL;
+   }
+   if (numPlatforms > 16) {
+      numPlatforms = 16;
+   }
+
+   for (p = 0; p < numPlatforms && !found; p++) {
+      cl_device_id devices[64];
+      cl_uint numDevices = 0;
+
+      if (onlyPlatform && platforms[p] != onlyPlatform) {
+         continue;
+      }
+      /* Platforms without devices of this type are simply skipped */
+      if (clGetDeviceIDs(platforms[p], type, 64, devices, &numDevices) !=
+          CL_SUCCESS) {
+         continue;
+      }
+      if (numDevices > 64) {
+         numDevices = 64;
+      }
+      for (d = 0; d < numDevices && !found; d++) {
+         cl_bool available = CL_FALSE;
+         clGetDeviceInfo(devices[d], CL_DEVICE_AVAILABLE, sizeof(cl_bool),
+            &available, NULL);
+         if (available && matchesVendor(platforms[p], devices[d], vendor)) {
+            if (matches++ == index) {
+               found = devices[d];
+            }
+         }
+      }
+   }
+   return found;
+}
+
+cl_device_id selectDevice(const char *spec, cl_device_type preferredType,
+   cl_platform_id platform)
+{
+   DeviceSpec ds;
+   cl_device_id device;
+
+   parseSpec(spec, preferredType, &ds);
+   device = findDevice(ds.type, ds.vendor, ds.index, platform);
+   if (device) {
+      return device;
+   }
+
+   if (ds.explicitSpec) {
+      printf("No device matches '%s', falling back\n", spec);
+   }
+
+   /* Fall back to a CPU device (e.g., pocl) and then to anything */
+   device = findDevice(CL_DEVICE_TYPE_CPU, "", 0, platform);
+   if (!device) {
+      device = findDevice(CL_DEVICE_TYPE_ALL, "", 0, platform);
+   }
+   if (!device) {
+      printf("No OpenCL device found\n");
+      exit(-1);
+   }
+   return device;
+}
+
+/* Whether the removed "--out-of-order" option has been reported */
+static int warnedOutOfOrder = 0;
+
+cl_command_queue_properties queueProperties(int argc, char **argv,
+   cl_device_id device)
+{
+   cl_command_queue_properties requested = 0;
+   cl_command_queue_properties supported = 0;
+
+   if (hasOption(argc, argv, "profiling", "OCL_PROFILING") ||
+       hasOption(argc, argv, "profile", "OCL_PROFILE") ||
+       hasOption(argc, argv, "autotune", "OCL_AUTOTUNE")) {
+      requested |= CL_QUEUE_PROFILING_ENABLE;
+   }
+   if (hasOption(argc, argv, "out-of-order", "OCL_OUT_OF_ORDER") && 
+       !warnedOutOfOrder) {
+      printf("--out-of-order (OCL_OUT_OF_ORDER) was removed: the graph "
+         "queues are out-of-order unless --in-order is given, and the "
+         "other queues are always in-order\n");
+      warnedOutOfOrder = 1;
+   }
+
+   check(clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES,
+      sizeof(supported), &supported, NULL));
+   return requested & supported;
+}
+
+cl_command_queue_properties graphQueueProperties(int argc, char **argv,
+   cl_device_id device)
+{
+   cl_command_queue_properties supported = 0;
+   /* The graph times its transfers from their events */
+   cl_command_queue_properties properties = 
+      queueProperties(argc, argv, device) | CL_QUEUE_PROFILING_ENABLE;
+
+   if (!hasOption(argc, argv, "in-order", "OCL_IN_ORDER")) {
+      properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+   }
+   check(clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES,
+      sizeof(supported), &supported, NULL));
+   return properties & supported;
+}
+
+void printDevice(const char *role, cl_device_id device)
+{
+   cl_platform_id platform;
+   char deviceName[256];
+   char platformName[256];
+
+   deviceName[0] = '\0';
+   platformName[0] = '\0';
+   clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName,
+      NULL);
+   clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform,
+      NULL);
+   clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platformName),
+      platformName, NULL);
+   printf("%s: %s (%s)\n", role, deviceName, platformName);
+}
+
+void runtimeInit(Runtime *rt, int argc, char **argv)
+{
+   cl_int status;
+
+   rt->program = NULL;
+   rt->kernel = NULL;
+   poolInit(&rt->pool);
+
+   /* Choose the device */
+   rt->device = selectDevice(getOption(argc, argv, "device", "OCL_DEVICE"),
+      CL_DEVICE_TYPE_GPU, NULL);
+   check(clGetDeviceInfo(rt->device, CL_DEVICE_PLATFORM,
+      sizeof(cl_platform_id), &rt->platform, NULL));
+   printDevice("Device", rt->device);
+
+   /* Create a context and associate it with the device */
+   rt->context = clCreateContext(NULL, 1, &rt->device, NULL, NULL, &status);
+   check(status);
+
+   /* Create a command queue and associate it with the device. The
+    * samples pass every dependency as an event, so it is out-of-order
+    * where the device allows. */
+   rt->queue = clCreateCommandQueue(rt->context, rt->device,
+      graphQueueProperties(argc, argv, rt->device), &status);
+   check(status);
+}
+
+void runtimeBuild(Runtime *rt, const char *sourceFile, const char *options,
+   const char *kernelName)
+{
+   cl_int status;
+
+   rt->program = buildProgramCached(rt->context, 1, &rt->device, sourceFile,
+      options);
+
+   if (kernelName) {
+      rt->kernel = clCreateKernel(rt->program, kernelName, &status);
+      check(status);
+   }
+}
+
+void runtimeRelease(Runtime *rt)
+{
+   if (rt->kernel) {
+      clReleaseKernel(rt->kernel);
+   }
+   if (rt->program) {
+      clReleaseProgram(rt->program);
+   }
+   poolPrintStats(&rt->pool);
+   poolRelease(&rt->pool);
+   clReleaseCommandQueue(rt->queue);
+   clReleaseContext(rt->context);
+}
@@ -0,0 +1,69 @@
+#ifndef __RUNTIME_H__
+#define __RUNTIME_H__
+
+#include <CL/cl.h>
+
+#include "memory-pool.h"
+
+/* The OpenCL objects every single-device sample needs */
+typedef struct {
+   cl_platform_id platform;
+   cl_device_id device;
+   cl_context context;
+   cl_command_queue queue;
+   cl_program program;
+   cl_kernel kernel;
+   /* Buffers and images for the context (see memory-pool.h) */
+   MemPool pool;
+} Runtime;
+
+/* Select a device and create a context and a command queue for it.
+ *
+ * The device is chosen with "--device SPEC" or the OCL_DEVICE environment
+ * variable. SPEC is a comma-separated list of
+ *   type=gpu|cpu|accelerator|all   (or just "gpu", "cpu", ...)
+ *   vendor=TEXT  matched against the device name and vendor and the
+ *                platform name and vendor (or any other bare word)
+ *   index=N      pick the N-th matching device (or just "N")
+ * All platforms are searched. Without a SPEC a GPU is preferred. When no
+ * device matches, the first CPU device (e.g., pocl) is used instead, and
+ * failing that any available device.
+ *
+ * The queue is created with graphQueueProperties(). "--profiling"
+ * (OCL_PROFILING=1) requests a profiling queue; "--profile" (see
+ * profiler.h) and "--autotune" (see autotune.h) also enable profiling. */
+void runtimeInit(Runtime *rt, int argc, char **argv);
+
+/* Build 'sourceFile' through the program cache and create 'kernelName'
+ * (which may be NULL to only build the program) */
+void runtimeBuild(Runtime *rt, const char *sourceFile, const char *options,
+   const char *kernelName);
+
+/* Release everything runtimeInit and runtimeBuild created, including the
+ * pool, after printing its statistics */
+void runtimeRelease(Runtime *rt);
+
+/* Return the device selected by 'spec' (see runtimeInit). 'preferredType'
+ * applies when the spec does not name a type. Only devices of 'platform'
+ * are considered unless it is NULL. */
+cl_device_id selectDevice(const char *spec, cl_device_type preferredType,
+   cl_platform_id platform);
+
+/* Return the queue properties requested on the command line that 'device'
+ * supports. These queues are always in-order: callers that chain their
+ * commands without events rely on it. */
+cl_command_queue_properties queueProperties(int argc, char **argv,
+   cl_device_id device);
+
+/* queueProperties() plus profiling, which times the transfers of a
+ * command graph, and out-of-order execution where 'device' supports it,
+ * unless "--in-order" (OCL_IN_ORDER=1) is given. Only for queues
+ * whose commands carry all their dependencies as events (see
+ * command-graph.h). */
+cl_command_queue_properties graphQueueProperties(int argc, char **argv,
+   cl_device_id device);
+
+/* Print the name and platform of a device */
+void printDevice(const char *role, cl_device_id device);
+
+#endif
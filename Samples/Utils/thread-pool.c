@@ -0,0 +1,122 @@
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Utility functions */
+#include "thread-pool.h"
+
+#define MAX_POOL_THREADS 64
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t start;
+   pthread_cond_t done;
+   int numThreads;
+   unsigned long generation;
+   int pending;
+   ParallelFunc func;
+   void *arg;
+   size_t count;
+   int activeParts;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 
+          PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, 0, 0};
+
+/* Run part 'part' of the current job */
+static void runPart(int part)
+{
+   size_t begin = 0;
+   size_t end = 0;
+   if (part < pool.activeParts) {
+      begin = pool.count*part/pool.activeParts;
+      end = pool.count*(part + 1)/pool.activeParts;
+   }
+   pool.func(pool.arg, part, begin, end);
+}
+
+static void* poolWorker(void *arg)
+{
+   int part = (int)(intptr_t)arg;
+   unsigned long seen = 0;
+
+   pthread_mutex_lock(&pool.lock);
+   for (;;) {
+      while (pool.generation == seen) {
+         pthread_cond_wait(&pool.start, &pool.lock);
+      }
+      seen = pool.generation;
+      pthread_mutex_unlock(&pool.lock);
+
+      runPart(part);
+
+      pthread_mutex_lock(&pool.lock);
+      if (--pool.pending == 0) {
+         pthread_cond_signal(&pool.done);
+      }
+   }
+   return NULL;
+}
+
+int threadPoolSize(void)
+{
+   int i;
+
+   if (pool.numThreads > 0) {
+      return pool.numThreads;
+   }
+
+   const char *env = getenv("OCL_HOST_THREADS");
+   int numThreads = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (numThreads < 1) {
+      numThreads = 1;
+   }
+   if (numThreads > MAX_POOL_THREADS) {
+      numThreads = MAX_POOL_THREADS;
+   }
+
+   /* The workers are detached and live until the process exits */
+   for (i = 1; i < numThreads; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, poolWorker, 
+             (void*)(intptr_t)i) != 0) {
+         numThreads = i;
+         break;
+      }
+      pthread_detach(thread);
+   }
+   pool.numThreads = numThreads;
+   return numThreads;
+}
+
+void parallelFor(size_t count, size_t grain, ParallelFunc func, void *arg)
+{
+   int numThreads = threadPoolSize();
+   size_t parts = grain ? count/grain : count;
+
+   pool.func = func;
+   pool.arg = arg;
+   pool.count = count;
+   pool.activeParts = parts < 1 ? 1 : 
+      (parts < (size_t)numThreads ? (int)parts : numThreads);
+
+   if (numThreads == 1) {
+      runPart(0);
+      return;
+   }
+
+   pthread_mutex_lock(&pool.lock);
+   pool.pending = numThreads - 1;
+   pool.generation++;
+   pthread_cond_broadcast(&pool.start);
+   pthread_mutex_unlock(&pool.lock);
+
+   runPart(0);
+
+   pthread_mutex_lock(&pool.lock);
+   while (pool.pending > 0) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+   }
+   pthread_mutex_unlock(&pool.lock);
+}
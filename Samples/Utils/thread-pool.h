@@ -0,0 +1,23 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <stddef.h>
+
+/* A process-wide pool of host threads for work such as the gold
+ * references. The pool has one thread per online CPU, or OCL_HOST_THREADS
+ * threads, and is started on first use. */
+
+/* The function run on each part of a range. 'part' is in
+ * [0, threadPoolSize()), and the parts cover [begin, end) contiguously in
+ * order of 'part'. */
+typedef void (*ParallelFunc)(void *arg, int part, size_t begin, size_t end);
+
+int threadPoolSize(void);
+
+/* Split [0, count) into threadPoolSize() contiguous parts, run 'func' on
+ * all of them (the calling thread takes part 0) and wait for them. Ranges
+ * shorter than 'grain' per part run on fewer threads; the remaining parts
+ * are called with empty ranges. Not reentrant. */
+void parallelFor(size_t count, size_t grain, ParallelFunc func, void *arg);
+
+#endif